@@ -27,9 +27,11 @@
 #define _UCCP420WLAN_CORE_H_
 
 #include <linux/atomic.h>
+#include <linux/completion.h>
 #include <linux/delay.h>
 #include <linux/dma-mapping.h>
 #include <linux/etherdevice.h>
+#include <linux/hrtimer.h>
 #include <linux/interrupt.h>
 #include <linux/jiffies.h>
 #include <linux/sched.h>
@@ -137,6 +139,14 @@ extern spinlock_t tsf_lock;
 
 
 #define MAX_OUTSTANDING_CTRL_REQ 2
+/* Upper bound for the cmd_window knob, the FW does not report how many
+ * control commands it can queue.
+ */
+#define MAX_CTRL_CMD_WINDOW 16
+#define UMAC_CMD_NUM (UMAC_CMD_TX_DEINIT + 1)
+#define UMAC_EVENT_NUM (UMAC_EVENT_TX_DEINIT_DONE + 1)
+/* Size classes of the preallocated control command buffers */
+#define CMD_POOL_CLASSES 3
 #define RESET_TIMEOUT 5000   /* In milli-seconds*/
 #define RESET_TIMEOUT_TICKS msecs_to_jiffies(RESET_TIMEOUT)
 /*100: For ROC, 500: For initial*/
@@ -145,6 +155,49 @@ extern spinlock_t tsf_lock;
 
 #define QUEUE_FLUSH_TIMEOUT  5000   /* Specify delay in milli-seconds*/
 #define QUEUE_FLUSH_TIMEOUT_TICKS   msecs_to_jiffies(QUEUE_FLUSH_TIMEOUT)
+/* Per-frame TX latency, binned in powers of two of microseconds */
+#define TX_LAT_HIST_BINS 20
+
+enum tx_lat_stage {
+	TX_LAT_QUEUE,	/* tx() to token assignment */
+	TX_LAT_HOST,	/* token assignment to hal_send */
+	TX_LAT_FW,	/* hal_send to TX_DONE */
+	TX_LAT_TOTAL,	/* tx() to TX_DONE */
+	TX_LAT_STAGES
+};
+
+/* Flush durations are binned in powers of two starting at 64us */
+#define TX_FLUSH_HIST_SHIFT 6
+#define TX_FLUSH_HIST_BINS 12
+
+/* FW acknowledgements waited on synchronously, their latencies are binned
+ * the same way as the flush durations.
+ */
+enum fw_wait_type {
+	FW_WAIT_SCAN_ABORT,
+	FW_WAIT_CANCEL_ROC,
+	FW_WAIT_CH_PROG,
+	FW_WAIT_TX_DEINIT,
+	FW_WAIT_RESET,
+	FW_WAIT_ECON_PS,
+	FW_WAIT_NUM
+};
+
+#define FW_WAIT_HIST_SHIFT 6
+#define FW_WAIT_HIST_BINS 12
+
+/* Channel operations finished from FW events, latency is taken from the
+ * mac80211 op (or the ROC end event) and binned like the FW waits.
+ */
+enum chan_op_type {
+	CHAN_OP_PROG,
+	CHAN_OP_ROC_START,
+	CHAN_OP_ROC_STOP,
+	CHAN_OP_NUM
+};
+
+/* Channel programming requests waiting for their CH_PROG_DONE */
+#define MAX_CHAN_PROG_PENDING 8
 
 #define TX_DEINIT_TIMEOUT 5000
 #define TX_DEINIT_TIMEOUT_TICKS msecs_to_jiffies(TX_DEINIT_TIMEOUT)
@@ -183,6 +236,14 @@ extern spinlock_t tsf_lock;
 #define TICK_NUMRATOR 12288 /* 12288 KHz  */
 #define TICK_DENOMINATOR 1000 /* 1000 KHz */
 
+/* Largest beacon handed to the firmware, bigger ones are sent by the host */
+#define MAX_BCN_TEMPLATE_LEN 1024
+/* TIM element minus the ID, length and DTIM count */
+#define MAX_BCN_TIM_LEN 253
+
+/* Airtime assumed per frame when releasing NoA held frames (in us) */
+#define NOA_FRAME_AIRTIME_US 200
+
 #define BTS_AP_24GHZ_ETS 195 /* Microsecs */
 #define BTS_AP_5GHZ_ETS 25 /* Microsecs */
 
@@ -311,6 +372,32 @@ struct wifi_params {
 	int init_prod;
 	unsigned char bypass_vpd;
 	unsigned int cont_tx;
+	unsigned int rate_cache;
+	unsigned int tx_status_batch;
+	/* Spare TX tokens an AC may hold while a higher AC is active */
+	unsigned int spare_credit[NUM_ACS];
+	unsigned int bcn_offload;
+	/* Production mode traffic generator */
+	unsigned int pkt_gen_descs;
+	unsigned int pkt_gen_acs;
+	unsigned int pkt_gen_aggr;
+	unsigned int pkt_gen_gap_us;
+	unsigned int prog_tx_two_phase;
+	unsigned int cmd_window;
+	unsigned int cmd_shadow;
+	unsigned int async_chan_prog;
+	unsigned int mcast_allmulti_thresh;
+	unsigned int key_cmd_prio;
+};
+
+/* Kept in skb->cb while a control command waits for the window, and in
+ * cmd_send_recv_cnt.in_flight once it is sent.
+ */
+struct ctrl_cmd_info {
+	unsigned int seq;
+	unsigned int id;
+	ktime_t queue_ts;
+	ktime_t send_ts;
 };
 
 struct cmd_send_recv_cnt {
@@ -321,6 +408,13 @@ struct cmd_send_recv_cnt {
 	unsigned long control_path_flags;
 	spinlock_t control_path_lock;
 	struct sk_buff_head outstanding_cmd;
+	/* PROC_DONE carries no command id, the FW completes the commands in
+	 * the order they were sent so the oldest one in flight is done.
+	 */
+	unsigned int cmd_seq;
+	unsigned int cmd_done_seq;
+	unsigned int cmd_in_flight;
+	struct ctrl_cmd_info in_flight[MAX_CTRL_CMD_WINDOW];
 };
 
 struct wifi_stats {
@@ -354,6 +448,34 @@ struct wifi_stats {
 	unsigned int tx_dones_to_stack;
 	unsigned int system_rev;
 	unsigned int outstanding_cmd_cnt;
+	/* Control command pipeline: peak in flight, commands that waited
+	 * for the window and for how long, round trip to PROC_DONE per id.
+	 */
+	unsigned int cmd_in_flight_max;
+	unsigned int cmd_queued_cnt;
+	unsigned long long cmd_queue_wait_us;
+	unsigned int cmd_queue_wait_max_us;
+	unsigned int cmd_rtt_cnt[UMAC_CMD_NUM];
+	unsigned long long cmd_rtt_us[UMAC_CMD_NUM];
+	unsigned int cmd_rtt_max_us[UMAC_CMD_NUM];
+	/* VIF_CFG changes merged into a batch and commands sent for them */
+	unsigned int vif_cfg_batched;
+	unsigned int vif_cfg_flushes;
+	/* FW events handled and the time spent in their handlers */
+	unsigned int event_cnt[UMAC_EVENT_NUM];
+	unsigned long long event_ns[UMAC_EVENT_NUM];
+	unsigned int event_max_ns[UMAC_EVENT_NUM];
+	unsigned int event_unknown;
+	/* Commands dropped as the FW already had the values */
+	unsigned int cmd_suppressed[UMAC_CMD_NUM];
+	/* Command buffers taken from each pool and allocated outside it */
+	unsigned int cmd_pool_used[CMD_POOL_CLASSES];
+	unsigned int cmd_pool_miss;
+	/* Multicast addresses sent, left in the FW and lists given up on */
+	unsigned int mcast_addr_add;
+	unsigned int mcast_addr_del;
+	unsigned int mcast_addr_kept;
+	unsigned int mcast_allmulti;
 	unsigned int pending_tx_cnt;
 	unsigned int umac_scan_req;
 	unsigned int umac_scan_complete;
@@ -367,6 +489,67 @@ struct wifi_stats {
 
 	unsigned int tx_cmd_send_count_beaconq;
 	unsigned int tx_done_recv_count;
+
+	unsigned int rate_cache_hits;
+	unsigned int rate_cache_misses;
+#ifdef PERF_PROFILING
+	/* Time spent in get_rate (ns) */
+	unsigned long long rate_cache_hit_ns;
+	unsigned long long rate_cache_miss_ns;
+#endif
+	unsigned int tx_status_ampdu_cnt;
+	unsigned int tx_status_fast_free;
+#ifdef PERF_PROFILING
+	/* Time spent reporting TX status to mac80211 (ns) */
+	unsigned int tx_status_mpdu_cnt;
+	unsigned long long tx_status_ns;
+#endif
+	/* Spare TX tokens taken beyond the credit, handed to a higher AC on
+	 * TX_DONE and refused because a higher AC was active.
+	 */
+	unsigned int spare_borrow[NUM_ACS];
+	unsigned int spare_reclaim[NUM_ACS];
+	unsigned int spare_denied[NUM_ACS];
+	unsigned int bcn_host_tx;
+	unsigned int bcn_tmpl_uploads;
+	/* DTIM broadcast bursts and the descriptors/frames they used */
+	unsigned int bcast_bursts;
+	unsigned int bcast_burst_descs;
+	unsigned int bcast_burst_frames;
+	unsigned int noa_release_batches;
+	unsigned int noa_release_frames;
+	unsigned int tx_flush_hist[TX_FLUSH_HIST_BINS];
+	unsigned int tx_flush_timeouts;
+	unsigned int fw_wait_hist[FW_WAIT_NUM][FW_WAIT_HIST_BINS];
+	unsigned int fw_wait_timeouts[FW_WAIT_NUM];
+	unsigned int chan_op_hist[CHAN_OP_NUM][FW_WAIT_HIST_BINS];
+	/* Key commands from being queued to their PROC_DONE, and the queued
+	 * commands they went ahead of.
+	 */
+	unsigned int key_ack_hist[FW_WAIT_HIST_BINS];
+	unsigned int key_cmd_passed;
+	unsigned int chan_prog_timeouts;
+	/* Channel commands sent, skipped as the FW was already on the
+	 * channel, and sent from the command cached in a channel context.
+	 */
+	unsigned int chan_prog_sent;
+	unsigned int chan_prog_skipped;
+	unsigned int chan_prog_cached;
+	/* Channel switches, descriptors resent from the ready lists and
+	 * time from the switch event to the first TX programmed.
+	 */
+	unsigned int chsw_events;
+	unsigned int chsw_ready_descs;
+	unsigned int chsw_first_tx_cnt;
+	unsigned long long chsw_first_tx_us;
+	unsigned int chsw_first_tx_max_us;
+	/* tx->lock hold time in uccp420wlan_prog_tx */
+	unsigned int tx_lock_hold_cnt;
+	unsigned long long tx_lock_hold_ns;
+	unsigned long long tx_lock_hold_max_ns;
+	unsigned int tx_lat_ac[NUM_ACS][TX_LAT_STAGES][TX_LAT_HIST_BINS];
+	unsigned int tx_lat_peer[MAX_PEND_Q_PER_AC][TX_LAT_STAGES]
+				[TX_LAT_HIST_BINS];
 	unsigned int rx_packet_mgmt_count;
 	unsigned int rx_packet_data_count;
 	unsigned int ed_cnt;
@@ -518,8 +701,18 @@ struct wifi_stats {
 };
 
 
+/* Two-phase uccp420wlan_prog_tx: the frames of a descriptor being built are
+ * off pkt, a discard or deinit meanwhile cancels the descriptor instead.
+ */
+enum tx_desc_build {
+	TX_DESC_IDLE,
+	TX_DESC_BUILDING,
+	TX_DESC_CANCELLED
+};
+
 struct tx_pkt_info {
 	struct sk_buff_head pkt;
+	enum tx_desc_build build;
 	unsigned int hdr_len;
 	unsigned int queue;
 	unsigned int vif_index;
@@ -530,6 +723,43 @@ struct tx_pkt_info {
 	int roc_peer_id;
 	int peer_id;
 	bool adjusted_rates;
+	/* Token assignment and hal_send of the frames in pkt */
+	ktime_t token_ts;
+	ktime_t send_ts;
+};
+
+
+/* Rate fields of UMAC_CMD_TX as compiled by get_rate, so that they can be
+ * replayed for the following frames of the same peer.
+ */
+struct umac_rate_tbl {
+	unsigned char num_rates;
+	unsigned char rate_protection_type[4];
+	unsigned char rate_preamble_type[4];
+	unsigned char rate_retries[4];
+	unsigned char rate[4];
+	unsigned char rate_flags[4];
+	unsigned char num_spatial_streams[4];
+	unsigned char stbc_enabled;
+	unsigned char bcc_or_ldpc;
+	unsigned char aggregate_mpdu;
+	/* Rates for which RTS depends on the frame length */
+	unsigned char len_prot_map;
+	unsigned char num_mcs_stats;
+	unsigned char mcs_stat_rate[4];
+	unsigned char mcs_stat_flags[4];
+	bool upd_max_retries;
+	unsigned int max_retries;
+};
+
+struct umac_rate_cache {
+	bool valid;
+	unsigned int gen;
+	unsigned int frm_type;
+	unsigned int ctl_flags;
+	unsigned int band;
+	struct ieee80211_tx_rate rates[IEEE80211_TX_MAX_RATES];
+	struct umac_rate_tbl tbl;
 };
 
 
@@ -540,11 +770,26 @@ struct tx_config {
 #ifdef PERF_PROFILING
 	 struct timer_list persec_timer;
 #endif
+	/* TX descriptor pool layout, fixed at load time: reserved tokens
+	 * are interleaved per AC (token % NUM_ACS), spare ones follow them.
+	 */
+	unsigned int num_descs_per_ac;
+	unsigned int num_spare_descs;
+	unsigned int num_descs;
+
 	/* Used to store tx tokens(buff pool ids) */
-	unsigned long buf_pool_bmp[(NUM_TX_DESCS/TX_DESC_BUCKET_BOUND) + 1];
+	unsigned long *buf_pool_bmp;
 
 	unsigned int outstanding_tokens[NUM_ACS];
+	/* Spare tokens currently held by each AC */
+	unsigned int spare_tokens[NUM_ACS];
+	/* ACs refused a spare token since they last got one */
+	unsigned long spare_denied_bmp;
 	unsigned int next_spare_token_ac;
+	/* Flushes sleep here until the tokens or pending frames they wait
+	 * for are gone, see tx_flush_wake.
+	 */
+	wait_queue_head_t flush_wq;
 
 	/* Used to store the address of pending skbs per ac */
 #ifdef MULTI_CHAN_SUPPORT
@@ -567,17 +812,65 @@ struct tx_config {
 	 * it will be used in tx complete.
 	 */
 #ifdef MULTI_CHAN_SUPPORT
-	int desc_chan_map[NUM_TX_DESCS];
-	struct tx_pkt_info pkt_info[MAX_CHANCTX + MAX_OFF_CHANCTX]
-				   [NUM_TX_DESCS];
+	int *desc_chan_map;
+	struct tx_pkt_info *pkt_info[MAX_CHANCTX + MAX_OFF_CHANCTX];
+
+	/* Descriptors still holding frames the FW discarded on a channel
+	 * switch, resent as they are when their context is resumed.
+	 */
+	unsigned long ready_bmp[MAX_CHANCTX + MAX_OFF_CHANCTX];
+	ktime_t chsw_start;
+	int chsw_pending;
 #else
-	struct tx_pkt_info pkt_info[NUM_TX_DESCS];
+	struct tx_pkt_info *pkt_info;
 #endif
 
 	unsigned int queue_stopped_bmp;
-	struct sk_buff_head proc_tx_list[NUM_TX_DESCS];
+	struct sk_buff_head *proc_tx_list;
+
+	/* Compiled rates per peer (and per VIF for bcast/mcast), a change
+	 * in rate_cache_gen invalidates all of them.
+	 */
+	struct umac_rate_cache rate_cache[MAX_PEND_Q_PER_AC];
+	unsigned int rate_cache_gen;
 };
 
+/* Production mode traffic generator: the frames of each descriptor are built
+ * once and resent from proc_tx_list as soon as their TX_DONE comes back.
+ */
+#define PKT_GEN_HDR_LEN 26
+
+struct pkt_gen {
+	/* Used to protect the generator state */
+	spinlock_t lock;
+	bool running;
+	/* Descriptors whose frames are back and can be resent */
+	unsigned long ready_bmp;
+	unsigned int in_flight;
+	/* Frames still to be sent, -1 for an endless run */
+	int remaining;
+	ktime_t start;
+	ktime_t end;
+	ktime_t last_send;
+	unsigned long long frames;
+	unsigned long long bytes;
+	struct hrtimer gap_timer;
+};
+
+/* Why the driver stopped a mac80211 queue, a queue is only woken once all
+ * of its reasons are gone.
+ */
+enum queue_stop_reason {
+	QUEUE_STOP_TX_FULL,
+	QUEUE_STOP_CHAN_PROG,
+	QUEUE_STOP_ROC,
+	QUEUE_STOP_ROC_DONE,
+	QUEUE_STOP_FLUSH,
+	QUEUE_STOP_DEINIT,
+};
+
+#define ALL_HW_QUEUES (BIT(IEEE80211_NUM_ACS) - 1)
+
 enum device_state {
 	STOPPED = 0,
 	STARTED
@@ -600,7 +893,7 @@ struct sta_tid_info {
 
 #ifdef CONFIG_PM
 struct econ_ps_cfg_status {
-	unsigned char completed;
+	struct completion completed;
 	unsigned char result;
 	int wake_trig;
 };
@@ -619,6 +912,29 @@ struct roc_params {
 	unsigned int roc_type;
 	bool need_offchan;
 	atomic_t roc_mgmt_tx_count;
+	/* Request accepted by remain_on_channel and not yet sent to the FW
+	 * by uccp420_roc_start_work.
+	 */
+	bool roc_starting;
+	bool roc_abort;
+	unsigned int start_chan;
+	unsigned int start_duration;
+	unsigned int start_type;
+	struct umac_vif *start_uvif;
+	int start_chanctx_idx;
+	struct umac_chanctx *start_off_chanctx;
+	ktime_t start_ts;
+	ktime_t stop_ts;
+};
+
+/* Follow up of a channel programming request, run on its CH_PROG_DONE */
+struct chan_prog_req {
+	int vif_index;
+	unsigned char vif_addr[ETH_ALEN];
+	bool op_chan;
+	bool radar_start;
+	unsigned int pri_chan;
+	ktime_t start;
 };
 
 struct mac80211_dev {
@@ -630,12 +946,18 @@ struct mac80211_dev {
 	struct mutex mutex;
 	int state;
 	int txpower;
-	unsigned char mc_filters[MCST_ADDR_LIMIT][6];
-	int mc_filter_count;
 
 	struct tasklet_struct proc_tx_tasklet;
+	struct pkt_gen pkt_gen;
 	/*ROC Work*/
 	struct delayed_work roc_complete_work;
+	struct work_struct roc_start_work;
+	/* FIFO of channel programming requests, the FW acks them in order */
+	struct chan_prog_req chan_prog_q[MAX_CHAN_PROG_PENDING];
+	unsigned int chan_prog_head;
+	unsigned int chan_prog_tail;
+	spinlock_t chan_prog_lock;
+	struct delayed_work chan_prog_timeout_work;
 	struct roc_params roc_params;
 	struct current_channel cur_chan;
 	struct tx_config tx;
@@ -649,12 +971,15 @@ struct mac80211_dev {
 	struct wifi_params *params;
 	struct wifi_stats  *stats;
 	char name[20];
-	char scan_abort_done;
-	char cancel_hw_roc_done;
+	struct completion scan_abort_done;
+	struct completion cancel_hw_roc_done;
 	char cancel_roc;
-	char chan_prog_done;
-	char reset_complete;
-	char tx_deinit_complete;
+	struct completion chan_prog_done;
+	/* Protects queue_stop_reasons */
+	spinlock_t queue_stop_lock;
+	unsigned long queue_stop_reasons[IEEE80211_NUM_ACS];
+	struct completion reset_complete;
+	struct completion tx_deinit_complete;
 	int power_save; /* Will be set only when a single VIF in
 			 * STA mode is active
 			 */
@@ -703,6 +1028,18 @@ struct umac_vif {
 	unsigned int noa_active;
 	struct sk_buff_head noa_que;
 	unsigned int noa_tx_allowed;
+	/* Expected end of the current presence period */
+	ktime_t noa_presence_end;
+
+	/* Beacon offload: template owned by the firmware and the TIM it was
+	 * uploaded with.
+	 */
+	bool bcn_offloaded;
+	bool bcn_tmpl_dirty;
+	/* Buffered broadcast traffic, the host sends the beacons meanwhile */
+	bool bcn_bc_host;
+	unsigned int bcn_tim_len;
+	unsigned char bcn_tim[MAX_BCN_TIM_LEN];
 
 	int vif_index;
 	struct ieee80211_vif *vif;
@@ -731,6 +1068,8 @@ struct umac_sta {
 #ifdef MULTI_CHAN_SUPPORT
 struct umac_chanctx {
 	int index;
+	/* Built from the chandef when the context is added or changed */
+	struct umac_chan_cmd chan_cmd;
 
 	struct list_head vifs;
 	short nvifs;
@@ -753,6 +1092,30 @@ extern int wait_for_scan_abort(struct mac80211_dev *dev);
 extern int wait_for_channel_prog_complete(struct mac80211_dev *dev);
 extern int wait_for_tx_queue_flush_complete(struct mac80211_dev *dev,
 					    unsigned int token);
+extern void tx_flush_hist_update(struct mac80211_dev *dev, ktime_t start);
+extern s64 wait_for_fw_event(struct mac80211_dev *dev,
+			     struct completion *done,
+			     unsigned long timeout,
+			     enum fw_wait_type type);
+extern void key_ack_hist_update(struct mac80211_dev *dev,
+				ktime_t start);
+extern void chan_op_hist_update(struct mac80211_dev *dev,
+				enum chan_op_type type,
+				ktime_t start);
+extern bool uccp420wlan_channel_active(struct mac80211_dev *dev,
+				       const struct umac_chan_cmd *cmd,
+				       unsigned int vif_index);
+extern int uccp420wlan_prog_channel_cmd(struct mac80211_dev *dev,
+					const struct umac_chan_cmd *cmd,
+					unsigned int vif_index,
+					bool wait);
+extern int uccp420wlan_set_channel(struct mac80211_dev *dev,
+				   const struct umac_chan_cmd *cmd,
+				   unsigned int vif_index,
+				   unsigned char *op_chan_addr,
+				   bool radar_start);
+extern void uccp420wlan_chan_prog_flush(struct mac80211_dev *dev);
+extern void uccp420wlan_chan_prog_timeout_work(struct work_struct *work);
 int wait_for_tx_deinit_complete(struct mac80211_dev *dev);
 extern int uccp420wlan_prog_nw_selection(unsigned int nw_select_enabled,
 					 unsigned char *mac_addr);
@@ -774,6 +1137,17 @@ extern int  uccp420wlan_tx_frame(struct sk_buff *skb,
 				 int curr_chanctx_idx,
 #endif
 				 bool bcast);
+extern void uccp420wlan_tx_noa_release(struct mac80211_dev *dev,
+#ifdef MULTI_CHAN_SUPPORT
+				       int curr_chanctx_idx,
+#endif
+				       struct sk_buff_head *frames);
+extern void uccp420wlan_tx_bcast_burst(struct mac80211_dev *dev,
+				       struct umac_vif *uvif,
+#ifdef MULTI_CHAN_SUPPORT
+				       int curr_chanctx_idx,
+#endif
+				       struct sk_buff_head *frames);
 extern int __uccp420wlan_tx_frame(struct mac80211_dev *dev,
 				  unsigned int queue,
 				  unsigned int token_id,
@@ -782,12 +1156,29 @@ extern int __uccp420wlan_tx_frame(struct mac80211_dev *dev,
 #endif
 				  unsigned int more_frames,
 				  bool retry);
+extern int uccp420wlan_tx_alloc(struct mac80211_dev *dev,
+				unsigned int num_descs_per_ac,
+				unsigned int num_spare_descs);
+extern void uccp420wlan_tx_free(struct mac80211_dev *dev);
 extern void uccp420wlan_tx_init(struct mac80211_dev *dev);
 extern void uccp420wlan_tx_deinit(struct mac80211_dev *dev);
-void uccp420wlan_tx_proc_send_pend_frms_all(struct mac80211_dev *dev,
-					   int chan_id);
+extern void uccp420wlan_stop_queues(struct mac80211_dev *dev,
+				    unsigned long queues,
+				    enum queue_stop_reason reason);
+extern void uccp420wlan_wake_queues(struct mac80211_dev *dev,
+				    unsigned long queues,
+				    enum queue_stop_reason reason);
+unsigned int uccp420wlan_tx_proc_send_pend_frms_all(struct mac80211_dev *dev,
+						    int chan_id);
 extern void proc_bss_info_changed(unsigned char *mac_addr, int value);
 extern void packet_generation(unsigned long data);
+extern void pkt_gen_init(struct mac80211_dev *dev);
+extern void pkt_gen_reset(struct mac80211_dev *dev);
+extern int pkt_gen_start(struct mac80211_dev *dev, int count);
+extern void pkt_gen_stop(struct mac80211_dev *dev);
+extern void pkt_gen_rate(struct mac80211_dev *dev,
+			 unsigned long long *fps,
+			 unsigned long long *kbps);
 extern int wait_for_reset_complete(struct mac80211_dev *dev);
 
 extern int uccp420wlan_tx_proc_pend_frms(struct mac80211_dev *dev,
@@ -800,6 +1191,8 @@ void free_token(struct mac80211_dev *dev,
 		int token_id,
 		int queue);
 
+void uccp420wlan_rate_cache_flush(struct mac80211_dev *dev);
+
 struct curr_peer_info get_curr_peer_opp(struct mac80211_dev *dev,
 #ifdef MULTI_CHAN_SUPPORT
 		      int curr_chanctx_idx,
@@ -1060,4 +1453,38 @@ static inline bool is_bufferable_mgmt_frame(struct ieee80211_hdr *hdr)
 
 	return false;
 }
+
+/* Per-frame TX metadata, computed once when the frame enters the driver so
+ * that uccp420wlan_prog_tx only reads it under tx->lock. It is kept in the
+ * bytes of skb->cb from control.flags on, which mac80211 no longer reads once
+ * it has handed the frame to the driver.
+ */
+struct umac_tx_meta {
+	/* 802.11 header + IV + beacon/probe response timestamp */
+	unsigned char hdr_len;
+	signed char vif_index;
+	unsigned char encrypt;
+	/* enq_us is set, i.e. the frame came in through tx() */
+	unsigned char enq_stamped;
+	/* Start of the TX latency stages (us, wraps), see tx_lat_account */
+	u32 enq_us;
+};
+
+static inline struct umac_tx_meta *umac_tx_meta(struct sk_buff *skb)
+{
+	struct ieee80211_tx_info *tx_info = IEEE80211_SKB_CB(skb);
+
+	BUILD_BUG_ON(offsetof(struct ieee80211_tx_info, control.flags) +
+		     sizeof(struct umac_tx_meta) > sizeof(skb->cb));
+
+	return (struct umac_tx_meta *)(&tx_info->control.flags);
+}
+
+/* Frames mac80211 hands over outside tx() (beacons, buffered broadcast)
+ * carry whatever it left in skb->cb, they have no enqueue stamp.
+ */
+static inline void umac_tx_meta_no_stamp(struct sk_buff *skb)
+{
+	umac_tx_meta(skb)->enq_stamped = 0;
+}
 #endif /* _UCCP420WLAN_CORE_H_ */
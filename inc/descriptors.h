@@ -28,15 +28,19 @@
 
 #define NUM_ACS			5
 
-#define NUM_TX_DESCS_PER_AC	2	/* reserved TX descriptors per AC
-					 * (must be multiple of 2, minimum of 2
-					 * and maximum of 4)
-					 */
-#define NUM_SPARE_TX_DESCS	2	/* Descriptors shared between ACs
-					 * (at least 1 and maximum of 2)
-					 */
-
-#define NUM_TX_DESCS    ((NUM_ACS *  NUM_TX_DESCS_PER_AC) + NUM_SPARE_TX_DESCS)
+/* Defaults for the TX descriptor pool, the actual layout is chosen at load
+ * time (num_tx_descs_per_ac, num_spare_tx_descs) and has to fit in the GRAM
+ * TX data area (HAL_MAX_TX_DESC descriptors).
+ */
+#define DEFAULT_TX_DESCS_PER_AC	2	/* reserved TX descriptors per AC */
+#define DEFAULT_SPARE_TX_DESCS	2	/* Descriptors shared between ACs */
+
+/* Limits of the module parameters, per AC counts have to be even */
+#define MIN_TX_DESCS_PER_AC	2
+#define MAX_TX_DESCS_PER_AC	4
+#define MIN_SPARE_TX_DESCS	1
+#define MAX_SPARE_TX_DESCS	2
+
 /* Max size of a sub-frame in an AMPDU */
 #define MAX_AMPDU_SUBFRAME_SIZE 1500
 
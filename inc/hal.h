@@ -37,10 +37,11 @@
 #define MAX_DATA_SIZE_8K (8 * 1024)
 #define MAX_DATA_SIZE_2K (2 * 1024)
 
-#define NUM_TX_DESC 12
 #define NUM_FRAMES_IN_TX_DESC 32
 #define NUM_BYTES_PER_FRAME 9
 #define TX_DESC_HAL_SIZE (NUM_FRAMES_IN_TX_DESC * NUM_BYTES_PER_FRAME)
+/* Number of TX descriptors the GRAM TX data area can hold */
+#define HAL_MAX_TX_DESC (HAL_SHARED_MEM_MAX_TX_SIZE / TX_DESC_HAL_SIZE)
 
 #define HAL_PRIV_DATA_SIZE 8
 
@@ -65,6 +66,12 @@
 #define HAL_GRAM_TX_DATA_ADDR (HAL_GRAM_TX_DATA_START + 6)
 
 #define HAL_HOST_BOUNCE_BUF_LEN (4 * 1024 * 1024)
+
+/* TX copy avoidance: max frame length moved to the DMA zone at enqueue and
+ * number of frames to skip after a failed attempt.
+ */
+#define HAL_TX_REHOME_MAX_LEN 1600
+#define HAL_TX_REHOME_BACKOFF 256
 #define HAL_HOST_NON_BOUNCE_BUF_LEN (60 * 1024 * 1024)
 
 /*RPU DUMP Regions and Commands*/
@@ -145,6 +152,7 @@ struct hal_ops_tag {
 			 unsigned int);
 	void (*deinit_bufs)(void);
 	int (*map_tx_buf)(int, int, unsigned char *, int);
+	void (*rehome_tx_skb)(struct sk_buff *);
 	int (*unmap_tx_buf)(int, int);
 	int (*reset_hal_params)(void);
 	void (*set_mem_region)(unsigned int);
@@ -44,6 +44,15 @@ struct umac_key {
 	unsigned char *key;
 };
 
+/* A UMAC_CMD_CHANNEL with the VIF left to fill in when it is sent, and
+ * the channel it is for after the production mode offsets.
+ */
+struct umac_chan_cmd {
+	struct cmd_channel channel;
+	unsigned int center_freq1;
+	unsigned int ch_width;
+};
+
 struct ssid_desc {
 	unsigned char ssid[MAX_SSID_LEN];
 	unsigned char ssid_len;
@@ -83,7 +92,8 @@ extern int uccp420wlan_scan(int index,
 
 extern int uccp420wlan_scan_abort(int index);
 
-extern int uccp420wlan_proc_tx(void);
+extern int uccp420wlan_proc_tx(unsigned int descriptor_id,
+			       unsigned int queue);
 
 extern int uccp420wlan_prog_tx(unsigned int queue,
 			       unsigned int more_data,
@@ -110,6 +120,10 @@ extern int uccp420wlan_prog_vif_ctrl(int index,
 				     unsigned int  vif_type,
 				     unsigned int  add_vif);
 
+extern void uccp420wlan_vif_cfg_begin(int index);
+
+extern int uccp420wlan_vif_cfg_end(int index);
+
 extern int uccp420wlan_prog_vif_basic_rates(int index,
 					    unsigned char *vif_addr,
 					    unsigned int basic_rate_set);
@@ -142,6 +156,14 @@ extern int uccp420wlan_prog_vif_beacon_int(int index,
 					   unsigned char *vif_addr,
 					   unsigned int bcn_int);
 
+extern int uccp420wlan_prog_vif_beacon(int index,
+				       unsigned char *vif_addr,
+				       unsigned int bcn_int,
+				       unsigned int dtim_period,
+				       unsigned int channel,
+				       unsigned char *bcn_buf,
+				       unsigned int len);
+
 extern int uccp420wlan_prog_vif_dtim_period(int index,
 					    unsigned char *vif_addr,
 					    unsigned int dtim_period);
@@ -180,8 +202,8 @@ extern int uccp420wlan_prog_txpower(unsigned int txpower);
 
 extern int uccp420wlan_prog_btinfo(unsigned int bt_state);
 
-extern int uccp420wlan_prog_mcast_addr_cfg(unsigned char  *mcast_addr,
-					   unsigned int add_filter);
+extern int uccp420wlan_prog_mcast_list(unsigned char (*addr)[ETH_ALEN],
+				       int count);
 
 extern int uccp420wlan_prog_mcast_filter_control(unsigned int
 						 enable_mcast_filtering);
@@ -207,6 +229,15 @@ extern int uccp420wlan_prog_channel(unsigned int prim_ch,
 #endif
 				    unsigned int freq_band);
 
+extern int uccp420wlan_build_channel(struct umac_chan_cmd *cmd,
+				     unsigned int prim_ch,
+				     unsigned int center_freq1,
+				     unsigned int center_freq2,
+				     unsigned int ch_width,
+				     unsigned int freq_band);
+
+extern void uccp420wlan_channel_forget(unsigned int vif_index);
+
 extern int uccp420wlan_prog_peer_key(int index,
 				     unsigned char *vif_addr,
 				     unsigned int op,
@@ -251,6 +282,8 @@ extern int uccp420wlan_prog_econ_ps_state(int if_index,
 #endif
 
 /* Events  */
+extern const char *uccp420wlan_event_name(unsigned int event);
+
 extern void uccp420wlan_scan_complete(void *context,
 				      struct host_event_scanres *scan_res,
 				      unsigned char *skb,
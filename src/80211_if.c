@@ -68,6 +68,14 @@ static unsigned int ftm;
 module_param(ftm, int, 0);
 MODULE_PARM_DESC(ftm, "Factory Test Mode, should be used only for calibrations.");
 
+static unsigned int num_tx_descs_per_ac = DEFAULT_TX_DESCS_PER_AC;
+module_param(num_tx_descs_per_ac, uint, 0);
+MODULE_PARM_DESC(num_tx_descs_per_ac, "Number of TX descriptors reserved per AC (2 or 4)");
+
+static unsigned int num_spare_tx_descs = DEFAULT_SPARE_TX_DESCS;
+module_param(num_spare_tx_descs, uint, 0);
+MODULE_PARM_DESC(num_spare_tx_descs, "Number of TX descriptors shared between ACs (1 to 2)");
+
 unsigned int system_rev = 0x494D47; /*ASCII: IMG*/
 
 int uccp_debug = UCCP_DEBUG_80211IF + UCCP_DEBUG_CRYPTO + UCCP_DEBUG_CORE;
@@ -75,6 +83,7 @@ int uccp_debug = UCCP_DEBUG_80211IF + UCCP_DEBUG_CRYPTO + UCCP_DEBUG_CORE;
 module_param(uccp_debug, uint, 0);
 MODULE_PARM_DESC(uccp_debug, " uccp_debug: Configure Debugging Mask");
 static void uccp420_roc_complete_work(struct work_struct *work);
+static void uccp420_roc_start_work(struct work_struct *work);
 static void uccp420wlan_exit(void);
 static int load_fw(struct ieee80211_hw *hw);
 static char *uccp420_get_vif_name(int vif_idx);
@@ -341,6 +350,8 @@ static void uccp420_roc_complete_work(struct work_struct *work)
 	struct tx_config *tx = NULL;
 	u32 roc_queue = 0;
 #ifdef MULTI_CHAN_SUPPORT
+	struct umac_vif *flush_vifs[MAX_VIFS];
+	int nflush = 0, i = 0;
 	bool need_offchan;
 	int roc_off_chanctx_idx = -1;
 	int chan_id = 0;
@@ -353,7 +364,9 @@ static void uccp420_roc_complete_work(struct work_struct *work)
 	if (dev->roc_params.roc_in_progress == 0)
 		return;
 
-	mutex_lock(&dev->mutex);
+	/* The ROC state only changes here while roc_in_progress is set, so
+	 * the TX drop (a FW round trip) is done before taking dev->mutex.
+	 */
 #ifdef MULTI_CHAN_SUPPORT
 	need_offchan = dev->roc_params.need_offchan;
 #endif
@@ -364,7 +377,7 @@ static void uccp420_roc_complete_work(struct work_struct *work)
 #endif
 
 	/* Stop the ROC queue */
-	ieee80211_stop_queue(dev->hw, roc_queue);
+	uccp420wlan_stop_queues(dev, BIT(roc_queue), QUEUE_STOP_ROC_DONE);
 	/* Unlock RCU immediately as we are freeing off_chanctx in this funciton
 	 * only and because flush_vif_queues sleep
 	 */
@@ -375,17 +388,36 @@ static void uccp420_roc_complete_work(struct work_struct *work)
 	rcu_read_unlock();
 
 #ifdef MULTI_CHAN_SUPPORT
-	list_for_each_entry_safe(uvif, tmp, &off_chanctx->vifs, list) {
+	/* The list changes under dev->mutex, flush from a snapshot of it */
+	mutex_lock(&dev->mutex);
+
+	list_for_each_entry(uvif, &off_chanctx->vifs, list) {
 		if (uvif == NULL || uvif->off_chanctx  == NULL)
 			continue;
+
+		if (nflush < MAX_VIFS)
+			flush_vifs[nflush++] = uvif;
+	}
+
+	mutex_unlock(&dev->mutex);
+
+	for (i = 0; i < nflush; i++) {
 		/* Flush the TX queues */
 		uccp420_flush_vif_queues(dev,
-					 uvif,
-					 uvif->off_chanctx->index,
+					 flush_vifs[i],
+					 off_chanctx->index,
 					 BIT(UMAC_ROC_AC),
 					 UMAC_VIF_CHANCTX_TYPE_OFF,
 					 TX_DROP);
+	}
+#endif
+
+	mutex_lock(&dev->mutex);
 
+#ifdef MULTI_CHAN_SUPPORT
+	list_for_each_entry_safe(uvif, tmp, &off_chanctx->vifs, list) {
+		if (uvif == NULL || uvif->off_chanctx  == NULL)
+			continue;
 
 		spin_lock_bh(&tx->lock);
 		spin_lock(&dev->chanctx_lock);
@@ -426,10 +458,6 @@ static void uccp420_roc_complete_work(struct work_struct *work)
 		uvif->off_chanctx = NULL;
 	}
 
-	if (need_offchan)
-		kfree(off_chanctx);
-
-
 	rcu_assign_pointer(dev->off_chanctx[roc_off_chanctx_idx], NULL);
 	dev->roc_off_chanctx_idx = -1;
 #endif
@@ -439,14 +467,23 @@ static void uccp420_roc_complete_work(struct work_struct *work)
 		ieee80211_remain_on_channel_expired(dev->hw);
 		UCCP_DEBUG_ROC("%s:%d ROC STOPPED..\n", __func__, __LINE__);
 	} else {
-		dev->cancel_hw_roc_done = 1;
+		complete(&dev->cancel_hw_roc_done);
 		dev->cancel_roc = 0;
 		UCCP_DEBUG_ROC("%s:%d ROC CANCELLED..\n", __func__, __LINE__);
 	}
 
 	/* Start the ROC queue */
-	ieee80211_wake_queue(dev->hw, roc_queue);
+	uccp420wlan_wake_queues(dev, BIT(roc_queue), QUEUE_STOP_ROC_DONE);
 	mutex_unlock(&dev->mutex);
+
+#ifdef MULTI_CHAN_SUPPORT
+	/* Unpublished above, free it once no reader can hold it */
+	if (need_offchan) {
+		synchronize_rcu();
+		kfree(off_chanctx);
+	}
+#endif
+	chan_op_hist_update(dev, CHAN_OP_ROC_STOP, dev->roc_params.stop_ts);
 }
 
 
@@ -457,6 +494,7 @@ static void tx(struct ieee80211_hw *hw,
 	struct mac80211_dev *dev = hw->priv;
 	struct ieee80211_hdr *hdr = (struct ieee80211_hdr *) skb->data;
 	struct ieee80211_tx_info *tx_info = IEEE80211_SKB_CB(skb);
+	struct umac_tx_meta *meta;
 	struct umac_vif *uvif;
 	unsigned char null_bssid[6] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 	struct iphdr *iphdr;
@@ -504,6 +542,15 @@ static void tx(struct ieee80211_hw *hw,
 	if (ether_addr_equal(hdr->addr3, null_bssid))
 		goto tx_status;
 
+	/* May move the frame data to the DMA zone */
+	hal_ops.rehome_tx_skb(skb);
+	hdr = (struct ieee80211_hdr *)skb->data;
+
+	/* Start of the TX latency stages, see tx_lat_account */
+	meta = umac_tx_meta(skb);
+	meta->enq_us = (u32)ktime_to_us(ktime_get());
+	meta->enq_stamped = 1;
+
 	if (uvif->vif->type != NL80211_IFTYPE_AP) {
 		if ((dev->power_save == PWRSAVE_STATE_DOZE) &&
 		    (((hdr->frame_control &
@@ -572,6 +619,27 @@ static void stop(struct ieee80211_hw *hw)
 	struct mac80211_dev    *dev = (struct mac80211_dev *)hw->priv;
 
 	UCCP_DEBUG_80211IF("%s-80211IF:In stop\n", dev->name);
+
+	/* Takes dev->mutex itself */
+	cancel_work_sync(&dev->roc_start_work);
+
+	/* Cancelled before it ran, undo what remain_on_channel set up */
+	if (dev->roc_params.roc_starting) {
+		dev->roc_params.roc_starting = false;
+#ifdef MULTI_CHAN_SUPPORT
+		if (dev->roc_params.need_offchan) {
+			kfree(dev->roc_params.start_off_chanctx);
+
+			if (dev->roc_params.start_chanctx_idx >= 0)
+				uccp420wlan_wake_queues(dev,
+							ALL_HW_QUEUES,
+							QUEUE_STOP_ROC);
+		}
+
+		dev->roc_params.start_off_chanctx = NULL;
+#endif
+	}
+
 	mutex_lock(&dev->mutex);
 	uccp420wlan_core_deinit(dev, ftm);
 	dev->state = STOPPED;
@@ -684,6 +752,7 @@ static int config(struct ieee80211_hw *hw,
 	unsigned int center_freq = 0;
 	unsigned int center_freq1 = 0;
 	unsigned int center_freq2 = 0;
+	struct umac_chan_cmd chan_cmd;
 	int i = 0;
 	int err = 0;
 	struct ieee80211_vif *vif = NULL;
@@ -711,26 +780,25 @@ static int config(struct ieee80211_hw *hw,
 				   dev->name,
 				   pri_chnl_num);
 
-		err = uccp420wlan_prog_channel(pri_chnl_num,
-					       center_freq1, center_freq2,
-					       ch_width,
-#ifdef MULTI_CHAN_SUPPORT
-					       0,
-#endif
-					       freq_band);
-
-		if (err) {
-			mutex_unlock(&dev->mutex);
-			return err;
-		}
 		if (conf->radar_enabled) {
 			UCCP_DEBUG_80211IF("RADAR Detection ENABLED on ");
 			UCCP_DEBUG_80211IF("PriChannel=%d with ch_width=%d\n",
 					   pri_chnl_num,
 					   ch_width);
+		}
 
-			CALL_UMAC(uccp420wlan_prog_radar_detect,
-				  RADAR_DETECT_OP_START);
+		err = uccp420wlan_build_channel(&chan_cmd, pri_chnl_num,
+						center_freq1, center_freq2,
+						ch_width, freq_band);
+
+		/* Radar detection starts once the FW is on the channel */
+		if (!err)
+			err = uccp420wlan_set_channel(dev, &chan_cmd, 0, NULL,
+						      conf->radar_enabled);
+
+		if (err) {
+			mutex_unlock(&dev->mutex);
+			return err;
 		}
 	}
 
@@ -768,6 +836,10 @@ static int config(struct ieee80211_hw *hw,
 					  dev->power_save);
 	}
 
+	/* The SMPS and retry limit changes of a VIF go out as one VIF_CFG */
+	for (i = 0; i < MAX_VIFS; i++)
+		uccp420wlan_vif_cfg_begin(i);
+
 	/* TODO: Make this global config as it effects all VIF's */
 	for (i = 0; i < MAX_VIFS; i++) {
 		if (!(changed & IEEE80211_CONF_CHANGE_SMPS))
@@ -822,68 +894,69 @@ static int config(struct ieee80211_hw *hw,
 	}
 
 prog_umac_fail:
+	for (i = 0; i < MAX_VIFS; i++)
+		uccp420wlan_vif_cfg_end(i);
+
 	mutex_unlock(&dev->mutex);
 	return ret;
 }
 
 
+/* Handed from prepare_multicast, which runs in atomic context, to
+ * configure_filter which programs it.
+ */
+struct mcast_list {
+	int count;
+	unsigned char addr[MCST_ADDR_LIMIT][ETH_ALEN];
+};
+
+
 static u64 prepare_multicast(struct ieee80211_hw *hw,
 			     struct netdev_hw_addr_list *mc_list)
 {
 	struct mac80211_dev *dev = hw->priv;
-	int i;
 	struct netdev_hw_addr *ha;
+	struct mcast_list *mcast;
 	int mc_count = 0;
-	int ret = 0;
 
 	if (dev->state != STARTED)
 		return 0;
 
 	mc_count = netdev_hw_addr_list_count(mc_list);
-	{
-		if (mc_count > MCST_ADDR_LIMIT) {
-			mc_count = 0;
-			pr_warn("%s-80211IF:Disabling MCAST filter (cnt=%d)\n",
-				dev->name, mc_count);
-			goto out;
-		}
-	}
-	UCCP_DEBUG_80211IF("%s-80211IF: Multicast filter count", dev->name);
-	UCCP_DEBUG_80211IF("adding: %d removing: %d\n", mc_count,
-			dev->mc_filter_count);
 
-	if (dev->mc_filter_count > 0) {
-		/* Remove all previous multicast addresses from the LMAC */
-		for (i = 0; i < dev->mc_filter_count; i++)
-			uccp420wlan_prog_mcast_addr_cfg(dev->mc_filters[i],
-							WLAN_MCAST_ADDR_REM);
+	if (mc_count == 0)
+		return 0;
+
+	if (mc_count > wifi->params.mcast_allmulti_thresh) {
+		pr_warn("%s-80211IF:Disabling MCAST filter (cnt=%d)\n",
+			dev->name, mc_count);
+		dev->stats->mcast_allmulti++;
+		return 0;
 	}
 
-	i = 0;
+	mcast = kzalloc(sizeof(struct mcast_list), GFP_ATOMIC);
 
-	netdev_hw_addr_list_for_each(ha, mc_list) {
-		/* Prog the multicast address into the LMAC */
-		CALL_UMAC(uccp420wlan_prog_mcast_addr_cfg,
-			  ha->addr,
-			  WLAN_MCAST_ADDR_ADD);
-		memcpy(dev->mc_filters[i], ha->addr, 6);
-		i++;
-	}
+	/* Accepting all multicast frames is always safe */
+	if (!mcast)
+		return 0;
 
-	dev->mc_filter_count = mc_count;
-out:
-	return mc_count;
-prog_umac_fail:
-	return ret;
+	netdev_hw_addr_list_for_each(ha, mc_list)
+		ether_addr_copy(mcast->addr[mcast->count++], ha->addr);
+
+	UCCP_DEBUG_80211IF("%s-80211IF: Multicast filter count %d\n",
+			   dev->name, mcast->count);
+
+	return (unsigned long)mcast;
 }
 
 
 static void configure_filter(struct ieee80211_hw *hw,
 		unsigned int changed_flags,
 		unsigned int *new_flags,
-		u64 mc_count)
+		u64 multicast)
 {
 	struct mac80211_dev *dev = hw->priv;
+	struct mcast_list *mcast = (struct mcast_list *)(unsigned long)multicast;
 	int ret = 0;
 
 	mutex_lock(&dev->mutex);
@@ -893,16 +966,24 @@ static void configure_filter(struct ieee80211_hw *hw,
 
 	if (dev->state != STARTED) {
 		mutex_unlock(&dev->mutex);
+		kfree(mcast);
 		return;
 	}
 
-	if ((*new_flags & FIF_ALLMULTI) || (mc_count == 0)) {
+	/* The FW list is left as it is while the filter is off, it only has
+	 * to catch up with the changes once it is turned on again.
+	 */
+	if ((*new_flags & FIF_ALLMULTI) || !mcast) {
 		/* Disable the multicast filter in LMAC */
 		UCCP_DEBUG_80211IF("%s-80211IF: Multicast filters disabled\n",
 				   dev->name);
 		CALL_UMAC(uccp420wlan_prog_mcast_filter_control,
 			  MCAST_FILTER_DISABLE);
-	} else if (mc_count) {
+	} else {
+		CALL_UMAC(uccp420wlan_prog_mcast_list,
+			  mcast->addr,
+			  mcast->count);
+
 		/* Enable the multicast filter in LMAC */
 		UCCP_DEBUG_80211IF("%s-80211IF: Multicast filters enabled\n",
 			       dev->name);
@@ -936,6 +1017,7 @@ out:
 
 prog_umac_fail:
 	mutex_unlock(&dev->mutex);
+	kfree(mcast);
 }
 
 
@@ -1410,6 +1492,10 @@ static void init_hw(struct ieee80211_hw *hw)
 	hw->max_rate_tries = 5;
 	hw->queues = 4;
 
+	/* No NETIF_F_SG: mac80211 refuses it at registration on the kernels we
+	 * build against, so the stack hands over linear frames only.
+	 */
+
 	/* Size */
 	hw->extra_tx_headroom = 0;
 	hw->vif_data_size = sizeof(struct umac_vif);
@@ -1547,6 +1633,151 @@ static int set_antenna(struct ieee80211_hw *hw, u32 tx_ant, u32 rx_ant)
 }
 
 
+/* Second half of remain_on_channel: the operating channel TX is flushed
+ * (a FW round trip) without dev->mutex, then the ROC is sent to the FW.
+ * While roc_starting is set only this work and cancel touch the start_*
+ * parameters.
+ */
+static void uccp420_roc_start_work(struct work_struct *work)
+{
+	struct mac80211_dev *dev = container_of(work, struct mac80211_dev,
+						roc_start_work);
+	struct roc_params *roc = &dev->roc_params;
+#ifdef MULTI_CHAN_SUPPORT
+	struct umac_vif *uvif = roc->start_uvif;
+	struct umac_chanctx *off_chanctx = roc->start_off_chanctx;
+	struct tx_config *tx = &dev->tx;
+	u32 hw_queue_map = 0;
+	int off_chanctx_id = 0, i = 0;
+	bool oper = (roc->start_chanctx_idx >= 0);
+#endif
+	int ret = 0;
+
+#ifdef MULTI_CHAN_SUPPORT
+	if (roc->need_offchan && oper) {
+		hw_queue_map = BIT(WLAN_AC_BK) |
+			BIT(WLAN_AC_BE) |
+			BIT(WLAN_AC_VI) |
+			BIT(WLAN_AC_VO) |
+			BIT(WLAN_AC_BCN);
+
+		uccp420_flush_vif_queues(dev,
+				uvif,
+				roc->start_chanctx_idx,
+				hw_queue_map,
+				UMAC_VIF_CHANCTX_TYPE_OPER,
+				TX_FLUSH);
+	}
+#endif
+
+	mutex_lock(&dev->mutex);
+
+	if (roc->roc_abort) {
+		UCCP_DEBUG_ROC("%s:%d ROC cancelled before start\n",
+			       __func__, __LINE__);
+#ifdef MULTI_CHAN_SUPPORT
+		if (roc->need_offchan)
+			kfree(off_chanctx);
+#endif
+		goto out;
+	}
+
+#ifdef MULTI_CHAN_SUPPORT
+	for (i = 0; i < MAX_OFF_CHANCTX; i++) {
+		if (!dev->off_chanctx[i]) {
+			off_chanctx_id = i;
+			break;
+		}
+	}
+
+	/* The slot is empty, so publishing needs no grace period */
+	if (roc->need_offchan) {
+		off_chanctx->index = OFF_CHANCTX_IDX_BASE + off_chanctx_id;
+		dev->roc_off_chanctx_idx = off_chanctx_id;
+
+		if (uvif->chanctx) {
+			/* Delete the uvif from OP channel list */
+			list_del_init(&uvif->list);
+		}
+		/* Add the vif to the off_chanctx */
+		list_add_tail(&uvif->list, &off_chanctx->vifs);
+		off_chanctx->nvifs++;
+		rcu_assign_pointer(dev->off_chanctx[off_chanctx_id],
+				   off_chanctx);
+
+		/* Move the channel context */
+		spin_lock_bh(&dev->chanctx_lock);
+		dev->curr_chanctx_idx = off_chanctx->index;
+		spin_unlock_bh(&dev->chanctx_lock);
+	} else {
+		/* Same channel context, just update off_chanctx
+		 * to chanctx
+		 */
+		dev->roc_off_chanctx_idx = off_chanctx->index;
+		rcu_assign_pointer(dev->off_chanctx[off_chanctx_id],
+				   off_chanctx);
+	}
+
+	spin_lock_bh(&tx->lock);
+	uvif->off_chanctx = off_chanctx;
+	spin_unlock_bh(&tx->lock);
+#endif
+	CALL_UMAC(uccp420wlan_prog_roc,
+		  ROC_START,
+		  roc->start_chan,
+		  roc->start_duration,
+		  roc->start_type);
+
+	goto out;
+
+prog_umac_fail:
+	pr_err("%s: ROC start failed: %d\n", dev->name, ret);
+
+#ifdef MULTI_CHAN_SUPPORT
+	/* Undo the move onto the off channel context */
+	spin_lock_bh(&tx->lock);
+	uvif->off_chanctx = NULL;
+	spin_unlock_bh(&tx->lock);
+
+	if (roc->need_offchan) {
+		list_del_init(&uvif->list);
+		off_chanctx->nvifs--;
+
+		if (uvif->chanctx)
+			list_add_tail(&uvif->list, &uvif->chanctx->vifs);
+
+		spin_lock_bh(&dev->chanctx_lock);
+
+		if (uvif->chanctx)
+			dev->curr_chanctx_idx = uvif->chanctx->index;
+		else
+			dev->curr_chanctx_idx = -1;
+
+		spin_unlock_bh(&dev->chanctx_lock);
+	}
+
+	rcu_assign_pointer(dev->off_chanctx[off_chanctx_id], NULL);
+	dev->roc_off_chanctx_idx = -1;
+#endif
+
+	/* No ROC events will follow, end it for mac80211 */
+	ieee80211_remain_on_channel_expired(dev->hw);
+out:
+	roc->roc_starting = false;
+	mutex_unlock(&dev->mutex);
+
+#ifdef MULTI_CHAN_SUPPORT
+	if (ret && roc->need_offchan) {
+		synchronize_rcu();
+		kfree(off_chanctx);
+	}
+
+	if (oper)
+		uccp420wlan_wake_queues(dev, ALL_HW_QUEUES, QUEUE_STOP_ROC);
+#endif
+}
+
+
 static int remain_on_channel(struct ieee80211_hw *hw,
 			     struct ieee80211_vif *vif,
 			     struct ieee80211_channel *channel,
@@ -1559,13 +1790,9 @@ static int remain_on_channel(struct ieee80211_hw *hw,
 #ifdef MULTI_CHAN_SUPPORT
 	struct umac_vif *uvif = (struct umac_vif *)vif->drv_priv;
 	struct umac_chanctx *off_chanctx = NULL;
-	int off_chanctx_id = 0, i = 0;
-	struct tx_config *tx = &dev->tx;
-	u32 hw_queue_map = 0;
 	struct ieee80211_chanctx_conf *vif_chanctx;
 	bool need_offchan = true;
 #endif
-	int ret = 0;
 
 	mutex_lock(&dev->mutex);
 	UCCP_DEBUG_ROC("%s:%d The Params are:",
@@ -1576,7 +1803,7 @@ static int remain_on_channel(struct ieee80211_hw *hw,
 			duration,
 			type);
 
-	if (dev->roc_params.roc_in_progress) {
+	if (dev->roc_params.roc_in_progress || dev->roc_params.roc_starting) {
 		UCCP_DEBUG_ROC("%s:%d Dropping roc...Busy\n",
 				__func__,
 				__LINE__);
@@ -1642,87 +1869,33 @@ static int remain_on_channel(struct ieee80211_hw *hw,
 		 *  ideally we should look for existing offchan context
 		 *  and re-use/create.
 		 */
-		for (i = 0; i < MAX_OFF_CHANCTX; i++) {
-			if (!dev->off_chanctx[i]) {
-				off_chanctx_id = i;
-				break;
-			}
-		}
-
-		if (uvif->chanctx) {
-			ieee80211_stop_queues(hw);
-
-			hw_queue_map = BIT(WLAN_AC_BK) |
-				BIT(WLAN_AC_BE) |
-				BIT(WLAN_AC_VI) |
-				BIT(WLAN_AC_VO) |
-				BIT(WLAN_AC_BCN);
-
-			uccp420_flush_vif_queues(dev,
-					uvif,
-					uvif->chanctx->index,
-					hw_queue_map,
-					UMAC_VIF_CHANCTX_TYPE_OPER,
-					TX_FLUSH);
-		}
-
-
-		off_chanctx->index = OFF_CHANCTX_IDX_BASE + off_chanctx_id;
-		dev->roc_off_chanctx_idx = off_chanctx_id;
 		INIT_LIST_HEAD(&off_chanctx->vifs);
 		off_chanctx->nvifs = 0;
 
-		if (uvif->chanctx) {
-			/* Delete the uvif from OP channel list */
-			list_del_init(&uvif->list);
-		}
-		/* Add the vif to the off_chanctx */
-		list_add_tail(&uvif->list, &off_chanctx->vifs);
-		off_chanctx->nvifs++;
-		rcu_assign_pointer(dev->off_chanctx[off_chanctx_id],
-				   off_chanctx);
-		synchronize_rcu();
-
-
-		/* Move the channel context */
-		spin_lock_bh(&dev->chanctx_lock);
-		dev->curr_chanctx_idx = off_chanctx->index;
-		spin_unlock_bh(&dev->chanctx_lock);
+		if (uvif->chanctx)
+			uccp420wlan_stop_queues(dev,
+						ALL_HW_QUEUES,
+						QUEUE_STOP_ROC);
 	} else {
-		/* Same channel context, just update off_chanctx
-		 * to chanctx
-		 */
 		off_chanctx = uvif->chanctx;
-
-		for (i = 0; i < MAX_OFF_CHANCTX; i++) {
-			if (!dev->off_chanctx[i]) {
-				off_chanctx_id = i;
-				break;
-			}
-		}
-		dev->roc_off_chanctx_idx = off_chanctx->index;
-		rcu_assign_pointer(dev->off_chanctx[off_chanctx_id],
-				   off_chanctx);
-		synchronize_rcu();
 	}
-	spin_lock_bh(&tx->lock);
-	uvif->off_chanctx = off_chanctx;
-	spin_unlock_bh(&tx->lock);
-#endif
-	CALL_UMAC(uccp420wlan_prog_roc,
-		  ROC_START,
-		  pri_chnl_num,
-		  duration,
-		  type);
 
-#ifdef MULTI_CHAN_SUPPORT
-	if (uvif->chanctx)
-		ieee80211_wake_queues(hw);
+	dev->roc_params.start_uvif = uvif;
+	dev->roc_params.start_off_chanctx = off_chanctx;
+	dev->roc_params.start_chanctx_idx =
+		uvif->chanctx ? uvif->chanctx->index : -1;
 #endif
+	dev->roc_params.start_chan = pri_chnl_num;
+	dev->roc_params.start_duration = duration;
+	dev->roc_params.start_type = type;
+	dev->roc_params.start_ts = ktime_get();
+	dev->roc_params.roc_abort = false;
+	dev->roc_params.roc_starting = true;
+
+	ieee80211_queue_work(hw, &dev->roc_start_work);
 
-prog_umac_fail:
 	mutex_unlock(&dev->mutex);
-	return ret;
+	return 0;
 }
 
 
@@ -1733,8 +1906,16 @@ static int cancel_remain_on_channel(struct ieee80211_hw *hw)
 
 	mutex_lock(&dev->mutex);
 
+	/* Not sent to the FW yet, the start work drops it */
+	if (dev->roc_params.roc_starting) {
+		dev->roc_params.roc_abort = true;
+		mutex_unlock(&dev->mutex);
+		flush_work(&dev->roc_start_work);
+		mutex_lock(&dev->mutex);
+	}
+
 	if (dev->roc_params.roc_in_progress) {
-		dev->cancel_hw_roc_done = 0;
+		reinit_completion(&dev->cancel_hw_roc_done);
 		dev->cancel_roc = 1;
 		UCCP_DEBUG_ROC("%s:%d Cancelling HW ROC....\n",
 				__func__, __LINE__);
@@ -1772,22 +1953,8 @@ static int tx_last_beacon(struct ieee80211_hw *hw)
 #ifdef CONFIG_PM
 static int wait_for_econ_ps_cfg(struct mac80211_dev *dev)
 {
-	int count = 0;
-	char econ_ps_cfg_done = 0;
-
-check_econ_ps_cfg_complete:
-	mutex_lock(&dev->mutex);
-	econ_ps_cfg_done = dev->econ_ps_cfg_stats.completed;
-	mutex_unlock(&dev->mutex);
-
-	if (!econ_ps_cfg_done && (count < PS_ECON_CFG_TIMEOUT_TICKS)) {
-		count++;
-		current->state = TASK_INTERRUPTIBLE;
-		schedule_timeout(1);
-		goto check_econ_ps_cfg_complete;
-	}
-
-	if (!econ_ps_cfg_done) {
+	if (wait_for_fw_event(dev, &dev->econ_ps_cfg_stats.completed,
+			      PS_ECON_CFG_TIMEOUT_TICKS, FW_WAIT_ECON_PS) < 0) {
 		pr_warn("%s: Didn't get ECON_PS_CFG_DONE event\n",
 		       __func__);
 		return -1;
@@ -1819,7 +1986,7 @@ static int img_resume(struct ieee80211_hw *hw)
 			active_vif_index = i;
 	}
 
-	dev->econ_ps_cfg_stats.completed = 0;
+	reinit_completion(&dev->econ_ps_cfg_stats.completed);
 	dev->econ_ps_cfg_stats.result = 0;
 
 	ret = uccp420wlan_prog_econ_ps_state(active_vif_index,
@@ -1895,7 +2062,7 @@ static int img_suspend(struct ieee80211_hw *hw,
 		return -ENOTSUPP;
 	 }
 
-	dev->econ_ps_cfg_stats.completed = 0;
+	reinit_completion(&dev->econ_ps_cfg_stats.completed);
 	dev->econ_ps_cfg_stats.result = 0;
 	dev->econ_ps_cfg_stats.wake_trig = -1;
 
@@ -2036,7 +2203,7 @@ void cancel_hw_scan(struct ieee80211_hw *hw, struct ieee80211_vif *vif)
 	if (wifi->params.hw_scan_status == HW_SCAN_STATUS_PROGRESS) {
 		pr_info("Aborting pending scan request...\n");
 
-		dev->scan_abort_done = 0;
+		reinit_completion(&dev->scan_abort_done);
 
 		if (uccp420wlan_scan_abort(uvif->vif_index))
 			return;
@@ -2127,6 +2294,8 @@ int sta_add(struct ieee80211_hw *hw,
 		rcu_assign_pointer(dev->peers[peer_id], sta);
 		synchronize_rcu();
 
+		uccp420wlan_rate_cache_flush(dev);
+
 		usta->index = peer_id;
 #ifdef MULTI_CHAN_SUPPORT
 		usta->chanctx = uvif->chanctx;
@@ -2163,7 +2332,7 @@ int sta_remove(struct ieee80211_hw *hw,
 	UCCP_DEBUG_TX("%s:%d discard tx\n", __func__, __LINE__);
 	uccp420_discard_sta_pend_q(dev, uvif, usta->index, hw_queue_map);
 	spin_unlock_bh(&tx->lock);
-	dev->tx_deinit_complete = 0;
+	reinit_completion(&dev->tx_deinit_complete);
 	uccp420wlan_prog_tx_deinit(usta->vif_index, sta->addr);
 
 	if (wait_for_tx_deinit_complete(dev) < 0) {
@@ -2359,41 +2528,34 @@ dump_fail:
 #endif
 
 #ifdef MULTI_CHAN_SUPPORT
-static int umac_chanctx_set_channel(struct mac80211_dev *dev,
-				     struct umac_vif *uvif,
-				     struct cfg80211_chan_def *chandef)
+static int umac_chanctx_build_channel(struct cfg80211_chan_def *chandef,
+				      struct umac_chan_cmd *cmd)
 {
-	unsigned int freq_band = 0;
-	unsigned int ch_width = 0;
-	int center_freq1 = 0;
-	int center_freq2 = 0;
 	unsigned int pri_chan;
-	int err = 0;
 
 	pri_chan = ieee80211_frequency_to_channel(chandef->chan->center_freq);
-	center_freq1 = chandef->center_freq1;
-	center_freq2 = chandef->center_freq2;
-
-	freq_band = chandef->chan->band;
-	ch_width = chandef->width;
 	DEBUG_LOG("%s: Primary Channel is: %d\n", __func__, pri_chan);
-	err = uccp420wlan_prog_channel(pri_chan, center_freq1,
-				       center_freq2,
-				       ch_width,
-				       uvif->vif_index,
-				       freq_band);
 
-	if (!err) {
-		/* RPU expects to program the associated channel
-		 * every time it changes, else it leads to
-		 * disconnections.
-		 */
-		uccp420wlan_prog_vif_op_channel(uvif->vif_index,
-						uvif->vif->addr,
-						pri_chan);
-	}
+	return uccp420wlan_build_channel(cmd, pri_chan,
+					 chandef->center_freq1,
+					 chandef->center_freq2,
+					 chandef->width,
+					 chandef->chan->band);
+}
 
-	return err;
+
+static int umac_chanctx_set_channel(struct mac80211_dev *dev,
+				    struct umac_vif *uvif,
+				    const struct umac_chan_cmd *cmd)
+{
+	if (cmd == &uvif->chanctx->chan_cmd)
+		dev->stats->chan_prog_cached++;
+
+	/* The OP channel of the VIF follows on the CH_PROG_DONE */
+	return uccp420wlan_set_channel(dev, cmd,
+				       uvif->vif_index,
+				       uvif->vif->addr,
+				       false);
 }
 
 
@@ -2432,8 +2594,13 @@ static int add_chanctx(struct ieee80211_hw *hw,
 	INIT_LIST_HEAD(&ctx->vifs);
 	ctx->nvifs = 0;
 
+	if (umac_chanctx_build_channel(&conf->def, &ctx->chan_cmd)) {
+		mutex_unlock(&dev->mutex);
+		return -1;
+	}
+
+	/* Empty slot, readers see either NULL or the new context */
 	rcu_assign_pointer(dev->chanctx[i], conf);
-	synchronize_rcu();
 
 	mutex_unlock(&dev->mutex);
 	return 0;
@@ -2461,11 +2628,13 @@ static void remove_chanctx(struct ieee80211_hw *hw,
 	 * free the vifs here
 	 */
 	rcu_assign_pointer(dev->chanctx[ctx->index], NULL);
+
+	mutex_unlock(&dev->mutex);
+
+	/* Readers may still index with it until the grace period ends */
 	synchronize_rcu();
 
 	ctx->index = -1;
-
-	mutex_unlock(&dev->mutex);
 }
 
 
@@ -2476,9 +2645,8 @@ static void change_chanctx(struct ieee80211_hw *hw,
 	struct umac_vif *uvif = NULL;
 	struct mac80211_dev *dev = NULL;
 	struct umac_chanctx *ctx = NULL;
+	struct umac_chan_cmd min_cmd;
 	int i = 0;
-	int center_freq = 0;
-	int chan = 0;
 	int err = 0, ret = 0;
 
 	dev = hw->priv;
@@ -2494,17 +2662,23 @@ static void change_chanctx(struct ieee80211_hw *hw,
 				   __func__,
 				   conf->def.width, conf->def.center_freq1);
 
-		center_freq = conf->def.chan->center_freq;
-		chan = ieee80211_frequency_to_channel(center_freq);
+		mutex_lock(&dev->mutex);
+
+		err = umac_chanctx_build_channel(&conf->def, &ctx->chan_cmd);
 
 		list_for_each_entry(uvif, &ctx->vifs, list) {
-			err = umac_chanctx_set_channel(dev, uvif, &conf->def);
+			if (err)
+				break;
 
-			if (err) {
-				pr_err("%s: Failed to set channel/width\n",
-				       __func__);
-				return;
-			}
+			err = umac_chanctx_set_channel(dev, uvif,
+						       &ctx->chan_cmd);
+		}
+
+		mutex_unlock(&dev->mutex);
+
+		if (err) {
+			pr_err("%s: Failed to set channel/width\n", __func__);
+			return;
 		}
 	}
 
@@ -2512,19 +2686,22 @@ static void change_chanctx(struct ieee80211_hw *hw,
 		UCCP_DEBUG_80211IF("%s Minimum channel width = %d\n", __func__,
 			conf->min_def.width);
 
-		center_freq = conf->min_def.chan->center_freq;
-		chan = ieee80211_frequency_to_channel(center_freq);
+		mutex_lock(&dev->mutex);
+
+		err = umac_chanctx_build_channel(&conf->min_def, &min_cmd);
 
 		list_for_each_entry(uvif, &ctx->vifs, list) {
-			err = umac_chanctx_set_channel(dev, uvif,
-						       &conf->min_def);
+			if (err)
+				break;
 
-			if (err) {
-				pr_err("%s: Failed to set channel/width\n",
-					__func__);
+			err = umac_chanctx_set_channel(dev, uvif, &min_cmd);
+		}
 
-				return;
-			}
+		mutex_unlock(&dev->mutex);
+
+		if (err) {
+			pr_err("%s: Failed to set channel/width\n", __func__);
+			return;
 		}
 	}
 
@@ -2619,7 +2796,15 @@ static int assign_vif_chanctx(struct ieee80211_hw *hw,
 		CALL_UMAC(uccp420wlan_prog_chanctx_time_info);
 	}
 
-	ret = umac_chanctx_set_channel(dev, uvif, &conf->def);
+	/* Production mode settings can change under the context */
+	if (wifi->params.production_test) {
+		ret = umac_chanctx_build_channel(&conf->def, &ctx->chan_cmd);
+
+		if (ret)
+			goto prog_umac_fail;
+	}
+
+	ret = umac_chanctx_set_channel(dev, uvif, &ctx->chan_cmd);
 
 prog_umac_fail:
 	mutex_unlock(&dev->mutex);
@@ -2650,17 +2835,17 @@ static void unassign_vif_chanctx(struct ieee80211_hw *hw,
 		  vif->p2p,
 		  conf->def.chan->center_freq);
 
-	mutex_lock(&dev->mutex);
-
 	/* We need to specifically handle flushing tx queues for the AP VIF
-	 * here (for STA VIF, mac80211 handles this via flush_queues)
+	 * here (for STA VIF, mac80211 handles this via flush_queues). The
+	 * chanctx ops are serialised by mac80211, so the flush (a FW round
+	 * trip) does not need dev->mutex.
 	 */
 	if (vif->type == NL80211_IFTYPE_AP) {
 		/* Flush all queues for this VIF */
 		for (i = 0; i < NUM_ACS; i++)
 			hw_queue_map |= BIT(i);
 
-		ieee80211_stop_queues(hw);
+		uccp420wlan_stop_queues(dev, ALL_HW_QUEUES, QUEUE_STOP_FLUSH);
 		uccp420_flush_vif_queues(dev,
 					 uvif,
 					 uvif->chanctx->index,
@@ -2668,9 +2853,11 @@ static void unassign_vif_chanctx(struct ieee80211_hw *hw,
 					 UMAC_VIF_CHANCTX_TYPE_OPER,
 					 TX_DROP);
 
-		ieee80211_wake_queues(hw);
+		uccp420wlan_wake_queues(dev, ALL_HW_QUEUES, QUEUE_STOP_FLUSH);
 	}
 
+	mutex_lock(&dev->mutex);
+
 	uvif->chanctx = NULL;
 
 	list_del(&uvif->list);
@@ -2828,6 +3015,7 @@ static void uccp420wlan_exit(void)
 		ieee80211_unregister_hw(wifi->hw);
 		device_release_driver(dev->dev);
 		device_destroy(hwsim_class, 0);
+		uccp420wlan_tx_free(dev);
 		ieee80211_free_hw(wifi->hw);
 		wifi->hw = NULL;
 	}
@@ -2892,11 +3080,25 @@ static int uccp420wlan_init(void)
 
 	mutex_init(&dev->mutex);
 	spin_lock_init(&dev->bcast_lock);
+	spin_lock_init(&dev->chan_prog_lock);
+	INIT_DELAYED_WORK(&dev->chan_prog_timeout_work,
+			  uccp420wlan_chan_prog_timeout_work);
+	INIT_WORK(&dev->roc_start_work, uccp420_roc_start_work);
+	init_completion(&dev->scan_abort_done);
+	init_completion(&dev->cancel_hw_roc_done);
+	init_completion(&dev->chan_prog_done);
+	init_completion(&dev->reset_complete);
+	init_completion(&dev->tx_deinit_complete);
+#ifdef CONFIG_PM
+	init_completion(&dev->econ_ps_cfg_stats.completed);
+#endif
 #ifdef MULTI_CHAN_SUPPORT
 	spin_lock_init(&dev->chanctx_lock);
 #endif
 
 	spin_lock_init(&dev->roc_lock);
+	spin_lock_init(&dev->queue_stop_lock);
+	pkt_gen_init(dev);
 	dev->state = STOPPED;
 	dev->active_vifs = 0;
 	dev->txpower = DEFAULT_TX_POWER;
@@ -2923,6 +3125,13 @@ static int uccp420wlan_init(void)
 		dev->vifs[i] = NULL;
 #endif
 
+	error = uccp420wlan_tx_alloc(dev,
+				     num_tx_descs_per_ac,
+				     num_spare_tx_descs);
+
+	if (error)
+		goto failed_hw;
+
 	/*Register hardware*/
 	error = ieee80211_register_hw(hw);
 
@@ -2945,6 +3154,7 @@ static int uccp420wlan_init(void)
 		wifi->hw = hw;
 		goto out;
 	} else {
+		uccp420wlan_tx_free(dev);
 		uccp420wlan_exit();
 		goto out;
 	}
@@ -3174,6 +3384,26 @@ static int proc_read_config(struct seq_file *m, void *v)
 #endif
 	seq_printf(m, "fw_loading = %d\n", wifi->params.fw_loading);
 	seq_printf(m, "bt_state = %d\n", wifi->params.bt_state);
+	seq_printf(m, "rate_cache = %d\n", wifi->params.rate_cache);
+	seq_printf(m, "tx_status_batch = %d\n", wifi->params.tx_status_batch);
+	seq_printf(m, "bcn_offload = %d\n", wifi->params.bcn_offload);
+	seq_printf(m, "spare_credit_bk = %d\n",
+		   wifi->params.spare_credit[WLAN_AC_BK]);
+	seq_printf(m, "spare_credit_be = %d\n",
+		   wifi->params.spare_credit[WLAN_AC_BE]);
+	seq_printf(m, "spare_credit_vi = %d\n",
+		   wifi->params.spare_credit[WLAN_AC_VI]);
+	seq_printf(m, "spare_credit_vo = %d\n",
+		   wifi->params.spare_credit[WLAN_AC_VO]);
+	seq_printf(m, "prog_tx_two_phase = %d\n",
+		   wifi->params.prog_tx_two_phase);
+	seq_printf(m, "cmd_window = %d\n", wifi->params.cmd_window);
+	seq_printf(m, "cmd_shadow = %d\n", wifi->params.cmd_shadow);
+	seq_printf(m, "async_chan_prog = %d\n",
+		   wifi->params.async_chan_prog);
+	seq_printf(m, "mcast_allmulti_thresh = %d\n",
+		   wifi->params.mcast_allmulti_thresh);
+	seq_printf(m, "key_cmd_prio = %d\n", wifi->params.key_cmd_prio);
 
 	/* Beacon Time Stamp */
 	if (dev->state == STARTED) {
@@ -3208,6 +3438,21 @@ static int proc_read_config(struct seq_file *m, void *v)
 		   wifi->params.pkt_gen_val);
 	seq_printf(m, "payload_length = %d bytes\n",
 		   wifi->params.payload_length);
+	seq_printf(m, "pkt_gen_descs = %d\n", wifi->params.pkt_gen_descs);
+	seq_printf(m, "pkt_gen_acs = 0x%x (BK:1 BE:2 VI:4 VO:8)\n",
+		   wifi->params.pkt_gen_acs);
+	seq_printf(m, "pkt_gen_aggr = %d frames\n", wifi->params.pkt_gen_aggr);
+	seq_printf(m, "pkt_gen_gap_us = %d\n", wifi->params.pkt_gen_gap_us);
+	{
+		unsigned long long fps, kbps;
+
+		pkt_gen_rate(dev, &fps, &kbps);
+		seq_printf(m, "pkt_gen_frames = %llu\n", dev->pkt_gen.frames);
+		seq_printf(m, "pkt_gen_fps = %llu\n", fps);
+		seq_printf(m, "pkt_gen_mbps = %llu.%03llu\n",
+			   div_u64(kbps, 1000),
+			   kbps - div_u64(kbps, 1000) * 1000);
+	}
 	seq_printf(m, "start_prod_mode = channel: %d\n",
 		   wifi->params.start_prod_mode);
 	seq_printf(m, "continuous_tx = %d\n",
@@ -3454,6 +3699,21 @@ static int proc_read_phy_stats(struct seq_file *m, void *v)
 	return 0;
 }
 
+static const char * const fw_wait_names[FW_WAIT_NUM] = {
+	[FW_WAIT_SCAN_ABORT] = "scan_abort",
+	[FW_WAIT_CANCEL_ROC] = "cancel_roc",
+	[FW_WAIT_CH_PROG] = "ch_prog",
+	[FW_WAIT_TX_DEINIT] = "tx_deinit",
+	[FW_WAIT_RESET] = "reset",
+	[FW_WAIT_ECON_PS] = "econ_ps",
+};
+
+static const char * const chan_op_names[CHAN_OP_NUM] = {
+	[CHAN_OP_PROG] = "chan_prog",
+	[CHAN_OP_ROC_START] = "roc_start",
+	[CHAN_OP_ROC_STOP] = "roc_stop",
+};
+
 static int proc_read_mac_stats(struct seq_file *m, void *v)
 {
 	unsigned int index;
@@ -3566,6 +3826,68 @@ static int proc_read_mac_stats(struct seq_file *m, void *v)
 		   wifi->stats.outstanding_cmd_cnt);
 	seq_printf(m, "gen_cmd_send_count = %d\n",
 		   wifi->stats.gen_cmd_send_count);
+	seq_printf(m, "cmd_queued = %d\n",
+		   skb_queue_len(&cmd_info.outstanding_cmd));
+	seq_printf(m, "cmd_in_flight = %d (max = %d)\n",
+		   cmd_info.cmd_in_flight,
+		   wifi->stats.cmd_in_flight_max);
+	seq_printf(m, "cmd_queued_cnt = %d\n",
+		   wifi->stats.cmd_queued_cnt);
+	seq_printf(m, "cmd_queue_wait_avg_us = %llu\n",
+		   wifi->stats.cmd_queued_cnt ?
+		   div_u64(wifi->stats.cmd_queue_wait_us,
+			   wifi->stats.cmd_queued_cnt) : 0);
+	seq_printf(m, "cmd_queue_wait_max_us = %d\n",
+		   wifi->stats.cmd_queue_wait_max_us);
+
+	seq_printf(m, "vif_cfg_batched = %d (cmds = %d)\n",
+		   wifi->stats.vif_cfg_batched,
+		   wifi->stats.vif_cfg_flushes);
+
+	seq_printf(m, "mcast_addr_add = %d\n", wifi->stats.mcast_addr_add);
+	seq_printf(m, "mcast_addr_del = %d\n", wifi->stats.mcast_addr_del);
+	seq_printf(m, "mcast_addr_kept = %d\n", wifi->stats.mcast_addr_kept);
+	seq_printf(m, "mcast_allmulti = %d\n", wifi->stats.mcast_allmulti);
+
+	for (index = 0; index < UMAC_EVENT_NUM; index++) {
+		if (!wifi->stats.event_cnt[index])
+			continue;
+
+		seq_printf(m, "event[%s] = %d (avg_ns = %llu max_ns = %d)\n",
+			   uccp420wlan_event_name(index),
+			   wifi->stats.event_cnt[index],
+			   div_u64(wifi->stats.event_ns[index],
+				   wifi->stats.event_cnt[index]),
+			   wifi->stats.event_max_ns[index]);
+	}
+	seq_printf(m, "event_unknown = %d\n", wifi->stats.event_unknown);
+
+	for (index = 0; index < CMD_POOL_CLASSES; index++)
+		seq_printf(m, "cmd_pool_used[%d] = %d\n",
+			   index,
+			   wifi->stats.cmd_pool_used[index]);
+	seq_printf(m, "cmd_pool_miss = %d\n", wifi->stats.cmd_pool_miss);
+
+	for (index = 0; index < UMAC_CMD_NUM; index++) {
+		if (!wifi->stats.cmd_suppressed[index])
+			continue;
+
+		seq_printf(m, "cmd_suppressed[%d] = %d\n",
+			   index,
+			   wifi->stats.cmd_suppressed[index]);
+	}
+
+	for (index = 0; index < UMAC_CMD_NUM; index++) {
+		if (!wifi->stats.cmd_rtt_cnt[index])
+			continue;
+
+		seq_printf(m, "cmd_rtt_us[%d] = %llu avg, %d max (%d cmds)\n",
+			   index,
+			   div_u64(wifi->stats.cmd_rtt_us[index],
+				   wifi->stats.cmd_rtt_cnt[index]),
+			   wifi->stats.cmd_rtt_max_us[index],
+			   wifi->stats.cmd_rtt_cnt[index]);
+	}
 	seq_printf(m, "umac_scan_req = %d\n",
 		   wifi->stats.umac_scan_req);
 	seq_printf(m, "umac_scan_complete = %d\n",
@@ -3578,6 +3900,121 @@ static int proc_read_mac_stats(struct seq_file *m, void *v)
 		   wifi->stats.tx_cmd_send_count_beaconq);
 	seq_printf(m, "tx_done_recv_count = %d\n",
 		   wifi->stats.tx_done_recv_count);
+	seq_printf(m, "rate_cache_hits = %d\n",
+		   wifi->stats.rate_cache_hits);
+	seq_printf(m, "rate_cache_misses = %d\n",
+		   wifi->stats.rate_cache_misses);
+	seq_printf(m, "tx_lock_hold_avg_ns = %llu\n",
+		   wifi->stats.tx_lock_hold_cnt ?
+		   div_u64(wifi->stats.tx_lock_hold_ns,
+			   wifi->stats.tx_lock_hold_cnt) : 0);
+	seq_printf(m, "tx_lock_hold_max_ns = %llu\n",
+		   wifi->stats.tx_lock_hold_max_ns);
+#ifdef PERF_PROFILING
+	seq_printf(m, "rate_cache_hit_avg_ns = %llu\n",
+		   wifi->stats.rate_cache_hits ?
+		   div_u64(wifi->stats.rate_cache_hit_ns,
+			   wifi->stats.rate_cache_hits) : 0);
+	seq_printf(m, "rate_cache_miss_avg_ns = %llu\n",
+		   wifi->stats.rate_cache_misses ?
+		   div_u64(wifi->stats.rate_cache_miss_ns,
+			   wifi->stats.rate_cache_misses) : 0);
+#endif
+	seq_printf(m, "tx_status_ampdu_cnt = %d\n",
+		   wifi->stats.tx_status_ampdu_cnt);
+	seq_printf(m, "tx_status_fast_free = %d\n",
+		   wifi->stats.tx_status_fast_free);
+#ifdef PERF_PROFILING
+	seq_printf(m, "tx_status_mpdu_avg_ns = %llu\n",
+		   wifi->stats.tx_status_mpdu_cnt ?
+		   div_u64(wifi->stats.tx_status_ns,
+			   wifi->stats.tx_status_mpdu_cnt) : 0);
+#endif
+
+	seq_printf(m, "bcn_host_tx = %d\n", wifi->stats.bcn_host_tx);
+	seq_printf(m, "bcn_tmpl_uploads = %d\n", wifi->stats.bcn_tmpl_uploads);
+	seq_printf(m, "bcast_bursts = %d (descs = %d, frames = %d)\n",
+		   wifi->stats.bcast_bursts,
+		   wifi->stats.bcast_burst_descs,
+		   wifi->stats.bcast_burst_frames);
+	seq_printf(m, "noa_release_batches = %d\n",
+		   wifi->stats.noa_release_batches);
+	seq_printf(m, "noa_release_frames = %d\n",
+		   wifi->stats.noa_release_frames);
+
+	for (index = 0; index < TX_FLUSH_HIST_BINS; index++)
+		seq_printf(m, "tx_flush_hist_us[%d+] = %d\n",
+			   index ? 1 << (TX_FLUSH_HIST_SHIFT + index - 1) : 0,
+			   wifi->stats.tx_flush_hist[index]);
+	seq_printf(m, "tx_flush_timeouts = %d\n",
+		   wifi->stats.tx_flush_timeouts);
+
+	for (index = 0; index < FW_WAIT_NUM; index++) {
+		unsigned int bin;
+
+		for (bin = 0; bin < FW_WAIT_HIST_BINS; bin++) {
+			if (!wifi->stats.fw_wait_hist[index][bin])
+				continue;
+
+			seq_printf(m, "fw_wait_hist_us[%s][%d+] = %d\n",
+				   fw_wait_names[index],
+				   bin ? 1 << (FW_WAIT_HIST_SHIFT + bin - 1) : 0,
+				   wifi->stats.fw_wait_hist[index][bin]);
+		}
+
+		if (wifi->stats.fw_wait_timeouts[index])
+			seq_printf(m, "fw_wait_timeouts[%s] = %d\n",
+				   fw_wait_names[index],
+				   wifi->stats.fw_wait_timeouts[index]);
+	}
+
+	for (index = 0; index < CHAN_OP_NUM; index++) {
+		unsigned int bin;
+
+		for (bin = 0; bin < FW_WAIT_HIST_BINS; bin++) {
+			if (!wifi->stats.chan_op_hist[index][bin])
+				continue;
+
+			seq_printf(m, "chan_op_hist_us[%s][%d+] = %d\n",
+				   chan_op_names[index],
+				   bin ? 1 << (FW_WAIT_HIST_SHIFT + bin - 1) : 0,
+				   wifi->stats.chan_op_hist[index][bin]);
+		}
+	}
+	seq_printf(m, "chan_prog_timeouts = %d\n",
+		   wifi->stats.chan_prog_timeouts);
+	seq_printf(m, "chan_prog_sent = %d\n", wifi->stats.chan_prog_sent);
+	seq_printf(m, "chan_prog_skipped = %d\n",
+		   wifi->stats.chan_prog_skipped);
+	seq_printf(m, "chan_prog_cached = %d\n",
+		   wifi->stats.chan_prog_cached);
+
+	for (index = 0; index < FW_WAIT_HIST_BINS; index++) {
+		if (!wifi->stats.key_ack_hist[index])
+			continue;
+
+		seq_printf(m, "key_ack_hist_us[%d+] = %d\n",
+			   index ? 1 << (FW_WAIT_HIST_SHIFT + index - 1) : 0,
+			   wifi->stats.key_ack_hist[index]);
+	}
+	seq_printf(m, "key_cmd_passed = %d\n", wifi->stats.key_cmd_passed);
+	seq_printf(m, "chsw_events = %d\n", wifi->stats.chsw_events);
+	seq_printf(m, "chsw_ready_descs = %d\n",
+		   wifi->stats.chsw_ready_descs);
+	seq_printf(m, "chsw_first_tx_avg_us = %llu\n",
+		   wifi->stats.chsw_first_tx_cnt ?
+		   div_u64(wifi->stats.chsw_first_tx_us,
+			   wifi->stats.chsw_first_tx_cnt) : 0);
+	seq_printf(m, "chsw_first_tx_max_us = %d\n",
+		   wifi->stats.chsw_first_tx_max_us);
+
+	for (index = WLAN_AC_BK; index <= WLAN_AC_VO; index++)
+		seq_printf(m, "spare_tokens_ac%d = %d (borrowed = %d, reclaimed = %d, denied = %d)\n",
+			   index,
+			   dev->tx.spare_tokens[index],
+			   wifi->stats.spare_borrow[index],
+			   wifi->stats.spare_reclaim[index],
+			   wifi->stats.spare_denied[index]);
 
 	seq_printf(m, "tx_buff_pool_map = %ld\n",
 		   dev->tx.buf_pool_bmp[0]);
@@ -3691,6 +4128,58 @@ void uccp420wlan_reinit(void)
 	uccp420wlan_init();
 	uccp_reinit = 1;
 }
+static void proc_set_spare_credit(int ac, unsigned long val)
+{
+	if (val > HAL_MAX_TX_DESC) {
+		pr_err("Invalid spare credit value should be 0 to %d\n",
+		       HAL_MAX_TX_DESC);
+		return;
+	}
+
+	/* Restart the measurement for the new setting */
+	wifi->params.spare_credit[ac] = val;
+	memset(wifi->stats.spare_borrow, 0, sizeof(wifi->stats.spare_borrow));
+	memset(wifi->stats.spare_reclaim, 0,
+	       sizeof(wifi->stats.spare_reclaim));
+	memset(wifi->stats.spare_denied, 0, sizeof(wifi->stats.spare_denied));
+}
+
+
+/* Params read by compile_rate_tbl, a write to any of them invalidates the
+ * cached rate tables.
+ */
+static const char * const rate_params[] = {
+	"uccp_num_spatial_streams=",
+	"num_spatial_streams=",
+	"mgd_mode_tx_fixed_mcs_indx=",
+	"mgd_mode_tx_fixed_rate=",
+	"mgd_mode_mcast_fixed_data_rate=",
+	"mgd_mode_mcast_fixed_rate_flags=",
+	"mgd_mode_mcast_fixed_bcc_or_ldpc=",
+	"mgd_mode_mcast_fixed_stbc_enabled=",
+	"mgd_mode_mcast_fixed_preamble=",
+	"mgd_mode_mcast_fixed_nss=",
+	"prod_mode_rate_flag=",
+	"rate_protection_type=",
+	"prod_mode_rate_preamble_type=",
+	"prod_mode_stbc_enabled=",
+	"prod_mode_bcc_or_ldpc=",
+};
+
+
+static bool param_affects_rates(unsigned char *buf)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(rate_params); i++) {
+		if (strstr(buf, rate_params[i]))
+			return true;
+	}
+
+	return false;
+}
+
+
 static ssize_t proc_write_config(struct file *file,
 				 const char __user *buffer,
 				 size_t count,
@@ -4363,6 +4852,7 @@ static ssize_t proc_write_config(struct file *file,
 		wifi->params.start_prod_mode = val;
 		tasklet_init(&dev->proc_tx_tasklet, packet_generation,
 			     (unsigned long)dev);
+		pkt_gen_reset(dev);
 		if (pri_chnl_num < 15)
 			freq_band = IEEE80211_BAND_2GHZ;
 		else
@@ -4414,7 +4904,7 @@ static ssize_t proc_write_config(struct file *file,
 			goto error;
 		}
 
-		tasklet_kill(&dev->proc_tx_tasklet);
+		pkt_gen_stop(dev);
 #if 0
 		/* Todo: Enabling this causes RPU Lockup,
 		 * need to debug
@@ -4453,8 +4943,8 @@ static ssize_t proc_write_config(struct file *file,
 		wifi->params.init_pkt_gen = 1;
 
 		wifi->params.pkt_gen_val = sval;
-		if (sval != 0)
-			tasklet_schedule(&dev->proc_tx_tasklet);
+		if ((sval != 0) && pkt_gen_start(dev, sval))
+			wifi->params.init_pkt_gen = 0;
 
 	} else if (param_get_sval(buf, "stop_packet_gen=", &sval)) {
 
@@ -4465,9 +4955,28 @@ static ssize_t proc_write_config(struct file *file,
 
 		wifi->params.pkt_gen_val = 1;
 		wifi->params.init_pkt_gen = 0;
-		tasklet_kill(&dev->proc_tx_tasklet);
+		pkt_gen_stop(dev);
 	} else if (param_get_val(buf, "payload_length=", &val)) {
 		wifi->params.payload_length = val;
+	} else if (param_get_val(buf, "pkt_gen_descs=", &val)) {
+		if ((val >= 1) && (val <= HAL_MAX_TX_DESC))
+			wifi->params.pkt_gen_descs = val;
+		else
+			pr_err("Invalid pkt_gen_descs value should be 1 to %d\n",
+			       HAL_MAX_TX_DESC);
+	} else if (param_get_val(buf, "pkt_gen_acs=", &val)) {
+		if ((val >= 1) && (val <= 0xF))
+			wifi->params.pkt_gen_acs = val;
+		else
+			pr_err("Invalid pkt_gen_acs value should be a bitmap of BK(1), BE(2), VI(4), VO(8)\n");
+	} else if (param_get_val(buf, "pkt_gen_aggr=", &val)) {
+		if ((val >= 1) && (val <= MAX_TX_CMDS))
+			wifi->params.pkt_gen_aggr = val;
+		else
+			pr_err("Invalid pkt_gen_aggr value should be 1 to %d\n",
+			       MAX_TX_CMDS);
+	} else if (param_get_val(buf, "pkt_gen_gap_us=", &val)) {
+		wifi->params.pkt_gen_gap_us = val;
 	} else if (param_get_sval(buf, "set_tx_power=", &sval)) {
 		if (wifi->params.production_test != 1 && !ftm) {
 			pr_err("set_tx_power: Can be set in only in FTM/production mode.\n");
@@ -4525,10 +5034,92 @@ static ssize_t proc_write_config(struct file *file,
 		else
 			pr_err("Invalid parameter value.\n");
 #endif
+	} else if (param_get_val(buf, "rate_cache=", &val)) {
+		if ((val == 0) || (val == 1)) {
+			/* Restart the measurement for the new setting */
+			wifi->params.rate_cache = val;
+			wifi->stats.rate_cache_hits = 0;
+			wifi->stats.rate_cache_misses = 0;
+#ifdef PERF_PROFILING
+			wifi->stats.rate_cache_hit_ns = 0;
+			wifi->stats.rate_cache_miss_ns = 0;
+#endif
+		} else
+			pr_err("Invalid rate_cache value should be 1 or 0\n");
+	} else if (param_get_val(buf, "tx_status_batch=", &val)) {
+		if ((val == 0) || (val == 1)) {
+			/* Restart the measurement for the new setting */
+			wifi->params.tx_status_batch = val;
+			wifi->stats.tx_status_ampdu_cnt = 0;
+			wifi->stats.tx_status_fast_free = 0;
+#ifdef PERF_PROFILING
+			wifi->stats.tx_status_mpdu_cnt = 0;
+			wifi->stats.tx_status_ns = 0;
+#endif
+		} else
+			pr_err("Invalid tx_status_batch value should be 1 or 0\n");
+	} else if (param_get_val(buf, "bcn_offload=", &val)) {
+		if ((val == 0) || (val == 1)) {
+			/* Takes effect on the next beacon interval */
+			wifi->params.bcn_offload = val;
+			wifi->stats.bcn_host_tx = 0;
+			wifi->stats.bcn_tmpl_uploads = 0;
+		} else
+			pr_err("Invalid bcn_offload value should be 1 or 0\n");
+	} else if (param_get_val(buf, "spare_credit_bk=", &val)) {
+		proc_set_spare_credit(WLAN_AC_BK, val);
+	} else if (param_get_val(buf, "spare_credit_be=", &val)) {
+		proc_set_spare_credit(WLAN_AC_BE, val);
+	} else if (param_get_val(buf, "spare_credit_vi=", &val)) {
+		proc_set_spare_credit(WLAN_AC_VI, val);
+	} else if (param_get_val(buf, "spare_credit_vo=", &val)) {
+		proc_set_spare_credit(WLAN_AC_VO, val);
+	} else if (param_get_val(buf, "cmd_window=", &val)) {
+		/* A larger window is used from the next PROC_DONE */
+		if ((val >= 1) && (val <= MAX_CTRL_CMD_WINDOW))
+			wifi->params.cmd_window = val;
+		else
+			pr_err("Invalid cmd_window value should be 1 to %d\n",
+			       MAX_CTRL_CMD_WINDOW);
+	} else if (param_get_val(buf, "async_chan_prog=", &val)) {
+		if ((val == 0) || (val == 1))
+			wifi->params.async_chan_prog = val;
+		else
+			pr_err("Invalid async_chan_prog value should be 1 or 0\n");
+	} else if (param_get_val(buf, "mcast_allmulti_thresh=", &val)) {
+		/* Used from the next multicast list change */
+		if (val <= MCST_ADDR_LIMIT)
+			wifi->params.mcast_allmulti_thresh = val;
+		else
+			pr_err("Invalid mcast_allmulti_thresh value should be 0 to %d\n",
+			       MCST_ADDR_LIMIT);
+	} else if (param_get_val(buf, "key_cmd_prio=", &val)) {
+		if ((val == 0) || (val == 1))
+			wifi->params.key_cmd_prio = val;
+		else
+			pr_err("Invalid key_cmd_prio value should be 1 or 0\n");
+	} else if (param_get_val(buf, "cmd_shadow=", &val)) {
+		if ((val == 0) || (val == 1))
+			wifi->params.cmd_shadow = val;
+		else
+			pr_err("Invalid cmd_shadow value should be 1 or 0\n");
+	} else if (param_get_val(buf, "prog_tx_two_phase=", &val)) {
+		if ((val == 0) || (val == 1)) {
+			/* Restart the measurement for the new setting */
+			wifi->params.prog_tx_two_phase = val;
+			wifi->stats.tx_lock_hold_cnt = 0;
+			wifi->stats.tx_lock_hold_ns = 0;
+			wifi->stats.tx_lock_hold_max_ns = 0;
+		} else
+			pr_err("Invalid prog_tx_two_phase value should be 1 or 0\n");
 	} else if (param_get_val(buf, "uccp_debug=", &val)) {
 		uccp_debug = val;
 	} else
 		pr_err("Invalid parameter name: %s\n", buf);
+
+	/* Only once the new value is in place */
+	if (param_affects_rates(buf))
+		uccp420wlan_rate_cache_flush(dev);
 error:
 	return count;
 prog_umac_fail:
@@ -4536,6 +5127,78 @@ prog_umac_fail:
 }
 
 
+static const char * const tx_lat_stage_name[TX_LAT_STAGES] = {
+	[TX_LAT_QUEUE] = "queue",
+	[TX_LAT_HOST] = "host",
+	[TX_LAT_FW] = "fw",
+	[TX_LAT_TOTAL] = "total",
+};
+
+
+static void proc_print_tx_lat_hist(struct seq_file *m,
+				   const char *owner,
+				   int id,
+				   unsigned int (*hist)[TX_LAT_HIST_BINS])
+{
+	int stage, bin;
+
+	for (stage = 0; stage < TX_LAT_STAGES; stage++) {
+		seq_printf(m, "%s%d %-5s:", owner, id,
+			   tx_lat_stage_name[stage]);
+
+		for (bin = 0; bin < TX_LAT_HIST_BINS; bin++)
+			seq_printf(m, " %u", hist[stage][bin]);
+
+		seq_puts(m, "\n");
+	}
+}
+
+
+static int proc_read_tx_latency(struct seq_file *m, void *v)
+{
+	int i, bin;
+
+	seq_puts(m, "************* TX LATENCY ***********\n");
+	seq_puts(m, "Bin n counts frames of [2^(n-1), 2^n) us, bin 0 is 0 us\n");
+	seq_puts(m, "bin(us) :");
+	for (bin = 0; bin < TX_LAT_HIST_BINS; bin++)
+		seq_printf(m, " %u", bin ? 1 << (bin - 1) : 0);
+	seq_puts(m, "\n");
+
+	for (i = 0; i < NUM_ACS; i++)
+		proc_print_tx_lat_hist(m, "ac", i, wifi->stats.tx_lat_ac[i]);
+
+	for (i = 0; i < MAX_PEND_Q_PER_AC; i++) {
+		unsigned int *total = wifi->stats.tx_lat_peer[i][TX_LAT_TOTAL];
+
+		for (bin = 0; bin < TX_LAT_HIST_BINS; bin++)
+			if (total[bin])
+				break;
+
+		if (bin == TX_LAT_HIST_BINS)
+			continue;
+
+		proc_print_tx_lat_hist(m, "peer", i,
+				       wifi->stats.tx_lat_peer[i]);
+	}
+
+	return 0;
+}
+
+
+static ssize_t proc_write_tx_latency(struct file *file,
+				     const char __user *buffer,
+				     size_t count,
+				     loff_t *ppos)
+{
+	/* Any write clears the histograms */
+	memset(wifi->stats.tx_lat_ac, 0, sizeof(wifi->stats.tx_lat_ac));
+	memset(wifi->stats.tx_lat_peer, 0, sizeof(wifi->stats.tx_lat_peer));
+
+	return count;
+}
+
+
 static int proc_open_config(struct inode *inode, struct file *file)
 {
 	return single_open(file, proc_read_config, NULL);
@@ -4554,6 +5217,12 @@ static int proc_open_mac_stats(struct inode *inode, struct file *file)
 }
 
 
+static int proc_open_tx_latency(struct inode *inode, struct file *file)
+{
+	return single_open(file, proc_read_tx_latency, NULL);
+}
+
+
 static const struct file_operations params_fops_config = {
 	.open = proc_open_config,
 	.read = seq_read,
@@ -4576,6 +5245,13 @@ static const struct file_operations params_fops_mac_stats = {
 	.write = NULL,
 	.release = single_release
 };
+static const struct file_operations params_fops_tx_latency = {
+	.open = proc_open_tx_latency,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.write = proc_write_tx_latency,
+	.release = single_release
+};
 static int proc_init(struct proc_dir_entry ***main_dir_entry)
 {
 	struct proc_dir_entry *entry;
@@ -4625,6 +5301,14 @@ static int proc_init(struct proc_dir_entry ***main_dir_entry)
 		goto  proc_entry3_fail;
 	}
 
+	entry = proc_create("tx_latency", 0644, wifi->umac_proc_dir_entry,
+			    &params_fops_tx_latency);
+	if (!entry) {
+		pr_err("Failed to create proc entry\n");
+		err = -ENOMEM;
+		goto  proc_entry4_fail;
+	}
+
 	/* Initialize WLAN params */
 	memset(&wifi->params, 0, sizeof(struct wifi_params));
 
@@ -4725,6 +5409,10 @@ static int proc_init(struct proc_dir_entry ***main_dir_entry)
 	wifi->params.pkt_gen_val = -1;
 	wifi->params.init_pkt_gen = 0;
 	wifi->params.payload_length = 4000;
+	wifi->params.pkt_gen_descs = 1;
+	wifi->params.pkt_gen_acs = BIT(WLAN_AC_BE);
+	wifi->params.pkt_gen_aggr = 1;
+	wifi->params.pkt_gen_gap_us = 0;
 	wifi->params.start_prod_mode = 0;
 	wifi->params.init_prod = 0;
 	wifi->params.bg_scan_intval = 5000 * 1000; /* Once in 5 seconds */
@@ -4734,10 +5422,26 @@ static int proc_init(struct proc_dir_entry ***main_dir_entry)
 	wifi->params.scan_type = ACTIVE;
 	wifi->params.hw_scan_status = HW_SCAN_STATUS_NONE;
 	wifi->params.fw_loading = 1;
+	wifi->params.rate_cache = 1;
+	wifi->params.tx_status_batch = 1;
+	wifi->params.bcn_offload = 0;
+	/* Background and best effort keep one spare when VI/VO are active */
+	wifi->params.spare_credit[WLAN_AC_BK] = 1;
+	wifi->params.spare_credit[WLAN_AC_BE] = 1;
+	wifi->params.spare_credit[WLAN_AC_VI] = HAL_MAX_TX_DESC;
+	wifi->params.spare_credit[WLAN_AC_VO] = HAL_MAX_TX_DESC;
+	wifi->params.prog_tx_two_phase = 1;
+	wifi->params.cmd_window = MAX_OUTSTANDING_CTRL_REQ;
+	wifi->params.cmd_shadow = 1;
+	wifi->params.async_chan_prog = 1;
+	wifi->params.mcast_allmulti_thresh = MCST_ADDR_LIMIT;
+	wifi->params.key_cmd_prio = 1;
 
 	**main_dir_entry = wifi->umac_proc_dir_entry;
 	return err;
 
+proc_entry4_fail:
+	remove_proc_entry("mac_stats", wifi->umac_proc_dir_entry);
 proc_entry3_fail:
 	remove_proc_entry("phy_stats", wifi->umac_proc_dir_entry);
 proc_entry2_fail:
@@ -4755,6 +5459,7 @@ static void proc_exit(void)
 {
 	/* This is created in hal_init */
 	remove_proc_entry("hal_stats", wifi->umac_proc_dir_entry);
+	remove_proc_entry("tx_latency", wifi->umac_proc_dir_entry);
 	remove_proc_entry("mac_stats", wifi->umac_proc_dir_entry);
 	remove_proc_entry("phy_stats", wifi->umac_proc_dir_entry);
 	remove_proc_entry("params", wifi->umac_proc_dir_entry);
@@ -4763,10 +5468,42 @@ static void proc_exit(void)
 }
 
 
+static int check_tx_desc_params(void)
+{
+	if ((num_tx_descs_per_ac < MIN_TX_DESCS_PER_AC) ||
+	    (num_tx_descs_per_ac > MAX_TX_DESCS_PER_AC) ||
+	    (num_tx_descs_per_ac % 2)) {
+		pr_err("Invalid num_tx_descs_per_ac %d, should be even and %d to %d\n",
+		       num_tx_descs_per_ac,
+		       MIN_TX_DESCS_PER_AC,
+		       MAX_TX_DESCS_PER_AC);
+		return -EINVAL;
+	}
+
+	if ((num_spare_tx_descs < MIN_SPARE_TX_DESCS) ||
+	    (num_spare_tx_descs > MAX_SPARE_TX_DESCS)) {
+		pr_err("Invalid num_spare_tx_descs %d, should be %d to %d\n",
+		       num_spare_tx_descs,
+		       MIN_SPARE_TX_DESCS,
+		       MAX_SPARE_TX_DESCS);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+
 int _uccp420wlan_80211if_init(struct proc_dir_entry **main_dir_entry)
 {
 	int error;
 
+	/* Before anything is set up, uccp420wlan_tx_alloc still checks that
+	 * the whole pool fits in GRAM
+	 */
+	error = check_tx_desc_params();
+	if (error)
+		return error;
+
 	error = proc_init(&main_dir_entry);
 	if (error)
 		return error;
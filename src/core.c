@@ -112,31 +112,59 @@ static int is_robust_mgmt(struct sk_buff *skb)
 }
 
 
-int wait_for_scan_abort(struct mac80211_dev *dev)
+static int fw_latency_bin(s64 delta_us)
 {
-	int count;
+	int bin = 0;
+
+	if (delta_us > 0)
+		bin = fls64((u64)delta_us >> FW_WAIT_HIST_SHIFT);
+
+	if (bin >= FW_WAIT_HIST_BINS)
+		bin = FW_WAIT_HIST_BINS - 1;
 
-	count = 0;
+	return bin;
+}
 
-check_scan_abort_complete:
-	if (!dev->scan_abort_done && (count < SCAN_ABORT_TIMEOUT_TICKS)) {
-		current->state = TASK_INTERRUPTIBLE;
 
-		if (schedule_timeout(1) == 0)
-			count++;
+/* Waits for an acknowledgement completed from uccp420wlan_msg_handler and
+ * records the latency, returns the time taken in us or -1 on timeout.
+ */
+s64 wait_for_fw_event(struct mac80211_dev *dev,
+		      struct completion *done,
+		      unsigned long timeout,
+		      enum fw_wait_type type)
+{
+	ktime_t start = ktime_get();
+	s64 delta_us;
 
-		goto check_scan_abort_complete;
+	if (!wait_for_completion_timeout(done, timeout)) {
+		dev->stats->fw_wait_timeouts[type]++;
+		return -1;
 	}
 
-	if (!dev->scan_abort_done) {
+	delta_us = ktime_us_delta(ktime_get(), start);
+	dev->stats->fw_wait_hist[type][fw_latency_bin(delta_us)]++;
+
+	return delta_us > 0 ? delta_us : 0;
+}
+
+
+int wait_for_scan_abort(struct mac80211_dev *dev)
+{
+	s64 us;
+
+	us = wait_for_fw_event(dev, &dev->scan_abort_done,
+			       SCAN_ABORT_TIMEOUT_TICKS, FW_WAIT_SCAN_ABORT);
+
+	if (us < 0) {
 		UMAC_PRINT("%s-UMAC: No SCAN_ABORT_DONE after %ld ticks\n",
 			   dev->name, SCAN_ABORT_TIMEOUT_TICKS);
 		return -1;
 	}
 
-	UCCP_DEBUG_SCAN("%s-UMAC: Scan abort complete after %d timer ticks\n",
+	UCCP_DEBUG_SCAN("%s-UMAC: Scan abort complete after %lld us\n",
 					dev->name,
-					count);
+					us);
 
 	return 0;
 
@@ -144,26 +172,21 @@ check_scan_abort_complete:
 
 int wait_for_cancel_hw_roc(struct mac80211_dev *dev)
 {
-	int count = 0;
-
-check_cancel_hw_roc_complete:
-	if (!dev->cancel_hw_roc_done && (count < CANCEL_HW_ROC_TIMEOUT_TICKS)) {
-		current->state = TASK_INTERRUPTIBLE;
-		if (schedule_timeout(1) == 0)
-			count++;
-		goto check_cancel_hw_roc_complete;
-	}
+	s64 us;
 
-	if (!dev->cancel_hw_roc_done) {
+	us = wait_for_fw_event(dev, &dev->cancel_hw_roc_done,
+			       CANCEL_HW_ROC_TIMEOUT_TICKS, FW_WAIT_CANCEL_ROC);
+
+	if (us < 0) {
 		pr_err("%s-UMAC: Warning: Didn't get CANCEL_HW_ROC_DONE after %ld timer ticks\n",
 		       dev->name,
 		       CANCEL_HW_ROC_TIMEOUT_TICKS);
 		return -1;
 	}
 
-	UCCP_DEBUG_ROC("%s-UMAC: Cancel HW RoC complet after %d timer ticks\n",
+	UCCP_DEBUG_ROC("%s-UMAC: Cancel HW RoC complet after %lld us\n",
 					dev->name,
-					count);
+					us);
 
 	return 0;
 
@@ -171,28 +194,19 @@ check_cancel_hw_roc_complete:
 
 int wait_for_channel_prog_complete(struct mac80211_dev *dev)
 {
-	int count;
-
-	count = 0;
-
-check_ch_prog_complete:
-	if (!dev->chan_prog_done && (count < CH_PROG_TIMEOUT_TICKS)) {
-		current->state = TASK_INTERRUPTIBLE;
+	s64 us;
 
-		if (schedule_timeout(1) == 0)
-			count++;
-
-		goto check_ch_prog_complete;
-	}
+	us = wait_for_fw_event(dev, &dev->chan_prog_done,
+			       CH_PROG_TIMEOUT_TICKS, FW_WAIT_CH_PROG);
 
-	if (!dev->chan_prog_done) {
+	if (us < 0) {
 		UMAC_PRINT("%s-UMAC: No channel prog done after %ld ticks\n",
 			   dev->name, CH_PROG_TIMEOUT_TICKS);
 		return -1;
 	}
 
-	UCCP_DEBUG_CORE("%s-UMAC: Channel Prog Complete after %d timer ticks\n",
-			dev->name, count);
+	UCCP_DEBUG_CORE("%s-UMAC: Channel Prog Complete after %lld us\n",
+			dev->name, us);
 
 	return 0;
 
@@ -200,57 +214,96 @@ check_ch_prog_complete:
 
 int wait_for_tx_deinit_complete(struct mac80211_dev *dev)
 {
-	int count = 0;
-
-check_tx_deinit_complete:
-	if (!dev->tx_deinit_complete &&
-	    (count < TX_DEINIT_TIMEOUT_TICKS)) {
-		current->state = TASK_INTERRUPTIBLE;
-		if (schedule_timeout(1) == 0)
-			count++;
-		goto check_tx_deinit_complete;
-	}
+	s64 us;
+
+	us = wait_for_fw_event(dev, &dev->tx_deinit_complete,
+			       TX_DEINIT_TIMEOUT_TICKS, FW_WAIT_TX_DEINIT);
 
-	if (!dev->tx_deinit_complete) {
+	if (us < 0) {
 		pr_err("%s-UMAC: Warning: Tx discard failed after %ld timer ticks\n",
 		       dev->name,
 		       TX_DEINIT_TIMEOUT_TICKS);
 		return -1;
 	}
 
-	UCCP_DEBUG_CORE("Discarded Tx successfully in %d timer ticks\n",
-			count);
+	UCCP_DEBUG_CORE("Discarded Tx successfully in %lld us\n",
+			us);
 
 	return 0;
 }
 
+void key_ack_hist_update(struct mac80211_dev *dev,
+			 ktime_t start)
+{
+	s64 delta_us = ktime_us_delta(ktime_get(), start);
+
+	dev->stats->key_ack_hist[fw_latency_bin(delta_us)]++;
+}
+
+void chan_op_hist_update(struct mac80211_dev *dev,
+			 enum chan_op_type type,
+			 ktime_t start)
+{
+	s64 delta_us = ktime_us_delta(ktime_get(), start);
+
+	dev->stats->chan_op_hist[type][fw_latency_bin(delta_us)]++;
+
+	UCCP_DEBUG_CORE("%s-UMAC: Channel op %d done in %lld us\n",
+			dev->name, type, delta_us);
+}
+
+
+void tx_flush_hist_update(struct mac80211_dev *dev, ktime_t start)
+{
+	s64 delta_us = ktime_us_delta(ktime_get(), start);
+	int bin = 0;
+
+	if (delta_us > 0)
+		bin = fls64((u64)delta_us >> TX_FLUSH_HIST_SHIFT);
+
+	if (bin >= TX_FLUSH_HIST_BINS)
+		bin = TX_FLUSH_HIST_BINS - 1;
+
+	dev->stats->tx_flush_hist[bin]++;
+}
+
+
+static bool tx_queue_drained(struct mac80211_dev *dev,
+			     unsigned int queue)
+{
+	bool drained;
+
+	spin_lock_bh(&dev->tx.lock);
+	drained = !dev->tx.outstanding_tokens[queue];
+	spin_unlock_bh(&dev->tx.lock);
+
+	return drained;
+}
+
+
 int wait_for_tx_queue_flush_complete(struct mac80211_dev *dev,
 				     unsigned int queue)
 {
-	int count = 0;
-
-check_tx_queue_flush_complete:
-	if (dev->tx.outstanding_tokens[queue] &&
-	    (count < QUEUE_FLUSH_TIMEOUT_TICKS)) {
-		current->state = TASK_INTERRUPTIBLE;
-		if (schedule_timeout(1) == 0)
-			count++;
-		goto check_tx_queue_flush_complete;
-	}
+	ktime_t start = ktime_get();
 
-	if (dev->tx.outstanding_tokens[queue]) {
+	if (!wait_event_timeout(dev->tx.flush_wq,
+				tx_queue_drained(dev, queue),
+				QUEUE_FLUSH_TIMEOUT_TICKS)) {
 		pr_err("%s-UMAC: Warning: Tx Queue %d flush failed pending: %d after %ld timer ticks\n",
 		       dev->name,
 		       queue,
 		       dev->tx.outstanding_tokens[queue],
 		       QUEUE_FLUSH_TIMEOUT_TICKS);
+		dev->stats->tx_flush_timeouts++;
 		return -1;
 	}
 
+	tx_flush_hist_update(dev, start);
+
 	UCCP_DEBUG_ROC("%s-UMAC:", dev->name);
-	UCCP_DEBUG_ROC("Flushed Tx queue %d successfully in %d timer ticks\n",
+	UCCP_DEBUG_ROC("Flushed Tx queue %d successfully in %lld us\n",
 		       queue,
-			   count);
+		       ktime_us_delta(ktime_get(), start));
 
 	return 0;
 
@@ -259,28 +312,19 @@ check_tx_queue_flush_complete:
 
 int wait_for_reset_complete(struct mac80211_dev *dev)
 {
-	int count;
-
-	count = 0;
-
-check_reset_complete:
-	if (!dev->reset_complete && (count < RESET_TIMEOUT_TICKS)) {
-		current->state = TASK_INTERRUPTIBLE;
-
-		if (schedule_timeout(1) == 0)
-			count++;
+	s64 us;
 
-		goto check_reset_complete;
-	}
+	us = wait_for_fw_event(dev, &dev->reset_complete,
+			       RESET_TIMEOUT_TICKS, FW_WAIT_RESET);
 
-	if (!dev->reset_complete) {
+	if (us < 0) {
 		UMAC_PRINT("%s-UMAC: No reset complete after %ld ticks\n",
 			   dev->name, RESET_TIMEOUT_TICKS);
 		return -1;
 	}
 
-	UMAC_PRINT("%s-UMAC: Reset complete after %d timer ticks\n",
-		   dev->name, count);
+	UMAC_PRINT("%s-UMAC: Reset complete after %lld us\n",
+		   dev->name, us);
 	return 0;
 
 }
@@ -336,84 +380,441 @@ prog_umac_fail:
 	return;
 }
 
-void packet_generation(unsigned long data)
+static int pkt_gen_queue(struct mac80211_dev *dev,
+			 unsigned int desc)
 {
-		struct mac80211_dev *dev = (struct mac80211_dev *)data;
-		unsigned char *mac_addr = dev->if_mac_addresses[0].addr;
-		struct ieee80211_hdr hdr = {0};
-		struct sk_buff *skb;
-		unsigned char broad_addr[6] = {0xff, 0xff, 0xff,
-					       0xff, 0xff, 0xff};
-		u16 hdrlen = 26;
+	unsigned long acs = dev->params->pkt_gen_acs;
+	unsigned int nth = desc % hweight_long(acs);
+	int ac;
+
+	/* Descriptors are spread round robin over the selected ACs */
+	for_each_set_bit(ac, &acs, WLAN_AC_BCN) {
+		if (!nth--)
+			break;
+	}
+
+	return ac;
+}
 
-		/*LOOP_START*/
-		/*PREPARE_SKB_LIST and SEND*/
 
+static int pkt_gen_build_frames(struct mac80211_dev *dev,
+				unsigned int desc)
+{
+	unsigned char *mac_addr = dev->if_mac_addresses[0].addr;
+	struct ieee80211_hdr hdr = {0};
+	struct sk_buff *skb;
+	unsigned char broad_addr[6] = {0xff, 0xff, 0xff,
+				       0xff, 0xff, 0xff};
+	u16 hdrlen = PKT_GEN_HDR_LEN;
+	unsigned int i;
+
+	ether_addr_copy(hdr.addr1, broad_addr);
+	ether_addr_copy(hdr.addr2, mac_addr);
+	ether_addr_copy(hdr.addr3, bss_addr);
+	hdr.frame_control = cpu_to_le16(IEEE80211_FTYPE_DATA |
+					IEEE80211_STYPE_QOS_DATA);
+
+	for (i = 0; i < dev->params->pkt_gen_aggr; i++) {
 		skb = alloc_skb(dev->params->payload_length + hdrlen,
-				GFP_ATOMIC);
-		ether_addr_copy(hdr.addr1, broad_addr);
-		ether_addr_copy(hdr.addr2, mac_addr);
-		ether_addr_copy(hdr.addr3, bss_addr);
-		hdr.frame_control = cpu_to_le16(IEEE80211_FTYPE_DATA |
-						IEEE80211_STYPE_QOS_DATA);
+				GFP_KERNEL);
+		if (!skb)
+			return -ENOMEM;
+
 		memcpy(skb_put(skb, hdrlen), &hdr, hdrlen);
 		memset(skb_put(skb, dev->params->payload_length), 0xAB,
-			dev->params->payload_length);
+		       dev->params->payload_length);
+
+		skb_queue_tail(&dev->tx.proc_tx_list[desc], skb);
+	}
+
+	return 0;
+}
+
+
+static enum hrtimer_restart pkt_gen_gap_expired(struct hrtimer *timer)
+{
+	struct mac80211_dev *dev = container_of(timer,
+						struct mac80211_dev,
+						pkt_gen.gap_timer);
+
+	tasklet_schedule(&dev->proc_tx_tasklet);
+
+	return HRTIMER_NORESTART;
+}
+
+
+void pkt_gen_init(struct mac80211_dev *dev)
+{
+	struct pkt_gen *gen = &dev->pkt_gen;
+
+	spin_lock_init(&gen->lock);
+	hrtimer_init(&gen->gap_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	gen->gap_timer.function = pkt_gen_gap_expired;
+	pkt_gen_reset(dev);
+}
+
+
+/* Called when production mode is (re)started: the TX path of a previous
+ * run has been torn down, so no TX_DONE is pending for its descriptors.
+ */
+void pkt_gen_reset(struct mac80211_dev *dev)
+{
+	struct pkt_gen *gen = &dev->pkt_gen;
+
+	spin_lock_bh(&gen->lock);
+	gen->running = false;
+	gen->ready_bmp = 0;
+	gen->in_flight = 0;
+	spin_unlock_bh(&gen->lock);
+}
+
+
+int pkt_gen_start(struct mac80211_dev *dev,
+		  int count)
+{
+	struct pkt_gen *gen = &dev->pkt_gen;
+	unsigned int desc;
+	bool busy;
+	int ret = 0;
+
+	/* The frame lists of descriptors still with the FW are reused only
+	 * once their TX_DONE is back.
+	 */
+	spin_lock_bh(&gen->lock);
+	busy = gen->running || gen->in_flight;
+	spin_unlock_bh(&gen->lock);
+
+	if (busy) {
+		pr_err("%s: Generator descriptors are still in flight\n",
+		       dev->name);
+		return -EBUSY;
+	}
+
+	if (!dev->params->pkt_gen_descs ||
+	    dev->params->pkt_gen_descs > dev->tx.num_descs ||
+	    dev->params->pkt_gen_descs > BITS_PER_LONG) {
+		pr_err("%s: pkt_gen_descs should be 1 to %d\n",
+		       dev->name,
+		       dev->tx.num_descs);
+		return -EINVAL;
+	}
+
+	for (desc = 0; desc < dev->params->pkt_gen_descs; desc++) {
+		ret = pkt_gen_build_frames(dev, desc);
+		if (ret) {
+			pr_err("%s: No memory for the generator frames\n",
+			       dev->name);
+			break;
+		}
+	}
+
+	if (ret) {
+		for (desc = 0; desc < dev->params->pkt_gen_descs; desc++)
+			skb_queue_purge(&dev->tx.proc_tx_list[desc]);
+		return ret;
+	}
+
+	spin_lock_bh(&gen->lock);
+	gen->ready_bmp = BIT(dev->params->pkt_gen_descs) - 1;
+	gen->in_flight = 0;
+	gen->remaining = count;
+	gen->frames = 0;
+	gen->bytes = 0;
+	gen->start = ktime_get();
+	gen->end = ktime_set(0, 0);
+	gen->last_send = ktime_set(0, 0);
+	gen->running = true;
+	spin_unlock_bh(&gen->lock);
+
+	tasklet_schedule(&dev->proc_tx_tasklet);
+
+	return 0;
+}
+
+
+void pkt_gen_stop(struct mac80211_dev *dev)
+{
+	struct pkt_gen *gen = &dev->pkt_gen;
+	unsigned long ready;
+	unsigned int desc;
+
+	spin_lock_bh(&gen->lock);
+	gen->running = false;
+	spin_unlock_bh(&gen->lock);
+
+	hrtimer_cancel(&gen->gap_timer);
+	tasklet_kill(&dev->proc_tx_tasklet);
+
+	/* Frames still with the FW are released on their TX_DONE */
+	spin_lock_bh(&gen->lock);
+	ready = gen->ready_bmp;
+	gen->ready_bmp = 0;
+
+	if (!ktime_to_ns(gen->end))
+		gen->end = ktime_get();
+	spin_unlock_bh(&gen->lock);
+
+	for_each_set_bit(desc, &ready, BITS_PER_LONG)
+		skb_queue_purge(&dev->tx.proc_tx_list[desc]);
+}
+
+
+void pkt_gen_rate(struct mac80211_dev *dev,
+		  unsigned long long *fps,
+		  unsigned long long *kbps)
+{
+	struct pkt_gen *gen = &dev->pkt_gen;
+	ktime_t end = gen->end;
+	s64 elapsed_us;
+
+	*fps = 0;
+	*kbps = 0;
+
+	if (!ktime_to_ns(gen->start))
+		return;
+
+	if (!ktime_to_ns(end))
+		end = ktime_get();
+
+	elapsed_us = ktime_us_delta(end, gen->start);
+
+	if (elapsed_us <= 0)
+		return;
+
+	*fps = div64_u64(gen->frames * USEC_PER_SEC, elapsed_us);
+	*kbps = div64_u64(gen->bytes * 8 * MSEC_PER_SEC, elapsed_us);
+}
+
+
+/* Sends every descriptor that is back from the FW, honouring the configured
+ * gap between two descriptors. Runs from proc_tx_tasklet.
+ */
+void packet_generation(unsigned long data)
+{
+	struct mac80211_dev *dev = (struct mac80211_dev *)data;
+	struct pkt_gen *gen = &dev->pkt_gen;
+	struct sk_buff_head *skb_list;
+	unsigned int gap_us = dev->params->pkt_gen_gap_us;
+	unsigned int desc;
+	s64 idle_us;
+	int ret;
+
+	spin_lock_bh(&gen->lock);
+
+	while (gen->running && gen->ready_bmp && gen->remaining) {
+		if (gap_us && ktime_to_ns(gen->last_send)) {
+			idle_us = ktime_us_delta(ktime_get(), gen->last_send);
+
+			if (idle_us < gap_us) {
+				hrtimer_start(&gen->gap_timer,
+					      ns_to_ktime((gap_us - idle_us) *
+							  NSEC_PER_USEC),
+					      HRTIMER_MODE_REL);
+				break;
+			}
+		}
+
+		desc = __ffs(gen->ready_bmp);
+		__clear_bit(desc, &gen->ready_bmp);
+		skb_list = &dev->tx.proc_tx_list[desc];
+
+		/* Trim the last descriptor to the requested frame count */
+		if (gen->remaining > 0) {
+			while (skb_queue_len(skb_list) > gen->remaining)
+				dev_kfree_skb_any(skb_dequeue_tail(skb_list));
+
+			gen->remaining -= skb_queue_len(skb_list);
+		}
+
+		gen->in_flight++;
+		gen->last_send = ktime_get();
+		spin_unlock_bh(&gen->lock);
+
+		ret = uccp420wlan_proc_tx(desc, pkt_gen_queue(dev, desc));
+
+		spin_lock_bh(&gen->lock);
+
+		if (ret < 0) {
+			pr_err("%s: Generator failed on descriptor %d: %d\n",
+			       dev->name,
+			       desc,
+			       ret);
+			gen->in_flight--;
+			skb_queue_purge(skb_list);
+		}
+	}
+
+	if ((!gen->running || !gen->remaining) && !gen->in_flight &&
+	    !ktime_to_ns(gen->end))
+		gen->end = ktime_get();
+
+	spin_unlock_bh(&gen->lock);
+}
+
+
+static void vif_bcn_offload_stop(struct umac_vif *uvif)
+{
+	if (!uvif->bcn_offloaded)
+		return;
+
+	uccp420wlan_prog_vif_beacon(uvif->vif_index,
+				    uvif->vif->addr,
+				    0,
+				    0,
+				    0,
+				    NULL,
+				    0);
+	uvif->bcn_offloaded = false;
+}
+
+
+static bool vif_bcn_tim_changed(struct umac_vif *uvif,
+				struct sk_buff *skb,
+				u16 tim_offset,
+				u16 tim_length)
+{
+	unsigned char *tim;
+	unsigned int len;
+
+	/* The DTIM count is maintained by the firmware */
+	if (tim_length < 3)
+		return false;
+
+	tim = skb->data + tim_offset + 3;
+	len = min_t(unsigned int, tim_length - 3, MAX_BCN_TIM_LEN);
+
+	if ((len == uvif->bcn_tim_len) && !memcmp(uvif->bcn_tim, tim, len))
+		return false;
+
+	memcpy(uvif->bcn_tim, tim, len);
+	uvif->bcn_tim_len = len;
+
+	return true;
+}
+
+
+/* Beacon offload: the template is handed to the firmware which then sends
+ * the beacons on its own. The host timer keeps running at the beacon
+ * interval so that mac80211 updates the TIM/DTIM state, but the template is
+ * only uploaded again when mac80211 changed it or the TIM changed. Returns
+ * false if the host has to send this beacon.
+ */
+static bool vif_bcn_offload(struct umac_vif *uvif,
+			    struct sk_buff *skb,
+			    u16 tim_offset,
+			    u16 tim_length)
+{
+	struct ieee80211_vif *vif = uvif->vif;
+	struct ieee80211_channel *chan = vif->bss_conf.chandef.chan;
+	bool tim_changed;
+
+	/* CSA changes the template on every beacon */
+	if (!uvif->dev->params->bcn_offload || vif->csa_active || !chan ||
+	    (skb->len > MAX_BCN_TEMPLATE_LEN)) {
+		vif_bcn_offload_stop(uvif);
+		return false;
+	}
+
+	tim_changed = vif_bcn_tim_changed(uvif, skb, tim_offset, tim_length);
+
+	if (uvif->bcn_offloaded && !uvif->bcn_tmpl_dirty && !tim_changed)
+		return true;
+
+	if (uccp420wlan_prog_vif_beacon(uvif->vif_index,
+					vif->addr,
+					vif->bss_conf.beacon_int,
+					vif->bss_conf.dtim_period,
+					ieee80211_frequency_to_channel(
+						chan->center_freq),
+					skb->data,
+					skb->len)) {
+		uvif->bcn_offloaded = false;
+		return false;
+	}
 
-		/*LOOP_END*/
-		skb_queue_tail(&dev->tx.proc_tx_list[0], skb);
-		uccp420wlan_proc_tx();
+	uvif->bcn_offloaded = true;
+	uvif->bcn_tmpl_dirty = false;
+	uvif->dev->stats->bcn_tmpl_uploads++;
 
+	return true;
 }
 
+
 static void vif_bcn_timer_expiry(unsigned long data)
 {
 	struct umac_vif *uvif = (struct umac_vif *)data;
-	struct sk_buff *skb, *temp;
+	struct sk_buff *skb, *bcn = NULL;
 	struct sk_buff_head bcast_frames;
+	u16 tim_offset = 0, tim_length = 0;
+	bool offloaded = false;
 
 	if (uvif->vif->bss_conf.enable_beacon == false)
 		return;
 
 	if (uvif->vif->type == NL80211_IFTYPE_AP) {
-		temp = skb = ieee80211_beacon_get(uvif->dev->hw, uvif->vif);
+		skb = ieee80211_beacon_get_tim(uvif->dev->hw,
+					       uvif->vif,
+					       &tim_offset,
+					       &tim_length);
 
 		if (!skb) {
 			/* No beacon, so dont transmit braodcast frames*/
 			goto reschedule_timer;
 		}
 
+		bcn = skb;
+		umac_tx_meta_no_stamp(bcn);
 		skb_queue_head_init(&bcast_frames);
-		skb->priority = 1;
-		skb_queue_tail(&bcast_frames, skb);
 
 		skb = ieee80211_get_buffered_bc(uvif->dev->hw, uvif->vif);
 
 		while (skb) {
-			/* Hack: skb->priority is used to indicate more
-			 * frames
-			 */
-			skb->priority = 1;
+			umac_tx_meta_no_stamp(skb);
 			skb_queue_tail(&bcast_frames, skb);
-			temp = skb;
 			skb = ieee80211_get_buffered_bc(uvif->dev->hw,
 							uvif->vif);
 		}
 
-		if (temp)
-			temp->priority = 0;
+		/* The buffered broadcast frames come out on the DTIM beacons
+		 * of this timer, the firmware has its own TBTT. While there is
+		 * such traffic the host sends the beacons, so that the frames
+		 * follow the DTIM beacon announcing them, until a DTIM beacon
+		 * has nothing to release.
+		 */
+		if (!skb_queue_empty(&bcast_frames))
+			uvif->bcn_bc_host = true;
+		else if ((tim_length < 3) || !bcn->data[tim_offset + 2])
+			uvif->bcn_bc_host = false;
+
+		if (uvif->bcn_bc_host)
+			vif_bcn_offload_stop(uvif);
+		else
+			offloaded = vif_bcn_offload(uvif,
+						    bcn,
+						    tim_offset,
+						    tim_length);
+
+		if (offloaded) {
+			dev_kfree_skb_any(bcn);
+			bcn = NULL;
+		} else {
+			uvif->dev->stats->bcn_host_tx++;
+		}
 
 		spin_lock_bh(&uvif->dev->bcast_lock);
 
-		while ((skb = skb_dequeue(&bcast_frames))) {
-			/* For a Beacon queue we will let the frames pass
-			 * through irrespective of the current channel context.
-			 * The FW will take care of transmitting them in the
-			 * appropriate channel. Hence pass the interfaces
-			 * channel context instead of the actual current channel
-			 * context.
+		/* For a Beacon queue we will let the frames pass through
+		 * irrespective of the current channel context. The FW will take
+		 * care of transmitting them in the appropriate channel. Hence
+		 * pass the interfaces channel context instead of the actual
+		 * current channel context.
+		 */
+		if (bcn) {
+			/* Hack: skb->priority is used to indicate more
+			 * frames
 			 */
-			uccp420wlan_tx_frame(skb,
+			bcn->priority = !skb_queue_empty(&bcast_frames);
+			uccp420wlan_tx_frame(bcn,
 					     NULL,
 					     uvif->dev,
 #ifdef MULTI_CHAN_SUPPORT
@@ -422,8 +823,25 @@ static void vif_bcn_timer_expiry(unsigned long data)
 					     true);
 		}
 
+		/* The buffered frames are packed into as few descriptors as
+		 * possible rather than one TX command each
+		 */
+		uccp420wlan_tx_bcast_burst(uvif->dev,
+					   uvif,
+#ifdef MULTI_CHAN_SUPPORT
+					   uvif->chanctx->index,
+#endif
+					   &bcast_frames);
+
 		spin_unlock_bh(&uvif->dev->bcast_lock);
 
+		/* No beacon TX_DONE to re-arm the timer */
+		if (offloaded)
+			mod_timer(&uvif->bcn_timer,
+				  jiffies +
+				  msecs_to_jiffies(
+					uvif->vif->bss_conf.beacon_int));
+
 		if (uvif->vif->csa_active) {
 			if (ieee80211_csa_is_complete(uvif->vif))
 				ieee80211_csa_finish(uvif->vif);
@@ -434,6 +852,8 @@ static void vif_bcn_timer_expiry(unsigned long data)
 		if (!skb)
 			goto reschedule_timer;
 
+		umac_tx_meta_no_stamp(skb);
+
 		/* For a Beacon queue we will let the frames pass through
 		 * irrespective of the current channel context. The FW will take
 		 * care of transmitting them in the appropriate channel.  Hence
@@ -461,10 +881,14 @@ int uccp420wlan_core_init(struct mac80211_dev *dev, unsigned int ftm)
 
 	UCCP_DEBUG_CORE("%s-UMAC: Init called\n", dev->name);
 	spin_lock_init(&tsf_lock);
-	uccp420wlan_lmac_if_init(dev, dev->name);
+
+	ret = uccp420wlan_lmac_if_init(dev, dev->name);
+
+	if (ret)
+		return ret;
 
 	/* Enable the LMAC, set defaults and initialize TX */
-	dev->reset_complete = 0;
+	reinit_completion(&dev->reset_complete);
 
 	UMAC_PRINT("%s-UMAC: Reset (ENABLE)\n", dev->name);
 
@@ -473,7 +897,7 @@ int uccp420wlan_core_init(struct mac80211_dev *dev, unsigned int ftm)
 		goto lmac_deinit;
 	}
 
-	if (hal_ops.init_bufs(NUM_TX_DESCS,
+	if (hal_ops.init_bufs(dev->tx.num_descs,
 			      NUM_RX_BUFS_2K,
 			      NUM_RX_BUFS_12K,
 			      dev->params->max_data_size) < 0) {
@@ -528,11 +952,13 @@ void uccp420wlan_core_deinit(struct mac80211_dev *dev, unsigned int ftm)
 
 	UCCP_DEBUG_CORE("%s-UMAC: De-init called\n", dev->name);
 
+	uccp420wlan_chan_prog_flush(dev);
+
 	/* De initialize tx  and disable LMAC*/
 	uccp420wlan_tx_deinit(dev);
 
 	/* Disable the LMAC */
-	dev->reset_complete = 0;
+	reinit_completion(&dev->reset_complete);
 	UMAC_PRINT("%s-UMAC: Reset (DISABLE)\n", dev->name);
 
 	if (ftm)
@@ -609,13 +1035,12 @@ void uccp420wlan_vif_add(struct umac_vif *uvif)
 		  IF_ADD);
 
 	/* Reprogram retry counts */
-	CALL_UMAC(uccp420wlan_prog_short_retry,
-		  uvif->vif_index, uvif->vif->addr,
-		  conf->short_frame_max_tx_count);
-
-	CALL_UMAC(uccp420wlan_prog_long_retry,
-		  uvif->vif_index, uvif->vif->addr,
-		  conf->long_frame_max_tx_count);
+	uccp420wlan_vif_cfg_begin(uvif->vif_index);
+	uccp420wlan_prog_short_retry(uvif->vif_index, uvif->vif->addr,
+				     conf->short_frame_max_tx_count);
+	uccp420wlan_prog_long_retry(uvif->vif_index, uvif->vif->addr,
+				    conf->long_frame_max_tx_count);
+	CALL_UMAC(uccp420wlan_vif_cfg_end, uvif->vif_index);
 
 	if (uvif->vif->type == NL80211_IFTYPE_AP) {
 		/* Program the EDCA params */
@@ -670,6 +1095,7 @@ void uccp420wlan_vif_remove(struct umac_vif *uvif)
 	case NL80211_IFTYPE_AP:
 		type = IF_MODE_AP;
 		del_timer(&uvif->bcn_timer);
+		uvif->bcn_offloaded = false;
 		break;
 	default:
 		WARN_ON(1);
@@ -785,6 +1211,8 @@ void uccp420wlan_vif_bss_info_changed(struct umac_vif *uvif,
 	UCCP_DEBUG_CORE("%s-CORE: BSS INFO changed %d, %d, %d\n",
 		uvif->dev->name, uvif->vif_index, uvif->vif->type, changed);
 
+	/* All the VIF_CFG changes of this callback go out as one command */
+	uccp420wlan_vif_cfg_begin(uvif->vif_index);
 
 	if (changed & BSS_CHANGED_BSSID)
 		CALL_UMAC(uccp420wlan_prog_vif_bssid,
@@ -952,6 +1380,12 @@ void uccp420wlan_vif_bss_info_changed(struct umac_vif *uvif,
 
 		break;
 	case NL80211_IFTYPE_AP:
+		/* Picked up by the beacon timer */
+		if (changed & (BSS_CHANGED_BEACON |
+			       BSS_CHANGED_BEACON_INT |
+			       BSS_CHANGED_BEACON_INFO))
+			uvif->bcn_tmpl_dirty = true;
+
 		if (changed & BSS_CHANGED_BEACON_ENABLED) {
 			if (uvif->vif->bss_conf.enable_beacon == true) {
 				bcn_int = uvif->vif->bss_conf.beacon_int;
@@ -962,6 +1396,8 @@ void uccp420wlan_vif_bss_info_changed(struct umac_vif *uvif,
 
 			} else {
 				del_timer(&uvif->bcn_timer);
+				vif_bcn_offload_stop(uvif);
+				uvif->bcn_bc_host = false;
 			}
 		}
 
@@ -983,10 +1419,10 @@ void uccp420wlan_vif_bss_info_changed(struct umac_vif *uvif,
 		break;
 	default:
 		WARN_ON(1);
-		return;
+		break;
 	}
 prog_umac_fail:
-	return;
+	uccp420wlan_vif_cfg_end(uvif->vif_index);
 }
 
 
@@ -996,7 +1432,7 @@ void uccp420wlan_reset_complete(char *lmac_version, void *context)
 
 	memcpy(dev->stats->uccp420_lmac_version, lmac_version, 5);
 	dev->stats->uccp420_lmac_version[5] = '\0';
-	dev->reset_complete = 1;
+	complete(&dev->reset_complete);
 }
 
 
@@ -1068,13 +1504,74 @@ void uccp420wlan_rf_calib_data(struct umac_event_rf_calib_data *rf_data,
 	memcpy(dev->stats->rf_calib_data, rf_data->rf_calib_data,
 	       rf_data->rf_calib_data_length);
 }
+
+
+/* The NOA event only says that the GO is present again, the length of the
+ * presence period comes from the NoA schedule advertised by the GO (or the
+ * beacon interval if there is none).
+ */
+static void noa_presence_start(struct umac_vif *uvif)
+{
+	struct ieee80211_p2p_noa_attr *noa_attr;
+	unsigned int presence_us;
+	unsigned int interval, duration;
+
+	noa_attr = &uvif->vif->bss_conf.p2p_noa_attr;
+	interval = le32_to_cpu(noa_attr->desc[0].interval);
+	duration = le32_to_cpu(noa_attr->desc[0].duration);
+
+	if (noa_attr->desc[0].count && (interval > duration))
+		presence_us = interval - duration;
+	else
+		presence_us = uvif->vif->bss_conf.beacon_int * 1024;
+
+	uvif->noa_presence_end = ktime_add_us(ktime_get(), presence_us);
+}
+
+
+/* Number of NoA held frames that fit in what is left of the presence period,
+ * at least one since the firmware says the GO is present.
+ */
+static unsigned int noa_release_budget(struct umac_vif *uvif)
+{
+	s64 remain_us = ktime_us_delta(uvif->noa_presence_end, ktime_get());
+
+	if (remain_us <= NOA_FRAME_AIRTIME_US)
+		return 1;
+
+	return div_u64(remain_us, NOA_FRAME_AIRTIME_US);
+}
+
+
+/* Move up to budget frames from the NoA queue to the release list, they go
+ * to the pending queues in one go so that they can be aggregated.
+ */
+static void noa_release_frames(struct mac80211_dev *dev,
+			       struct umac_vif *uvif,
+			       struct sk_buff_head *release)
+{
+	unsigned int budget = noa_release_budget(uvif);
+	struct sk_buff *skb;
+
+	while (budget && (skb = __skb_dequeue(&uvif->noa_que))) {
+		__skb_queue_tail(release, skb);
+		budget--;
+	}
+
+	if (skb_queue_len(release)) {
+		dev->stats->noa_release_batches++;
+		dev->stats->noa_release_frames += skb_queue_len(release);
+	}
+}
+
+
 void uccp420wlan_noa_event(int event, struct umac_event_noa *noa, void *context,
 			   struct sk_buff *skb)
 {
 	struct mac80211_dev  *dev = (struct mac80211_dev *)context;
 	struct ieee80211_vif *vif;
 	struct umac_vif *uvif;
-	bool transmit = false;
+	struct sk_buff_head release;
 #ifdef MULTI_CHAN_SUPPORT
 	int curr_chanctx_idx = -1;
 #endif
@@ -1090,6 +1587,8 @@ void uccp420wlan_noa_event(int event, struct umac_event_noa *noa, void *context,
 
 	uvif = (struct umac_vif *)vif->drv_priv;
 
+	__skb_queue_head_init(&release);
+
 	spin_lock_bh(&uvif->noa_que.lock);
 
 	if (event == FROM_TX) {
@@ -1097,16 +1596,12 @@ void uccp420wlan_noa_event(int event, struct umac_event_noa *noa, void *context,
 			if (!uvif->noa_tx_allowed || skb_peek(&uvif->noa_que))
 				__skb_queue_tail(&uvif->noa_que, skb);
 			else
-				transmit = true;
+				__skb_queue_tail(&release, skb);
 		} else
-			transmit = true;
+			__skb_queue_tail(&release, skb);
 	} else if (event == FROM_TX_DONE) {
-		if (uvif->noa_active && uvif->noa_tx_allowed) {
-			skb = __skb_dequeue(&uvif->noa_que);
-
-			if (skb)
-				transmit = true;
-		}
+		if (uvif->noa_active && uvif->noa_tx_allowed)
+			noa_release_frames(dev, uvif, &release);
 	} else { /* event = FROM_EVENT_NOA */
 
 		uvif->noa_active = noa->noa_active;
@@ -1120,9 +1615,8 @@ void uccp420wlan_noa_event(int event, struct umac_event_noa *noa, void *context,
 			uvif->noa_tx_allowed = noa->ap_present;
 
 			if (uvif->noa_tx_allowed) {
-				skb = __skb_dequeue(&uvif->noa_que);
-				if (skb)
-					transmit = true;
+				noa_presence_start(uvif);
+				noa_release_frames(dev, uvif, &release);
 			}
 		} else {
 			UCCP_DEBUG_CORE("%s: noa active = %d\n",
@@ -1142,20 +1636,20 @@ void uccp420wlan_noa_event(int event, struct umac_event_noa *noa, void *context,
 
 	rcu_read_unlock();
 
-	if (transmit) {
+	if (!skb_queue_len(&release))
+		return;
+
 #ifdef MULTI_CHAN_SUPPORT
-		spin_lock_bh(&dev->chanctx_lock);
-		curr_chanctx_idx = dev->curr_chanctx_idx;
-		spin_unlock_bh(&dev->chanctx_lock);
+	spin_lock_bh(&dev->chanctx_lock);
+	curr_chanctx_idx = dev->curr_chanctx_idx;
+	spin_unlock_bh(&dev->chanctx_lock);
 #endif
-		uccp420wlan_tx_frame(skb,
-				     NULL,
-				     dev,
+
+	uccp420wlan_tx_noa_release(dev,
 #ifdef MULTI_CHAN_SUPPORT
-				     curr_chanctx_idx,
+				   curr_chanctx_idx,
 #endif
-				     false);
-	}
+				   &release);
 }
 
 #if 0
@@ -1392,12 +1886,261 @@ void uccp420wlan_rx_frame(struct sk_buff *skb, void *context)
 }
 
 
+static void chan_prog_follow_up(struct mac80211_dev *dev,
+				struct chan_prog_req *req)
+{
+	/* RPU expects to program the associated channel
+	 * every time it changes, else it leads to
+	 * disconnections.
+	 */
+	if (req->op_chan)
+		uccp420wlan_prog_vif_op_channel(req->vif_index,
+						req->vif_addr,
+						req->pri_chan);
+
+	if (req->radar_start)
+		uccp420wlan_prog_radar_detect(RADAR_DETECT_OP_START);
+
+	chan_op_hist_update(dev, CHAN_OP_PROG, req->start);
+}
+
+
+/* The channel is sent but not acked yet when an entry of the VIF is still
+ * queued, its follow up then joins that of the last such entry. Returns
+ * false if the FW is already on the channel.
+ */
+static bool chan_prog_attach(struct mac80211_dev *dev,
+			     struct chan_prog_req *req)
+{
+	struct chan_prog_req *pend;
+	unsigned int i;
+	bool attached = false;
+
+	spin_lock_bh(&dev->chan_prog_lock);
+
+	for (i = dev->chan_prog_tail; i != dev->chan_prog_head; i--) {
+		pend = &dev->chan_prog_q[(i - 1) % MAX_CHAN_PROG_PENDING];
+
+		if (pend->vif_index != req->vif_index)
+			continue;
+
+		if (req->op_chan) {
+			pend->op_chan = true;
+			pend->pri_chan = req->pri_chan;
+			ether_addr_copy(pend->vif_addr, req->vif_addr);
+		}
+
+		pend->radar_start |= req->radar_start;
+		attached = true;
+		break;
+	}
+
+	spin_unlock_bh(&dev->chan_prog_lock);
+
+	return attached;
+}
+
+
+/* Programs a channel without holding the caller over the FW round trip.
+ * TX is stopped until the FW is on the channel, the OP channel of
+ * op_chan_addr and radar detection follow from uccp420wlan_ch_prog_complete.
+ * Called with dev->mutex held.
+ */
+int uccp420wlan_set_channel(struct mac80211_dev *dev,
+			    const struct umac_chan_cmd *cmd,
+			    unsigned int vif_index,
+			    unsigned char *op_chan_addr,
+			    bool radar_start)
+{
+	struct chan_prog_req req;
+	bool first, empty;
+	int err;
+
+	memset(&req, 0, sizeof(struct chan_prog_req));
+	req.vif_index = vif_index;
+	req.pri_chan = cmd->channel.primary_ch_number;
+	req.radar_start = radar_start;
+	req.start = ktime_get();
+
+	if (op_chan_addr) {
+		req.op_chan = true;
+		ether_addr_copy(req.vif_addr, op_chan_addr);
+	}
+
+	/* Already there (or on the way), no need to stop TX for it. On the
+	 * way, the follow up waits for the CH_PROG_DONE of the pending one.
+	 */
+	if (uccp420wlan_channel_active(dev, cmd, vif_index)) {
+		dev->stats->chan_prog_skipped++;
+
+		if (!chan_prog_attach(dev, &req))
+			chan_prog_follow_up(dev, &req);
+
+		return 0;
+	}
+
+	if (!dev->params->async_chan_prog) {
+		err = uccp420wlan_prog_channel_cmd(dev, cmd, vif_index, true);
+
+		if (err >= 0) {
+			chan_prog_follow_up(dev, &req);
+			err = 0;
+		}
+
+		return err;
+	}
+
+	/* Queued before sending, the CH_PROG_DONE can beat the send return */
+	spin_lock_bh(&dev->chan_prog_lock);
+
+	if (dev->chan_prog_tail - dev->chan_prog_head ==
+	    MAX_CHAN_PROG_PENDING) {
+		spin_unlock_bh(&dev->chan_prog_lock);
+		return -EBUSY;
+	}
+
+	first = (dev->chan_prog_tail == dev->chan_prog_head);
+	dev->chan_prog_q[dev->chan_prog_tail % MAX_CHAN_PROG_PENDING] = req;
+	dev->chan_prog_tail++;
+
+	spin_unlock_bh(&dev->chan_prog_lock);
+
+	if (first) {
+		uccp420wlan_stop_queues(dev,
+					ALL_HW_QUEUES,
+					QUEUE_STOP_CHAN_PROG);
+		ieee80211_queue_delayed_work(dev->hw,
+					     &dev->chan_prog_timeout_work,
+					     CH_PROG_TIMEOUT_TICKS);
+	}
+
+	err = uccp420wlan_prog_channel_cmd(dev, cmd, vif_index, false);
+
+	if (!err)
+		return 0;
+
+	/* Nothing goes to the FW, so no CH_PROG_DONE comes for this one and
+	 * it is still the last entry (only dev->mutex holders add).
+	 */
+	spin_lock_bh(&dev->chan_prog_lock);
+	dev->chan_prog_tail--;
+	empty = (dev->chan_prog_tail == dev->chan_prog_head);
+	spin_unlock_bh(&dev->chan_prog_lock);
+
+	if (err > 0) {
+		chan_prog_follow_up(dev, &req);
+		err = 0;
+	}
+
+	if (empty) {
+		cancel_delayed_work(&dev->chan_prog_timeout_work);
+		uccp420wlan_wake_queues(dev,
+					ALL_HW_QUEUES,
+					QUEUE_STOP_CHAN_PROG);
+	}
+
+	return err;
+}
+
+
+/* Drops the pending channel programming and forgets the channels sent for
+ * it, returns how many were dropped.
+ */
+static unsigned int chan_prog_drop(struct mac80211_dev *dev)
+{
+	unsigned long vifs = 0;
+	unsigned int dropped, index;
+
+	spin_lock_bh(&dev->chan_prog_lock);
+
+	dropped = dev->chan_prog_tail - dev->chan_prog_head;
+
+	while (dev->chan_prog_head != dev->chan_prog_tail) {
+		index = dev->chan_prog_q[dev->chan_prog_head %
+					 MAX_CHAN_PROG_PENDING].vif_index;
+
+		if (index < MAX_VIFS)
+			vifs |= BIT(index);
+
+		dev->chan_prog_head++;
+	}
+
+	spin_unlock_bh(&dev->chan_prog_lock);
+
+	for_each_set_bit(index, &vifs, MAX_VIFS)
+		uccp420wlan_channel_forget(index);
+
+	return dropped;
+}
+
+
+void uccp420wlan_chan_prog_timeout_work(struct work_struct *work)
+{
+	struct delayed_work *dwork = to_delayed_work(work);
+	struct mac80211_dev *dev;
+	unsigned int dropped;
+
+	dev = container_of(dwork, struct mac80211_dev, chan_prog_timeout_work);
+
+	dropped = chan_prog_drop(dev);
+
+	if (!dropped)
+		return;
+
+	UMAC_PRINT("%s-UMAC: No channel prog done after %ld ticks, %d dropped\n",
+		   dev->name, CH_PROG_TIMEOUT_TICKS, dropped);
+	dev->stats->chan_prog_timeouts++;
+	uccp420wlan_wake_queues(dev,
+				ALL_HW_QUEUES,
+				QUEUE_STOP_CHAN_PROG);
+}
+
+
+/* Forgets the pending channel programming, the FW is going down */
+void uccp420wlan_chan_prog_flush(struct mac80211_dev *dev)
+{
+	cancel_delayed_work_sync(&dev->chan_prog_timeout_work);
+
+	chan_prog_drop(dev);
+}
+
+
 void uccp420wlan_ch_prog_complete(int event,
 				  struct umac_event_ch_prog_complete *prog_ch,
 				  void *context)
 {
 	struct mac80211_dev *dev = (struct mac80211_dev *)context;
+	struct chan_prog_req req;
+	bool found = false, empty = false;
+
+	spin_lock_bh(&dev->chan_prog_lock);
+
+	if (dev->chan_prog_head != dev->chan_prog_tail) {
+		req = dev->chan_prog_q[dev->chan_prog_head %
+				       MAX_CHAN_PROG_PENDING];
+		dev->chan_prog_head++;
+		empty = (dev->chan_prog_head == dev->chan_prog_tail);
+		found = true;
+	}
+
+	spin_unlock_bh(&dev->chan_prog_lock);
 
-	dev->chan_prog_done = 1;
+	/* Not an async request, uccp420wlan_prog_channel_cmd waits on this */
+	if (!found) {
+		complete(&dev->chan_prog_done);
+		return;
+	}
+
+	chan_prog_follow_up(dev, &req);
+	cancel_delayed_work(&dev->chan_prog_timeout_work);
+
+	if (empty)
+		uccp420wlan_wake_queues(dev,
+					ALL_HW_QUEUES,
+					QUEUE_STOP_CHAN_PROG);
+	else
+		ieee80211_queue_delayed_work(dev->hw,
+					     &dev->chan_prog_timeout_work,
+					     CH_PROG_TIMEOUT_TICKS);
 }
 
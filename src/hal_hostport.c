@@ -66,6 +66,12 @@ static const char *hal_name = "UCCP420_WIFI_HAL";
 static unsigned long shm_offset = HAL_SHARED_MEM_OFFSET;
 module_param(shm_offset, ulong, S_IRUSR|S_IWUSR);
 
+/* TX frames outside the 64MB window up to this length are re-homed to a
+ * ZONE_DMA buffer before they are queued, 0 disables re-homing.
+ */
+static unsigned int tx_rehome_max_len = HAL_TX_REHOME_MAX_LEN;
+module_param(tx_rehome_max_len, uint, S_IRUSR|S_IWUSR);
+
 unsigned int hal_cmd_sent;
 unsigned int hal_event_recv;
 struct timer_list stats_timer;
@@ -74,6 +80,12 @@ unsigned int alloc_skb_dma_region;
 unsigned int alloc_skb_priv_tx_region;
 unsigned int alloc_skb_priv_rx_region;
 unsigned int alloc_skb_priv_runtime;
+/* Updated from the mac80211 TX path, which can run on several CPUs */
+static atomic_t tx_dma_inplace;
+static atomic_t tx_dma_rehome;
+static atomic_t tx_dma_rehome_fail;
+static atomic_t tx_dma_copy;
+static atomic_t tx_rehome_backoff;
 
 static unsigned int uccp_ddr_base;
 static unsigned int phys_64mb;
@@ -1088,6 +1100,18 @@ static int proc_read_hal_stats(struct seq_file *m, void *v)
 	seq_printf(m, "Alloc SKB in Priv 4 MB TX Region: %d\n",
 		   alloc_skb_priv_tx_region);
 
+	seq_printf(m, "TX SKB mapped in place: %d\n",
+		   atomic_read(&tx_dma_inplace));
+
+	seq_printf(m, "TX SKB re-homed to DMA zone: %d\n",
+		   atomic_read(&tx_dma_rehome));
+
+	seq_printf(m, "TX SKB re-home failures: %d\n",
+		   atomic_read(&tx_dma_rehome_fail));
+
+	seq_printf(m, "TX SKB left for copy: %d\n",
+		   atomic_read(&tx_dma_copy));
+
 	seq_printf(m, "Alloc SKB in Priv 4 MB RX Region: %d\n",
 		   alloc_skb_priv_rx_region);
 
@@ -1655,7 +1679,7 @@ static int hal_init(void *dev)
 	}
 
 	/*Allocate space do update data pointers to DCP*/
-	hpriv->hal_tx_data = kzalloc((NUM_TX_DESC * NUM_FRAMES_IN_TX_DESC *
+	hpriv->hal_tx_data = kzalloc((HAL_MAX_TX_DESC * NUM_FRAMES_IN_TX_DESC *
 				      sizeof(struct hal_tx_data)), GFP_KERNEL);
 
 	if (!hpriv->hal_tx_data) {
@@ -1803,6 +1827,12 @@ static int hal_init_bufs(unsigned int tx_bufs,
 				      MAX_RX_BUF_PTR_PER_CMD);
 	int result = -1;
 
+	if (tx_bufs > HAL_MAX_TX_DESC) {
+		pr_err("%s Cannot accomodate tx_bufs: %d in GRAM, max: %d\n",
+		       hal_name, tx_bufs, HAL_MAX_TX_DESC);
+		return -1;
+	}
+
 	hpriv->tx_bufs = tx_bufs;
 	hpriv->rx_bufs_2k = rx_bufs_2k;
 	hpriv->rx_bufs_12k = rx_bufs_12k;
@@ -1923,7 +1953,7 @@ int hal_map_tx_buf(int pkt_desc, int frame_id, unsigned char *data, int len)
 		       (unsigned int)dma_buf,
 		       index);
 
-		for (i = 0; i < NUM_TX_DESC; i++) {
+		for (i = 0; i < hpriv->tx_bufs; i++) {
 			for (j = 0; j < NUM_FRAMES_IN_TX_DESC; j++) {
 				UCCP_DEBUG_HAL("%s: TX: descriptor: %d ",
 					       __func__, i);
@@ -1975,6 +2005,44 @@ int hal_map_tx_buf(int pkt_desc, int frame_id, unsigned char *data, int len)
 }
 
 
+/* Called for every TX frame before it is queued (outside the TX lock) to
+ * decide how its payload will reach the RPU:
+ * - in place: it already lies in the 64MB window,
+ * - re-home: its data is moved here to a ZONE_DMA buffer with
+ *   pskb_expand_head, so that the map (and any requeue) does not need to
+ *   copy it again under the TX lock. The skb stays the one mac80211 handed
+ *   over, with its socket and destructor, so its status is reported as usual,
+ * - copy: left as is and copied to the private TX region when mapped.
+ * Large frames are always copied, and a failed re-home (no memory or the
+ * buffer landed outside the window) backs off for a while since the DMA
+ * zone is under pressure.
+ */
+void hal_rehome_tx_skb(struct sk_buff *skb)
+{
+	if (is_mem_dma(skb->data, skb->len)) {
+		atomic_inc(&tx_dma_inplace);
+		return;
+	}
+
+	if (skb_shared(skb) ||
+	    skb->len > tx_rehome_max_len ||
+	    atomic_add_unless(&tx_rehome_backoff, -1, 0)) {
+		atomic_inc(&tx_dma_copy);
+		return;
+	}
+
+	if (pskb_expand_head(skb, 0, 0, GFP_ATOMIC | GFP_DMA) ||
+	    !is_mem_dma(skb->data, skb->len)) {
+		atomic_set(&tx_rehome_backoff, HAL_TX_REHOME_BACKOFF);
+		atomic_inc(&tx_dma_rehome_fail);
+		atomic_inc(&tx_dma_copy);
+		return;
+	}
+
+	atomic_inc(&tx_dma_rehome);
+}
+
+
 int hal_unmap_tx_buf(int pkt_desc, int frame_id)
 {
 	unsigned int index = (pkt_desc * NUM_FRAMES_IN_TX_DESC) + frame_id;
@@ -2142,6 +2210,7 @@ struct hal_ops_tag hal_ops = {
 	.init_bufs = hal_init_bufs,
 	.deinit_bufs = hal_deinit_bufs,
 	.map_tx_buf = hal_map_tx_buf,
+	.rehome_tx_skb = hal_rehome_tx_skb,
 	.unmap_tx_buf = hal_unmap_tx_buf,
 	.reset_hal_params	= hal_reset_hal_params,
 	.set_mem_region	= hal_set_mem_region,
@@ -36,7 +36,7 @@ static void wait_for_tx_complete(struct tx_config *tx)
 	 * or size.
 	 */
 	while (find_last_bit(tx->buf_pool_bmp,
-			     NUM_TX_DESCS) != NUM_TX_DESCS) {
+			     tx->num_descs) != tx->num_descs) {
 		count++;
 
 		if (count < TX_COMPLETE_TIMEOUT_TICKS) {
@@ -89,29 +89,51 @@ static void update_aux_adc_voltage(struct mac80211_dev *dev,
 	dev->params->pdout_voltage[index++] = pdout;
 }
 
+/* A group addressed frame can share the beacon queue descriptor of first if
+ * prog_tx can describe it with the header length and encryption of first,
+ * and if the A1-A2-A3 match as the RPU expects for all the frames of a
+ * descriptor. A beacon parked on the same pending queue always goes alone.
+ */
+static bool bcast_burst_can_pack(struct sk_buff *first,
+				 struct sk_buff *skb)
+{
+	struct ieee80211_hdr *hdr_first = (struct ieee80211_hdr *)first->data;
+	struct ieee80211_hdr *hdr = (struct ieee80211_hdr *)skb->data;
+	struct umac_tx_meta *meta_first = umac_tx_meta(first);
+	struct umac_tx_meta *meta = umac_tx_meta(skb);
+
+	if (ieee80211_is_beacon(hdr_first->frame_control) ||
+	    ieee80211_is_beacon(hdr->frame_control))
+		return false;
+
+	return (meta->hdr_len == meta_first->hdr_len) &&
+		(meta->encrypt == meta_first->encrypt) &&
+		ether_addr_equal(hdr->addr1, hdr_first->addr1) &&
+		ether_addr_equal(hdr->addr2, hdr_first->addr2) &&
+		ether_addr_equal(hdr->addr3, hdr_first->addr3);
+}
+
+
+
+/* True if skb can go in the same descriptor as skb_first, the frame the
+ * descriptor starts with.
+ */
 static int check_80211_aggregation(struct mac80211_dev *dev,
-				struct sk_buff *skb,
-			       int ac,
-#ifdef MULTI_CHAN_SUPPORT
-			       int off_chanctx_idx,
-#endif
-			       int peer_id)
+				   struct sk_buff *skb,
+				   struct sk_buff *skb_first,
+				   int ac)
 {
 
 	struct ieee80211_tx_info *tx_info = IEEE80211_SKB_CB(skb);
 	struct ieee80211_hdr *mac_hdr = NULL, *mac_hdr_first = NULL;
-	struct sk_buff *skb_first;
-	struct sk_buff_head *pend_pkt_q = NULL;
-	struct tx_config *tx = &dev->tx;
 	bool ampdu = false, is_qos = false, addr = true;
 
+	/* Group addressed frames are never AMPDUs, they are burst instead */
+	if (ac == WLAN_AC_BCN)
+		return skb_first && bcast_burst_can_pack(skb_first, skb);
+
 	mac_hdr = (struct ieee80211_hdr *)skb->data;
-#ifdef MULTI_CHAN_SUPPORT
-	pend_pkt_q = &tx->pending_pkt[off_chanctx_idx][peer_id][ac];
-#else
-	pend_pkt_q = &tx->pending_pkt[peer_id][ac];
-#endif
-	skb_first = skb_peek(pend_pkt_q);
+
 	if (skb_first)
 		mac_hdr_first = (struct ieee80211_hdr *)skb_first->data;
 
@@ -157,42 +179,74 @@ static int check_80211_aggregation(struct mac80211_dev *dev,
 }
 
 
-static void tx_status(struct sk_buff *skb,
-		      struct umac_event_tx_done *tx_done,
-		      unsigned int frame_idx,
-		      struct mac80211_dev *dev,
-		      struct ieee80211_tx_info tx_info_1st_mpdu)
+static void tx_lat_hist_add(unsigned int *hist,
+			    s64 delta_us)
+{
+	int bin = 0;
+
+	if (delta_us > 0)
+		bin = fls64((u64)delta_us);
+
+	if (bin >= TX_LAT_HIST_BINS)
+		bin = TX_LAT_HIST_BINS - 1;
+
+	hist[bin]++;
+}
+
+
+/* Splits the life of a completed frame into the stages of enum tx_lat_stage,
+ * using the stamp taken in tx() and the ones of its descriptor. Called before
+ * the TX status is filled in, which overwrites the metadata.
+ */
+static void tx_lat_account(struct mac80211_dev *dev,
+			   struct sk_buff *skb,
+			   unsigned int queue,
+			   struct tx_pkt_info *pkt_info,
+			   ktime_t done_ts)
+{
+	struct wifi_stats *stats = dev->stats;
+	struct umac_tx_meta *meta = umac_tx_meta(skb);
+	s64 stage_us[TX_LAT_STAGES];
+	int stage;
+
+	/* Not stamped in tx(), e.g. beacons */
+	if (!meta->enq_stamped)
+		return;
+
+	stage_us[TX_LAT_QUEUE] = (s32)((u32)ktime_to_us(pkt_info->token_ts) -
+				       meta->enq_us);
+	stage_us[TX_LAT_HOST] = ktime_us_delta(pkt_info->send_ts,
+					       pkt_info->token_ts);
+	stage_us[TX_LAT_FW] = ktime_us_delta(done_ts, pkt_info->send_ts);
+	stage_us[TX_LAT_TOTAL] = (s32)((u32)ktime_to_us(done_ts) -
+				       meta->enq_us);
+
+	for (stage = 0; stage < TX_LAT_STAGES; stage++) {
+		tx_lat_hist_add(stats->tx_lat_ac[queue][stage],
+				stage_us[stage]);
+
+		if (pkt_info->peer_id >= 0 &&
+		    pkt_info->peer_id < MAX_PEND_Q_PER_AC)
+			tx_lat_hist_add(stats->tx_lat_peer[pkt_info->peer_id]
+							  [stage],
+					stage_us[stage]);
+	}
+}
+
+
+static void tx_status_rates(struct ieee80211_tx_info *tx_info,
+			    struct umac_event_tx_done *tx_done,
+			    unsigned int frame_idx,
+			    struct mac80211_dev *dev,
+			    struct ieee80211_tx_info *tx_info_1st_mpdu)
 {
 	int index, i;
 	char idx = 0;
 	struct ieee80211_tx_rate *txrate;
 	struct ieee80211_tx_rate *tx_inf_rate = NULL;
-	struct ieee80211_tx_info *tx_info = IEEE80211_SKB_CB(skb);
 	int tx_fixed_mcs_idx = 0;
 	int tx_fixed_rate = 0;
 	struct ieee80211_supported_band *band = NULL;
-	struct umac_vif *uvif = NULL;
-	int ret = 0;
-
-	uvif = (struct umac_vif *)(tx_info->control.vif->drv_priv);
-
-	/*Just inform ma8c0211, it will free the skb*/
-	if (tx_done->frm_status[frame_idx] == TX_DONE_STAT_DISCARD) {
-		ieee80211_free_txskb(dev->hw, skb);
-		dev->stats->tx_dones_to_stack++;
-		return;
-	}
-
-	/* Rate info will be retained, except the count*/
-	ieee80211_tx_info_clear_status(tx_info);
-
-	if (tx_done->frm_status[frame_idx] == TX_DONE_STAT_SUCCESS)
-		tx_info->flags |= IEEE80211_TX_STAT_ACK;
-	else if (tx_info->flags & IEEE80211_TX_CTL_AMPDU)
-		tx_info->flags |= IEEE80211_TX_STAT_AMPDU_NO_BACK;
-
-	tx_info->flags &= ~IEEE80211_TX_STAT_AMPDU;
-	tx_info->flags &= ~IEEE80211_TX_CTL_AMPDU;
 
 	band = dev->hw->wiphy->bands[tx_info->band];
 
@@ -200,7 +254,7 @@ static void tx_status(struct sk_buff *skb,
 		tx_inf_rate = &tx_info->status.rates[index];
 
 		/* Populate tx_info based on 1st MPDU in an AMPDU */
-		txrate = (&tx_info_1st_mpdu.control.rates[index]);
+		txrate = (&tx_info_1st_mpdu->control.rates[index]);
 
 		if (txrate->idx < 0)
 			break;
@@ -283,13 +337,35 @@ static void tx_status(struct sk_buff *skb,
 		tx_info->status.rates[index + 1].count = 0;
 		index++;
 	}
+}
+
 
-	if (((tx_info->flags & IEEE80211_TX_CTL_TX_OFFCHAN)
+/* Must be called before ieee80211_tx_info_clear_status, which clears
+ * control.vif.
+ */
+static bool tx_status_is_roc(struct ieee80211_tx_info *tx_info,
+			     struct mac80211_dev *dev)
+{
 #ifdef MULTI_CHAN_SUPPORT
-	     || (uvif->chanctx &&
-		 (uvif->chanctx->index == dev->roc_off_chanctx_idx))
+	struct umac_vif *uvif = NULL;
+
+	uvif = (struct umac_vif *)(tx_info->control.vif->drv_priv);
+
+	if (uvif->chanctx &&
+	    (uvif->chanctx->index == dev->roc_off_chanctx_idx))
+		return true;
 #endif
-	    ) &&
+
+	return !!(tx_info->flags & IEEE80211_TX_CTL_TX_OFFCHAN);
+}
+
+
+static void tx_status_roc(bool roc_frame,
+			  struct mac80211_dev *dev)
+{
+	int ret = 0;
+
+	if (roc_frame &&
 	    (atomic_dec_return(&dev->roc_params.roc_mgmt_tx_count) == 0)) {
 		UCCP_DEBUG_ROC("%s:%d TXDONE Frame: %d\n",
 			__func__,
@@ -303,11 +379,235 @@ static void tx_status(struct sk_buff *skb,
 		}
 	}
 
+prog_umac_fail:
+	return;
+}
+
+
+static void tx_status(struct sk_buff *skb,
+		      struct umac_event_tx_done *tx_done,
+		      unsigned int frame_idx,
+		      struct mac80211_dev *dev,
+		      struct ieee80211_tx_info *tx_info_1st_mpdu)
+{
+	struct ieee80211_tx_info *tx_info = IEEE80211_SKB_CB(skb);
+	bool roc_frame;
+
+	/*Just inform ma8c0211, it will free the skb*/
+	if (tx_done->frm_status[frame_idx] == TX_DONE_STAT_DISCARD) {
+		ieee80211_free_txskb(dev->hw, skb);
+		dev->stats->tx_dones_to_stack++;
+		return;
+	}
+
+	roc_frame = tx_status_is_roc(tx_info, dev);
+
+	/* Rate info will be retained, except the count*/
+	ieee80211_tx_info_clear_status(tx_info);
+
+	if (tx_done->frm_status[frame_idx] == TX_DONE_STAT_SUCCESS)
+		tx_info->flags |= IEEE80211_TX_STAT_ACK;
+	else if (tx_info->flags & IEEE80211_TX_CTL_AMPDU)
+		tx_info->flags |= IEEE80211_TX_STAT_AMPDU_NO_BACK;
+
+	tx_info->flags &= ~IEEE80211_TX_STAT_AMPDU;
+	tx_info->flags &= ~IEEE80211_TX_CTL_AMPDU;
+
+	tx_status_rates(tx_info, tx_done, frame_idx, dev, tx_info_1st_mpdu);
+
+	tx_status_roc(roc_frame, dev);
+
 	dev->stats->tx_dones_to_stack++;
 
 	ieee80211_tx_status(dev->hw, skb);
-prog_umac_fail:
-	return;
+}
+
+
+/* All the MPDUs of an A-MPDU are sent at the same rate, so the status rates
+ * are derived once per descriptor and the aggregate is reported to RC through
+ * a single frame (IEEE80211_TX_STAT_AMPDU). The other subframes keep
+ * IEEE80211_TX_CTL_AMPDU so that RC skips them, and the acked ones mac80211
+ * has nothing to do for are freed without going through ieee80211_tx_status.
+ */
+static void tx_status_ampdu(struct sk_buff_head *tx_done_list,
+			    struct umac_event_tx_done *tx_done,
+			    unsigned int hdr_len,
+			    struct mac80211_dev *dev,
+			    struct ieee80211_tx_info *tx_info_1st_mpdu,
+			    int *vif_index_bitmap)
+{
+	struct ieee80211_tx_rate rates[IEEE80211_TX_MAX_RATES];
+	struct ieee80211_tx_info *tx_info = NULL;
+	struct ieee80211_tx_info *rep_info = NULL;
+	struct ieee80211_hdr *mac_hdr;
+	struct sk_buff *skb, *tmp, *skb_rep = NULL;
+	unsigned int ampdu_len = 0, ampdu_ack_len = 0;
+	unsigned int pkt = 0, rep_idx = 0;
+	int vif_index = -1;
+	bool rep_roc = false;
+
+	skb_queue_walk(tx_done_list, skb) {
+		if (tx_done->frm_status[pkt] != TX_DONE_STAT_DISCARD) {
+			if (!skb_rep) {
+				skb_rep = skb;
+				rep_idx = pkt;
+			}
+
+			ampdu_len++;
+
+			if (tx_done->frm_status[pkt] == TX_DONE_STAT_SUCCESS)
+				ampdu_ack_len++;
+		}
+
+		pkt++;
+	}
+
+	if (skb_rep) {
+		rep_info = IEEE80211_SKB_CB(skb_rep);
+		rep_roc = tx_status_is_roc(rep_info, dev);
+
+		/* Rate info will be retained, except the count*/
+		ieee80211_tx_info_clear_status(rep_info);
+		tx_status_rates(rep_info, tx_done, rep_idx, dev,
+				tx_info_1st_mpdu);
+		memcpy(rates, rep_info->status.rates, sizeof(rates));
+
+		if (tx_done->frm_status[rep_idx] == TX_DONE_STAT_SUCCESS)
+			rep_info->flags |= IEEE80211_TX_STAT_ACK;
+		else
+			rep_info->flags |= IEEE80211_TX_STAT_AMPDU_NO_BACK;
+
+		rep_info->flags |= IEEE80211_TX_STAT_AMPDU;
+		rep_info->status.ampdu_len = ampdu_len;
+		rep_info->status.ampdu_ack_len = ampdu_ack_len;
+
+		/* RPU sends an A-MPDU only if A1-A2-A3 are the same */
+		mac_hdr = (struct ieee80211_hdr *)(skb_rep->data - hdr_len);
+		vif_index = vif_addr_to_index(mac_hdr->addr2, dev);
+
+		if (vif_index > -1)
+			*vif_index_bitmap |= (1 << vif_index);
+
+		dev->stats->tx_status_ampdu_cnt++;
+	}
+
+	pkt = 0;
+
+	skb_queue_walk_safe(tx_done_list, skb, tmp) {
+		__skb_unlink(skb, tx_done_list);
+
+		/* In the Tx path we move the .11hdr from skb to CMD_TX
+		 * Hence pushing it here, not required for loopback case
+		 */
+		skb_push(skb, hdr_len);
+		tx_info = IEEE80211_SKB_CB(skb);
+
+		if (tx_done->frm_status[pkt] == TX_DONE_STAT_DISCARD) {
+			ieee80211_free_txskb(dev->hw, skb);
+			dev->stats->tx_dones_to_stack++;
+			pkt++;
+			continue;
+		}
+
+		tx_status_roc((skb == skb_rep) ?
+			      rep_roc : tx_status_is_roc(tx_info, dev),
+			      dev);
+		dev->stats->tx_dones_to_stack++;
+
+		/* mac80211 acts on the status of these (ends the U-APSD
+		 * service period, reports to the socket), they have to go
+		 * through ieee80211_tx_status.
+		 */
+		if (skb != skb_rep &&
+		    tx_done->frm_status[pkt] == TX_DONE_STAT_SUCCESS &&
+		    !(tx_info->flags & (IEEE80211_TX_CTL_REQ_TX_STATUS |
+					IEEE80211_TX_STATUS_EOSP |
+					IEEE80211_TX_CTL_PS_RESPONSE)) &&
+		    !tx_info->ack_frame_id) {
+			dev_kfree_skb_any(skb);
+			dev->stats->tx_status_fast_free++;
+			pkt++;
+			continue;
+		}
+
+		if (skb != skb_rep) {
+			ieee80211_tx_info_clear_status(tx_info);
+			memcpy(tx_info->status.rates, rates, sizeof(rates));
+
+			if (tx_done->frm_status[pkt] == TX_DONE_STAT_SUCCESS)
+				tx_info->flags |= IEEE80211_TX_STAT_ACK;
+			else
+				tx_info->flags |=
+					IEEE80211_TX_STAT_AMPDU_NO_BACK;
+		}
+
+		ieee80211_tx_status(dev->hw, skb);
+		pkt++;
+	}
+}
+
+
+static inline bool is_spare_token(struct tx_config *tx, int token_id)
+{
+	return token_id >= (tx->num_descs_per_ac * NUM_ACS);
+}
+
+
+/* A spare token moved from one AC to another on TX_DONE, the receiving AC
+ * had frames pending and spare_token_allowed let it have the token.
+ */
+static void spare_token_move(struct mac80211_dev *dev, int from, int to)
+{
+	struct tx_config *tx = &dev->tx;
+
+	if (tx->spare_tokens[to] >= dev->params->spare_credit[to])
+		dev->stats->spare_borrow[to]++;
+
+	tx->outstanding_tokens[from]--;
+	tx->outstanding_tokens[to]++;
+	tx->spare_tokens[from]--;
+	tx->spare_tokens[to]++;
+
+	if (to > from)
+		dev->stats->spare_reclaim[to]++;
+}
+
+
+/* An AC can always hold up to its credit of spare tokens, beyond that it
+ * borrows them only while all the higher ACs are idle so that they can get
+ * one back on the next TX_DONE. @from is the AC handing over its spare
+ * token on TX_DONE (-1 for a free token), that token does not keep it busy.
+ * A refusal is counted once, on the request for a free token, not again on
+ * the TX_DONE rescans until the AC is allowed one.
+ */
+static bool spare_token_allowed(struct mac80211_dev *dev, int queue, int from)
+{
+	struct tx_config *tx = &dev->tx;
+	unsigned int outstanding;
+	int ac;
+
+	if (tx->spare_tokens[queue] < dev->params->spare_credit[queue])
+		goto allowed;
+
+	for (ac = queue + 1; ac <= WLAN_AC_VO; ac++) {
+		outstanding = tx->outstanding_tokens[ac];
+
+		if (ac == from)
+			outstanding--;
+
+		if (outstanding) {
+			if ((from == -1) &&
+			    !__test_and_set_bit(queue, &tx->spare_denied_bmp))
+				dev->stats->spare_denied[queue]++;
+
+			return false;
+		}
+	}
+
+allowed:
+	__clear_bit(queue, &tx->spare_denied_bmp);
+
+	return true;
 }
 
 
@@ -320,11 +620,11 @@ static int get_token(struct mac80211_dev *dev,
 	int cnt = 0;
 	int curr_bit = 0;
 	int pool_id = 0;
-	int token_id = NUM_TX_DESCS;
+	int token_id = dev->tx.num_descs;
 	struct tx_config *tx = &dev->tx;
 
 	/* First search for a reserved token */
-	for (cnt = 0; cnt < NUM_TX_DESCS_PER_AC; cnt++) {
+	for (cnt = 0; cnt < tx->num_descs_per_ac; cnt++) {
 		curr_bit = ((queue + (NUM_ACS * cnt)) % TX_DESC_BUCKET_BOUND);
 		pool_id = ((queue + (NUM_ACS * cnt)) / TX_DESC_BUCKET_BOUND);
 
@@ -338,15 +638,21 @@ static int get_token(struct mac80211_dev *dev,
 	/* If reserved token is not found search for a spare token
 	 * (only for non beacon queues)
 	 */
-	if ((cnt == NUM_TX_DESCS_PER_AC) && (queue != WLAN_AC_BCN)) {
-		for (token_id = NUM_TX_DESCS_PER_AC * NUM_ACS;
-		     token_id < NUM_TX_DESCS;
+	if ((cnt == tx->num_descs_per_ac) && (queue != WLAN_AC_BCN) &&
+	    spare_token_allowed(dev, queue, -1)) {
+		for (token_id = tx->num_descs_per_ac * NUM_ACS;
+		     token_id < tx->num_descs;
 		     token_id++) {
 			curr_bit = (token_id % TX_DESC_BUCKET_BOUND);
 			pool_id = (token_id / TX_DESC_BUCKET_BOUND);
 			if (!test_and_set_bit(curr_bit,
 					      &tx->buf_pool_bmp[pool_id])) {
+				if (tx->spare_tokens[queue] >=
+				    dev->params->spare_credit[queue])
+					dev->stats->spare_borrow[queue]++;
+
 				tx->outstanding_tokens[queue]++;
+				tx->spare_tokens[queue]++;
 				break;
 			}
 		}
@@ -355,6 +661,19 @@ static int get_token(struct mac80211_dev *dev,
 	return token_id;
 }
 
+/* Flush waiters re-check under tx->lock, for an AC reaching zero outstanding
+ * or for the tokens/pending frames of one VIF. A token can be charged to
+ * another AC than the one it was taken for (spare tokens) and a pending
+ * queue also drains into reused tokens, so every waiter is woken on each
+ * token release and pending queue dequeue.
+ */
+static void tx_flush_wake(struct tx_config *tx)
+{
+	if (waitqueue_active(&tx->flush_wq))
+		wake_up(&tx->flush_wq);
+}
+
+
 void free_token(struct mac80211_dev *dev,
 		int token_id,
 		int queue)
@@ -372,8 +691,14 @@ void free_token(struct mac80211_dev *dev,
 
 	tx->outstanding_tokens[queue]--;
 
+	if (is_spare_token(tx, token_id))
+		tx->spare_tokens[queue]--;
+
+	tx_flush_wake(tx);
+
 	test = tx->outstanding_tokens[queue];
-	if (WARN_ON_ONCE(test < 0 || test > 4)) {
+	if (WARN_ON_ONCE(test < 0 ||
+			 test > (tx->num_descs_per_ac + tx->num_spare_descs))) {
 		UCCP_DEBUG_TX("%s: invalid outstanding_tokens: %d, old:%d\n",
 			      __func__,
 			      test,
@@ -564,92 +889,163 @@ struct curr_peer_info get_curr_peer_opp(struct mac80211_dev *dev,
 
 
 #ifdef MULTI_CHAN_SUPPORT
-void uccp420wlan_tx_proc_send_pend_frms_all(struct mac80211_dev *dev,
-					    int ch_id)
+static int tx_claim_token(struct tx_config *tx,
+			  int token_id)
+{
+	return test_and_set_bit(token_id % TX_DESC_BUCKET_BOUND,
+				&tx->buf_pool_bmp[token_id /
+						  TX_DESC_BUCKET_BOUND]);
+}
+
+
+static void tx_release_token(struct tx_config *tx,
+			     int token_id)
+{
+	__clear_bit(token_id % TX_DESC_BUCKET_BOUND,
+		    &tx->buf_pool_bmp[token_id / TX_DESC_BUCKET_BOUND]);
+}
+
+
+static void tx_send_claimed_token(struct mac80211_dev *dev,
+				  int queue,
+				  int token_id,
+				  int ch_id)
+{
+	int ret = 0;
+
+	ret = __uccp420wlan_tx_frame(dev,
+				     queue,
+				     token_id,
+				     ch_id,
+				     0,
+				     0); /* TODO: Currently sending 0
+					  * since this param is not used
+					  * as expected in the orig
+					  * code for multiple frames etc
+					  * Need to set this
+					  * properly when the orig code
+					  * logic is corrected
+					  */
+	if (ret < 0) {
+		pr_err("%s: Queueing of TX frame to FW failed\n",
+		       __func__);
+	}
+}
+
+
+/* Resumes TX on a channel context: the descriptors parked on its ready list
+ * go out first, then free tokens are filled from the pending queues until
+ * every AC has run dry. Returns the number of descriptors programmed.
+ */
+unsigned int uccp420wlan_tx_proc_send_pend_frms_all(struct mac80211_dev *dev,
+						    int ch_id)
 {
-	int txq_len = 0;
 	int i = 0, cnt = 0;
 	int queue = 0;
-	int curr_bit = 0;
-	int pool_id = 0;
-	int ret = 0;
 	int start_ac, end_ac;
 	unsigned int pkts_pend = 0;
+	unsigned int sent = 0;
+	unsigned int ac_empty = 0;
+	unsigned long ready = 0;
 	struct tx_config *tx = NULL;
 	struct sk_buff_head *txq = NULL;
 
 	tx = &dev->tx;
 
-	for (i = 0; i < NUM_TX_DESCS; i++) {
+	spin_lock_bh(&tx->lock);
+	ready = tx->ready_bmp[ch_id];
+	tx->ready_bmp[ch_id] = 0;
+	spin_unlock_bh(&tx->lock);
+
+	for_each_set_bit(i, &ready, tx->num_descs) {
 		spin_lock_bh(&tx->lock);
 
-		curr_bit = (i % TX_DESC_BUCKET_BOUND);
-		pool_id = (i / TX_DESC_BUCKET_BOUND);
+		txq = &tx->pkt_info[ch_id][i].pkt;
 
-		if (test_and_set_bit(curr_bit, &tx->buf_pool_bmp[pool_id])) {
+		if (!skb_queue_len(txq)) {
 			spin_unlock_bh(&tx->lock);
 			continue;
 		}
 
-		txq = &tx->pkt_info[ch_id][i].pkt;
-		txq_len = skb_queue_len(txq);
+		/* Still in use on another context, try on the next resume */
+		if (tx_claim_token(tx, i)) {
+			tx->ready_bmp[ch_id] |= BIT(i);
+			spin_unlock_bh(&tx->lock);
+			continue;
+		}
 
-		/* Not valid when txq len is 0 */
 		queue = tx->pkt_info[ch_id][i].queue;
+		tx->outstanding_tokens[queue]++;
 
-		if (!txq_len) {
-			/* Reserved token */
-			if (i < (NUM_TX_DESCS_PER_AC * NUM_ACS)) {
-				queue = (i % NUM_ACS);
-				start_ac = end_ac = queue;
-			} else {
-				/* Spare token:
-				 * Loop through all AC's
-				 */
-				start_ac = WLAN_AC_VO;
-				end_ac = WLAN_AC_BK;
-			}
+		if (is_spare_token(tx, i))
+			tx->spare_tokens[queue]++;
 
-			for (cnt = start_ac; cnt >= end_ac; cnt--) {
-				pkts_pend = uccp420wlan_tx_proc_pend_frms(dev,
-									  cnt,
-									  ch_id,
-									  i);
-				if (pkts_pend) {
-					queue = cnt;
-					break;
-				}
-			}
+		dev->stats->chsw_ready_descs++;
+		spin_unlock_bh(&tx->lock);
 
-			if (pkts_pend == 0) {
-				__clear_bit(curr_bit,
-					    &tx->buf_pool_bmp[pool_id]);
-				spin_unlock_bh(&tx->lock);
+		tx_send_claimed_token(dev, queue, i, ch_id);
+		sent++;
+	}
+
+	for (i = 0; i < tx->num_descs; i++) {
+		if (ac_empty == (BIT(NUM_ACS) - 1))
+			break;
+
+		spin_lock_bh(&tx->lock);
+
+		if (tx_claim_token(tx, i)) {
+			spin_unlock_bh(&tx->lock);
+			continue;
+		}
+
+		/* Reserved token */
+		if (i < (tx->num_descs_per_ac * NUM_ACS)) {
+			queue = (i % NUM_ACS);
+			start_ac = end_ac = queue;
+		} else {
+			/* Spare token:
+			 * Loop through all AC's
+			 */
+			start_ac = WLAN_AC_VO;
+			end_ac = WLAN_AC_BK;
+		}
+
+		pkts_pend = 0;
+
+		for (cnt = start_ac; cnt >= end_ac; cnt--) {
+			if (ac_empty & BIT(cnt))
 				continue;
+
+			pkts_pend = uccp420wlan_tx_proc_pend_frms(dev,
+								  cnt,
+								  ch_id,
+								  i);
+			if (pkts_pend) {
+				queue = cnt;
+				break;
 			}
+
+			ac_empty |= BIT(cnt);
+		}
+
+		if (pkts_pend == 0) {
+			tx_release_token(tx, i);
+			spin_unlock_bh(&tx->lock);
+			continue;
 		}
 
 		tx->outstanding_tokens[queue]++;
+
+		if (is_spare_token(tx, i))
+			tx->spare_tokens[queue]++;
+
 		spin_unlock_bh(&tx->lock);
 
-		ret = __uccp420wlan_tx_frame(dev,
-					     queue,
-					     i,
-					     ch_id,
-					     0,
-					     0); /* TODO: Currently sending 0
-						  * since this param is not used
-						  * as expected in the orig
-						  * code for multiple frames etc
-						  * Need to set this
-						  * properly when the orig code
-						  * logic is corrected
-						  */
-		if (ret < 0) {
-			pr_err("%s: Queueing of TX frame to FW failed\n",
-			       __func__);
-		}
+		tx_send_claimed_token(dev, queue, i, ch_id);
+		sent++;
 	}
+
+	return sent;
 }
 #endif
 
@@ -728,9 +1124,8 @@ int uccp420wlan_tx_proc_pend_frms(struct mac80211_dev *dev,
 				max_tx_cmds = MAX_SUBFRAMES_IN_AMPDU_HT;
 		if (!check_80211_aggregation(dev,
 					     loop_skb,
-					     ac,
-					     peer_info.op_chan_idx,
-					     peer_info.id) ||
+					     skb_peek(txq) ? : loop_skb,
+					     ac) ||
 		    (skb_queue_len(txq) >= max_tx_cmds)) {
 			break;
 		}
@@ -746,16 +1141,20 @@ int uccp420wlan_tx_proc_pend_frms(struct mac80211_dev *dev,
 		skb_queue_tail(txq, skb_dequeue(pend_pkt_q));
 
 	total_pending_processed = skb_queue_len(txq);
+	tx_flush_wake(tx);
 
 	pend_pkt_q_len = skb_queue_len(pend_pkt_q);
 	if ((ac != WLAN_AC_BCN) &&
 	    (tx->queue_stopped_bmp & (1 << ac)) &&
 	    pend_pkt_q_len < (MAX_TX_QUEUE_LEN / 2)) {
-		ieee80211_wake_queue(dev->hw, tx_queue_unmap(ac));
+		uccp420wlan_wake_queues(dev,
+					BIT(tx_queue_unmap(ac)),
+					QUEUE_STOP_TX_FULL);
 		tx->queue_stopped_bmp &= ~(1 << (ac));
 	}
 
 	pkt_info->peer_id = peer_info.id;
+	pkt_info->token_ts = ktime_get();
 	UCCP_DEBUG_TX("%s-UMACTX: token_id: %d ",
 				dev->name,
 				token_id);
@@ -775,7 +1174,7 @@ int uccp420wlan_tx_alloc_token(struct mac80211_dev *dev,
 			       int peer_id,
 			       struct sk_buff *skb)
 {
-	int token_id = NUM_TX_DESCS;
+	int token_id = dev->tx.num_descs;
 	struct tx_config *tx = &dev->tx;
 	struct sk_buff_head *pend_pkt_q = NULL;
 	unsigned int pkts_pend = 0;
@@ -805,14 +1204,13 @@ int uccp420wlan_tx_alloc_token(struct mac80211_dev *dev,
 
 	tx_info = IEEE80211_SKB_CB(skb);
 
-	if (tx->outstanding_tokens[ac] >= NUM_TX_DESCS_PER_AC) {
+	if (tx->outstanding_tokens[ac] >= tx->num_descs_per_ac) {
 		bool agg_status = false;
 
 		agg_status = check_80211_aggregation(dev,
 						     skb,
-						     ac,
-						     off_chanctx_idx,
-						     peer_id);
+						     skb_peek(pend_pkt_q),
+						     ac);
 
 		if (agg_status || !dev->params->enable_early_agg_checks) {
 			int max_cmds = dev->params->max_tx_cmds;
@@ -842,8 +1240,9 @@ int uccp420wlan_tx_alloc_token(struct mac80211_dev *dev,
 		if ((!dev->roc_params.roc_in_progress) ||
 		    (dev->roc_params.roc_in_progress &&
 		     (ac != UMAC_ROC_AC))) {
-			ieee80211_stop_queue(dev->hw,
-					     skb->queue_mapping);
+			uccp420wlan_stop_queues(dev,
+						BIT(skb->queue_mapping),
+						QUEUE_STOP_TX_FULL);
 			tx->queue_stopped_bmp |= (1 << ac);
 		}
 	}
@@ -860,7 +1259,7 @@ int uccp420wlan_tx_alloc_token(struct mac80211_dev *dev,
 					ac, tx->outstanding_tokens[ac]);
 	UCCP_DEBUG_TX(", peerid: %d,\n", peer_id);
 
-	if (token_id == NUM_TX_DESCS)
+	if (token_id == tx->num_descs)
 		goto out;
 
 	pkts_pend = uccp420wlan_tx_proc_pend_frms(dev,
@@ -876,7 +1275,7 @@ int uccp420wlan_tx_alloc_token(struct mac80211_dev *dev,
 
 	if (!pkts_pend) {
 		free_token(dev, token_id, ac);
-		token_id = NUM_TX_DESCS;
+		token_id = tx->num_descs;
 	}
 
 out:
@@ -930,11 +1329,16 @@ int uccp420wlan_tx_free_buff_req(struct mac80211_dev *dev,
 	struct umac_vif *uvif = NULL;
 	struct ieee80211_vif *ivif = NULL;
 	unsigned long bcn_int = 0;
+	unsigned int hdr_len = 0;
 #ifdef MULTI_CHAN_SUPPORT
 	int chanctx_idx = 0;
 	struct tx_pkt_info *pkt_info = NULL;
 #endif
 	int start_ac, end_ac;
+	ktime_t done_ts;
+#ifdef PERF_PROFILING
+	ktime_t status_start;
+#endif
 
 	skb_queue_head_init(&tx_done_list);
 
@@ -985,7 +1389,7 @@ int uccp420wlan_tx_free_buff_req(struct mac80211_dev *dev,
 	}
 
 	/* Reserved token */
-	if (desc_id < (NUM_TX_DESCS_PER_AC * NUM_ACS)) {
+	if (desc_id < (tx->num_descs_per_ac * NUM_ACS)) {
 		start_ac = end_ac = tx_done->queue;
 	} else {
 		/* Spare token:
@@ -995,6 +1399,11 @@ int uccp420wlan_tx_free_buff_req(struct mac80211_dev *dev,
 		end_ac = WLAN_AC_BK;
 	}
 	for (cnt = start_ac; cnt >= end_ac; cnt--) {
+		/* Another AC gets the spare token only within its credit */
+		if ((cnt != tx_done->queue) &&
+		    !spare_token_allowed(dev, cnt, tx_done->queue))
+			continue;
+
 		pkts_pend = uccp420wlan_tx_proc_pend_frms(dev,
 					      cnt,
 #ifdef MULTI_CHAN_SUPPORT
@@ -1005,19 +1414,27 @@ int uccp420wlan_tx_free_buff_req(struct mac80211_dev *dev,
 		if (pkts_pend) {
 			*ac = cnt;
 			/* Spare Token Case*/
-			if (tx_done->queue != *ac) {
-				/*Adjust the counters*/
-				tx->outstanding_tokens[tx_done->queue]--;
-				tx->outstanding_tokens[*ac]++;
-			}
+			if (tx_done->queue != *ac)
+				spare_token_move(dev, tx_done->queue, *ac);
 			break;
 		}
 	}
 
 	/* Unmap here before release lock to avoid race */
 	if (skb_queue_len(&tx_done_list)) {
+		done_ts = ktime_get();
+
 		skb_queue_walk_safe(&tx_done_list, skb, tmp) {
 			hal_ops.unmap_tx_buf(tx_done->descriptor_id, pkt);
+			tx_lat_account(dev,
+				       skb,
+				       tx_done->queue,
+#ifdef MULTI_CHAN_SUPPORT
+				       pkt_info,
+#else
+				       &dev->tx.pkt_info[desc_id],
+#endif
+				       done_ts);
 			UCCP_DEBUG_TX("%s-UMACTX:TXDONE: ID=%d",
 				dev->name,
 				tx_done->descriptor_id);
@@ -1038,6 +1455,13 @@ int uccp420wlan_tx_free_buff_req(struct mac80211_dev *dev,
 #endif
 	}
 
+	/* The descriptor can be reused as soon as the lock is released */
+#ifdef MULTI_CHAN_SUPPORT
+	hdr_len = pkt_info->hdr_len;
+#else
+	hdr_len = dev->tx.pkt_info[desc_id].hdr_len;
+#endif
+
 	/* Unlock: Give a chance for Tx to add to pending lists */
 	spin_unlock_bh(&tx->lock);
 
@@ -1048,12 +1472,28 @@ int uccp420wlan_tx_free_buff_req(struct mac80211_dev *dev,
 	if (!skb_queue_len(&tx_done_list))
 		goto out;
 
+#ifdef PERF_PROFILING
+	status_start = ktime_get();
+	dev->stats->tx_status_mpdu_cnt += skb_queue_len(&tx_done_list);
+#endif
 	skb_first = skb_peek(&tx_done_list);
 
 	memcpy(&tx_info_1st_mpdu,
 	       (struct ieee80211_tx_info *)IEEE80211_SKB_CB(skb_first),
 	       sizeof(struct ieee80211_tx_info));
 
+	if (dev->params->tx_status_batch &&
+	    (skb_queue_len(&tx_done_list) > 1) &&
+	    (tx_info_1st_mpdu.flags & IEEE80211_TX_CTL_AMPDU)) {
+		tx_status_ampdu(&tx_done_list,
+				tx_done,
+				hdr_len,
+				dev,
+				&tx_info_1st_mpdu,
+				vif_index_bitmap);
+		goto status_done;
+	}
+
 	pkt = 0;
 
 	skb_queue_walk_safe(&tx_done_list, skb, tmp) {
@@ -1064,13 +1504,7 @@ int uccp420wlan_tx_free_buff_req(struct mac80211_dev *dev,
 		/* In the Tx path we move the .11hdr from skb to CMD_TX
 		 * Hence pushing it here, not required for loopback case
 		 */
-#ifdef MULTI_CHAN_SUPPORT
-		skb_push(skb,
-			 dev->tx.pkt_info[chanctx_idx][desc_id].hdr_len);
-#else
-		skb_push(skb,
-			 dev->tx.pkt_info[tx_done->descriptor_id].hdr_len);
-#endif
+		skb_push(skb, hdr_len);
 		mac_hdr = (struct ieee80211_hdr *)(skb->data);
 
 		if (!ieee80211_is_beacon(mac_hdr->frame_control)) {
@@ -1084,7 +1518,7 @@ int uccp420wlan_tx_free_buff_req(struct mac80211_dev *dev,
 				  tx_done,
 				  pkt,
 				  dev,
-				  tx_info_1st_mpdu);
+				  &tx_info_1st_mpdu);
 		} else {
 			struct ieee80211_bss_conf *bss_conf;
 			bool bcn_status;
@@ -1155,6 +1589,12 @@ int uccp420wlan_tx_free_buff_req(struct mac80211_dev *dev,
 
 		pkt++;
 	}
+
+status_done:
+#ifdef PERF_PROFILING
+	dev->stats->tx_status_ns += ktime_to_ns(ktime_sub(ktime_get(),
+							  status_start));
+#endif
 out:
 	return pkts_pend;
 }
@@ -1208,10 +1648,15 @@ void uccp420wlan_proc_ch_sw_event(struct umac_event_ch_switch *ch_sw_info,
 	dev->curr_chanctx_idx = chan_id;
 	spin_unlock(&dev->chanctx_lock);
 
+	dev->stats->chsw_events++;
+	dev->tx.chsw_start = ktime_get();
+	dev->tx.chsw_pending = 1;
+
 	/* We now try to xmit any frames whose xmission got cancelled due to a
 	 * previous channel switch
 	 */
-	uccp420wlan_tx_proc_send_pend_frms_all(dev, chan_id);
+	if (!uccp420wlan_tx_proc_send_pend_frms_all(dev, chan_id))
+		dev->tx.chsw_pending = 0;
 }
 
 
@@ -1303,10 +1748,7 @@ unsigned int uccp420wlan_proc_tx_dscrd_chsw(struct mac80211_dev *dev,
 	       (struct ieee80211_tx_info *)IEEE80211_SKB_CB(skb_first),
 	       sizeof(struct ieee80211_tx_info));
 
-	skb_queue_walk_safe(txq, skb, tmp) {
-		if (!skb)
-			continue;
-
+	skb_queue_walk(txq, skb) {
 		hal_ops.unmap_tx_buf(desc_id, pkt);
 
 		/* In the Tx path we move the .11hdr from skb to CMD_TX
@@ -1315,26 +1757,25 @@ unsigned int uccp420wlan_proc_tx_dscrd_chsw(struct mac80211_dev *dev,
 		skb_push(skb,
 			 tx->pkt_info[chanctx_idx][desc_id].hdr_len);
 
-		mac_hdr = (struct ieee80211_hdr *)skb->data;
-
-		if (retries_exceeded) {
-			__skb_unlink(skb, txq);
-
-			if (!skb)
-				continue;
-			skb_queue_tail(&tx_done_list, skb);
-
-			UCCP_DEBUG_TX("%s: %d ", __func__, __LINE__);
-			UCCP_DEBUG_TX("Freeing the skb MAX retries reached.\n");
-		} else {
-			UCCP_DEBUG_TX("%s: %d ", __func__, __LINE__);
-			UCCP_DEBUG_TX("Re-programming the skb when ");
-			UCCP_DEBUG_TX("CTX is right with retry bit set.\n");
-		mac_hdr->frame_control |= cpu_to_le16(IEEE80211_FCTL_RETRY);
+		if (!retries_exceeded) {
+			mac_hdr = (struct ieee80211_hdr *)skb->data;
+			mac_hdr->frame_control |=
+				cpu_to_le16(IEEE80211_FCTL_RETRY);
 		}
 		pkt++;
 	}
 
+	if (retries_exceeded) {
+		UCCP_DEBUG_TX("%s: %d ", __func__, __LINE__);
+		UCCP_DEBUG_TX("Freeing the skbs MAX retries reached.\n");
+		skb_queue_splice_tail_init(txq, &tx_done_list);
+	} else if (chanctx_idx != curr_chanctx_idx) {
+		UCCP_DEBUG_TX("%s: %d ", __func__, __LINE__);
+		UCCP_DEBUG_TX("Parking the skbs till CTX %d is resumed.\n",
+			      chanctx_idx);
+		tx->ready_bmp[chanctx_idx] |= BIT(desc_id);
+	}
+
 	/* First check if there is a packet in the txq of the current
 	 * chanctx that needs to be transmitted
 	 */
@@ -1344,6 +1785,7 @@ unsigned int uccp420wlan_proc_tx_dscrd_chsw(struct mac80211_dev *dev,
 	pkts_pend = txq_len;
 
 	if (txq_len) {
+		tx->ready_bmp[curr_chanctx_idx] &= ~BIT(desc_id);
 		spin_unlock_bh(&tx->lock);
 
 		/* TODO: Currently sending 0 since this param is not
@@ -1373,7 +1815,7 @@ unsigned int uccp420wlan_proc_tx_dscrd_chsw(struct mac80211_dev *dev,
 	} else {
 		/* Check pending queue */
 		/* Reserved token */
-		if (desc_id < (NUM_TX_DESCS_PER_AC * NUM_ACS)) {
+		if (desc_id < (tx->num_descs_per_ac * NUM_ACS)) {
 			queue = (desc_id % NUM_ACS);
 			start_ac = end_ac = queue;
 		} else {
@@ -1385,18 +1827,23 @@ unsigned int uccp420wlan_proc_tx_dscrd_chsw(struct mac80211_dev *dev,
 		}
 
 		for (cnt = start_ac; cnt >= end_ac; cnt--) {
+			/* Another AC gets the spare token only within its
+			 * credit
+			 */
+			if ((cnt != tx_done->queue) &&
+			    !spare_token_allowed(dev, cnt, tx_done->queue))
+				continue;
+
 			pkts_pend = uccp420wlan_tx_proc_pend_frms(dev,
 						      cnt,
 						      curr_chanctx_idx,
 						      desc_id);
 			if (pkts_pend) {
 				queue = cnt;
-				if (tx_done->queue != queue) {
-					unsigned int txd_q = tx_done->queue;
-					/*Adjust the counters*/
-					tx->outstanding_tokens[txd_q]--;
-					tx->outstanding_tokens[queue]++;
-				}
+				if (tx_done->queue != queue)
+					spare_token_move(dev,
+							 tx_done->queue,
+							 queue);
 				break;
 			}
 		}
@@ -1430,7 +1877,7 @@ tx_done:
 				  tx_done,
 				  pkt,
 				  dev,
-				  tx_info_1st_mpdu);
+				  &tx_info_1st_mpdu);
 	}
 
 	spin_lock_bh(&tx->lock);
@@ -1473,6 +1920,113 @@ static void print_persec_stats(unsigned long data)
 #endif
 
 
+int uccp420wlan_tx_alloc(struct mac80211_dev *dev,
+			 unsigned int num_descs_per_ac,
+			 unsigned int num_spare_descs)
+{
+	struct tx_config *tx = &dev->tx;
+	unsigned int num_descs = 0;
+	int i = 0;
+#ifdef MULTI_CHAN_SUPPORT
+	int j = 0;
+#endif
+
+	/* Every AC (beacon included) needs a reserved token, beacons cannot
+	 * use the spare ones. The firmware picks up the frame pointers of a
+	 * descriptor from GRAM, so all of them have to fit in there.
+	 */
+	if (num_descs_per_ac <= HAL_MAX_TX_DESC &&
+	    num_spare_descs <= HAL_MAX_TX_DESC)
+		num_descs = (NUM_ACS * num_descs_per_ac) + num_spare_descs;
+
+	if (!num_descs_per_ac || !num_descs || (num_descs > HAL_MAX_TX_DESC)) {
+		pr_err("%s-UMACTX: Invalid TX descriptors: %d per AC, %d spare (max %d in GRAM)\n",
+		       dev->name,
+		       num_descs_per_ac,
+		       num_spare_descs,
+		       HAL_MAX_TX_DESC);
+		return -EINVAL;
+	}
+
+	tx->num_descs_per_ac = num_descs_per_ac;
+	tx->num_spare_descs = num_spare_descs;
+	tx->num_descs = num_descs;
+
+	tx->buf_pool_bmp = kcalloc(BITS_TO_LONGS(num_descs),
+				   sizeof(unsigned long),
+				   GFP_KERNEL);
+	tx->proc_tx_list = kcalloc(num_descs,
+				   sizeof(struct sk_buff_head),
+				   GFP_KERNEL);
+#ifdef MULTI_CHAN_SUPPORT
+	tx->desc_chan_map = kcalloc(num_descs, sizeof(int), GFP_KERNEL);
+
+	for (j = 0; j < MAX_CHANCTX + MAX_OFF_CHANCTX; j++) {
+		tx->pkt_info[j] = kcalloc(num_descs,
+					  sizeof(struct tx_pkt_info),
+					  GFP_KERNEL);
+		if (!tx->pkt_info[j])
+			goto err;
+	}
+
+	if (!tx->desc_chan_map)
+		goto err;
+#else
+	tx->pkt_info = kcalloc(num_descs,
+			       sizeof(struct tx_pkt_info),
+			       GFP_KERNEL);
+
+	if (!tx->pkt_info)
+		goto err;
+#endif
+
+	if (!tx->buf_pool_bmp || !tx->proc_tx_list)
+		goto err;
+
+	for (i = 0; i < num_descs; i++)
+		skb_queue_head_init(&tx->proc_tx_list[i]);
+
+	pr_info("%s-UMACTX: TX descriptors: %d (%d per AC, %d spare), %d frames each\n",
+		dev->name,
+		num_descs,
+		num_descs_per_ac,
+		num_spare_descs,
+		NUM_FRAMES_IN_TX_DESC);
+
+	return 0;
+err:
+	pr_err("%s-UMACTX: Unable to allocate TX descriptor pool\n", dev->name);
+	uccp420wlan_tx_free(dev);
+
+	return -ENOMEM;
+}
+
+
+void uccp420wlan_tx_free(struct mac80211_dev *dev)
+{
+	struct tx_config *tx = &dev->tx;
+#ifdef MULTI_CHAN_SUPPORT
+	int j = 0;
+
+	for (j = 0; j < MAX_CHANCTX + MAX_OFF_CHANCTX; j++) {
+		kfree(tx->pkt_info[j]);
+		tx->pkt_info[j] = NULL;
+	}
+
+	kfree(tx->desc_chan_map);
+	tx->desc_chan_map = NULL;
+#else
+	kfree(tx->pkt_info);
+	tx->pkt_info = NULL;
+#endif
+	kfree(tx->proc_tx_list);
+	tx->proc_tx_list = NULL;
+
+	kfree(tx->buf_pool_bmp);
+	tx->buf_pool_bmp = NULL;
+}
+
+
 void uccp420wlan_tx_init(struct mac80211_dev *dev)
 {
 	int i = 0;
@@ -1482,13 +2036,15 @@ void uccp420wlan_tx_init(struct mac80211_dev *dev)
 #endif
 	struct tx_config *tx = &dev->tx;
 
-	memset(&tx->buf_pool_bmp,
-	       0,
-	       sizeof(long) * ((NUM_TX_DESCS/TX_DESC_BUCKET_BOUND) + 1));
+	bitmap_zero(tx->buf_pool_bmp, tx->num_descs);
 
 	tx->queue_stopped_bmp = 0;
+	tx->spare_denied_bmp = 0;
 	tx->next_spare_token_ac = WLAN_AC_BE;
 
+	memset(&tx->rate_cache, 0, sizeof(tx->rate_cache));
+	tx->rate_cache_gen = 0;
+
 	for (i = 0; i < NUM_ACS; i++) {
 		for (j = 0; j < MAX_PEND_Q_PER_AC; j++) {
 #ifdef MULTI_CHAN_SUPPORT
@@ -1500,9 +2056,12 @@ void uccp420wlan_tx_init(struct mac80211_dev *dev)
 		}
 
 		tx->outstanding_tokens[i] = 0;
+		tx->spare_tokens[i] = 0;
 	}
 
-	for (i = 0; i < NUM_TX_DESCS; i++) {
+	init_waitqueue_head(&tx->flush_wq);
+
+	for (i = 0; i < tx->num_descs; i++) {
 #ifdef MULTI_CHAN_SUPPORT
 		tx->desc_chan_map[i] = -1;
 
@@ -1513,6 +2072,13 @@ void uccp420wlan_tx_init(struct mac80211_dev *dev)
 #endif
 	}
 
+#ifdef MULTI_CHAN_SUPPORT
+	/* The ready lists are one word per context */
+	BUILD_BUG_ON(HAL_MAX_TX_DESC > BITS_PER_LONG);
+	memset(tx->ready_bmp, 0, sizeof(tx->ready_bmp));
+	tx->chsw_pending = 0;
+#endif
+
 	for (j = 0; j < NUM_ACS; j++)
 #ifdef MULTI_CHAN_SUPPORT
 		for (i = 0; i < MAX_CHANCTX; i++)
@@ -1531,6 +2097,11 @@ void uccp420wlan_tx_init(struct mac80211_dev *dev)
 	dev->curr_chanctx_idx = -1;
 #endif
 	spin_lock_init(&tx->lock);
+
+	/* A fresh start, whatever stopped the queues before is gone */
+	spin_lock_bh(&dev->queue_stop_lock);
+	memset(dev->queue_stop_reasons, 0, sizeof(dev->queue_stop_reasons));
+	spin_unlock_bh(&dev->queue_stop_lock);
 	ieee80211_wake_queues(dev->hw);
 
 	UCCP_DEBUG_TX("%s-UMACTX: initialization successful\n",
@@ -1538,6 +2109,42 @@ void uccp420wlan_tx_init(struct mac80211_dev *dev)
 }
 
 
+void uccp420wlan_stop_queues(struct mac80211_dev *dev,
+			     unsigned long queues,
+			     enum queue_stop_reason reason)
+{
+	int queue;
+
+	spin_lock_bh(&dev->queue_stop_lock);
+
+	for_each_set_bit(queue, &queues, IEEE80211_NUM_ACS) {
+		__set_bit(reason, &dev->queue_stop_reasons[queue]);
+		ieee80211_stop_queue(dev->hw, queue);
+	}
+
+	spin_unlock_bh(&dev->queue_stop_lock);
+}
+
+
+void uccp420wlan_wake_queues(struct mac80211_dev *dev,
+			     unsigned long queues,
+			     enum queue_stop_reason reason)
+{
+	int queue;
+
+	spin_lock_bh(&dev->queue_stop_lock);
+
+	for_each_set_bit(queue, &queues, IEEE80211_NUM_ACS) {
+		__clear_bit(reason, &dev->queue_stop_reasons[queue]);
+
+		if (!dev->queue_stop_reasons[queue])
+			ieee80211_wake_queue(dev->hw, queue);
+	}
+
+	spin_unlock_bh(&dev->queue_stop_lock);
+}
+
+
 void uccp420wlan_tx_deinit(struct mac80211_dev *dev)
 {
 	int i = 0;
@@ -1552,15 +2159,19 @@ void uccp420wlan_tx_deinit(struct mac80211_dev *dev)
 #endif
 	struct sk_buff_head *pend_q = NULL;
 
-	ieee80211_stop_queues(dev->hw);
+	uccp420wlan_stop_queues(dev, ALL_HW_QUEUES, QUEUE_STOP_DEINIT);
 
 	wait_for_tx_complete(tx);
 
 	spin_lock_bh(&tx->lock);
 
-	for (i = 0; i < NUM_TX_DESCS; i++) {
+	for (i = 0; i < tx->num_descs; i++) {
 #ifdef MULTI_CHAN_SUPPORT
 		for (j = 0; j < MAX_CHANCTX + MAX_OFF_CHANCTX; j++) {
+			/* Still being built after the wait above */
+			if (tx->pkt_info[j][i].build == TX_DESC_BUILDING)
+				tx->pkt_info[j][i].build = TX_DESC_CANCELLED;
+
 			qlen = skb_queue_len(&tx->pkt_info[j][i].pkt);
 
 			if (qlen) {
@@ -1572,6 +2183,9 @@ void uccp420wlan_tx_deinit(struct mac80211_dev *dev)
 			}
 		}
 #else
+		if (tx->pkt_info[i].build == TX_DESC_BUILDING)
+			tx->pkt_info[i].build = TX_DESC_CANCELLED;
+
 		while ((skb = skb_dequeue(&tx->pkt_info[i].pkt)) != NULL)
 			dev_kfree_skb_any(skb);
 #endif
@@ -1598,6 +2212,23 @@ void uccp420wlan_tx_deinit(struct mac80211_dev *dev)
 }
 
 
+#ifdef MULTI_CHAN_SUPPORT
+static void tx_chsw_latency_update(struct mac80211_dev *dev)
+{
+	s64 delta_us = ktime_us_delta(ktime_get(), dev->tx.chsw_start);
+
+	if (delta_us < 0)
+		delta_us = 0;
+
+	dev->stats->chsw_first_tx_cnt++;
+	dev->stats->chsw_first_tx_us += delta_us;
+
+	if (delta_us > dev->stats->chsw_first_tx_max_us)
+		dev->stats->chsw_first_tx_max_us = delta_us;
+}
+#endif
+
+
 int __uccp420wlan_tx_frame(struct mac80211_dev *dev,
 			   unsigned int queue,
 			   unsigned int token_id,
@@ -1620,6 +2251,11 @@ int __uccp420wlan_tx_frame(struct mac80211_dev *dev,
 				  token_id,
 				  retry);
 
+#ifdef MULTI_CHAN_SUPPORT
+	if (ret >= 0 && xchg(&dev->tx.chsw_pending, 0))
+		tx_chsw_latency_update(dev);
+#endif
+
 	if (ret < 0) {
 		pr_err("%s-UMACTX: Unable to send frame, dropping ..%d\n",
 		       dev->name, ret);
@@ -1636,19 +2272,106 @@ int __uccp420wlan_tx_frame(struct mac80211_dev *dev,
 		txq = &dev->tx.pkt_info[token_id].pkt;
 #endif
 
-		for (pkt = 0; pkt < skb_queue_len(txq); pkt++) {
-			tx_done.frm_status[pkt] = TX_DONE_STAT_ERR_RETRY_LIM;
-			tx_done.rate[pkt] = 0;
-		}
+		for (pkt = 0; pkt < skb_queue_len(txq); pkt++) {
+			tx_done.frm_status[pkt] = TX_DONE_STAT_ERR_RETRY_LIM;
+			tx_done.rate[pkt] = 0;
+		}
+
+		uccp420wlan_tx_complete(&tx_done,
+#ifdef MULTI_CHAN_SUPPORT
+					curr_chanctx_idx,
+#endif
+					dev);
+	}
+
+	return ret;
+}
+
+
+static void tx_meta_fill(struct mac80211_dev *dev,
+			 struct sk_buff *skb)
+{
+	struct ieee80211_tx_info *tx_info = IEEE80211_SKB_CB(skb);
+	struct ieee80211_hdr *mac_hdr = (struct ieee80211_hdr *)skb->data;
+	struct umac_tx_meta *meta = umac_tx_meta(skb);
+	struct ieee80211_key_conf *hw_key = tx_info->control.hw_key;
+	__u16 fc = mac_hdr->frame_control;
+	unsigned int hdrlen = ieee80211_hdrlen(fc);
+
+	meta->vif_index = vif_addr_to_index(mac_hdr->addr2, dev);
+	meta->encrypt = ENCRYPT_DISABLE;
+
+	/* GET The security Header Length only for data/qos-data/unicast PMF
+	 * for 11W case.
+	 * hw_key == NULL: Encrypted in SW (injected frames)
+	 * iv_len = 0: treat as SW encryption.
+	 * iv_len is always the header and icv_len is always the trailer
+	 * include only iv_len
+	 */
+	if ((ieee80211_is_data(fc) ||
+	     ieee80211_is_data_qos(fc)) &&
+	    ieee80211_has_protected(fc) &&
+	    hw_key && hw_key->iv_len) {
+		hdrlen += hw_key->iv_len;
+		meta->encrypt = ENCRYPT_ENABLE;
+	}
+
+	/* For injected frames (wlantest) hw_key is not set,as PMF uses
+	 * CCMP always so hardcode this to CCMP IV LEN 8.
+	 * For Auth3: It is completely handled in SW (mac80211).
+	 */
+	if (ieee80211_is_unicast_robust_mgmt_frame(skb) &&
+	    ieee80211_has_protected(fc)) {
+		hdrlen += 8;
+		meta->encrypt = ENCRYPT_ENABLE;
+	}
+
+	/* separate in to up to TSF and From TSF*/
+	if (ieee80211_is_beacon(fc) || ieee80211_is_probe_resp(fc))
+		hdrlen += 8; /* Timestamp*/
+
+	meta->hdr_len = hdrlen;
+}
+
+
+/* Per frame work common to all the TX entry points, returns the pending
+ * queue type (operating or off channel) the frame goes to.
+ */
+static int tx_frame_prep(struct mac80211_dev *dev,
+			 struct sk_buff *skb)
+{
+	struct ieee80211_tx_info *tx_info = IEEE80211_SKB_CB(skb);
+	struct ieee80211_hdr *mac_hdr = (struct ieee80211_hdr *)skb->data;
+	int off_chanctx_idx = 0;
+#ifdef MULTI_CHAN_SUPPORT
+	struct umac_vif *uvif = NULL;
+
+	uvif = (struct umac_vif *)(tx_info->control.vif->drv_priv);
+#endif
+
+	tx_meta_fill(dev, skb);
+
+	if (!ieee80211_is_beacon(mac_hdr->frame_control))
+		dev->stats->tx_cmds_from_stack++;
+
+	if (dev->params->production_test == 1)
+		tx_info->flags |= IEEE80211_TX_CTL_AMPDU;
 
-		uccp420wlan_tx_complete(&tx_done,
 #ifdef MULTI_CHAN_SUPPORT
-					curr_chanctx_idx,
-#endif
-					dev);
+	if ((tx_info->flags & IEEE80211_TX_CTL_TX_OFFCHAN) ||
+	    (uvif->chanctx &&
+	    uvif->chanctx->index == dev->roc_off_chanctx_idx))  {
+		atomic_inc(&dev->roc_params.roc_mgmt_tx_count);
+		off_chanctx_idx = UMAC_VIF_CHANCTX_TYPE_OFF;
+		UCCP_DEBUG_ROC("%s:%d Sending OFFCHAN Frame: %d\n",
+			__func__, __LINE__,
+			atomic_read(&dev->roc_params.roc_mgmt_tx_count));
+	} else {
+		off_chanctx_idx = UMAC_VIF_CHANCTX_TYPE_OPER;
 	}
+#endif
 
-	return ret;
+	return off_chanctx_idx;
 }
 
 
@@ -1676,6 +2399,12 @@ int uccp420wlan_tx_frame(struct sk_buff *skb,
 	uvif = (struct umac_vif *)(tx_info->control.vif->drv_priv);
 	mac_hdr = (struct ieee80211_hdr *)(skb->data);
 
+#ifdef MULTI_CHAN_SUPPORT
+	off_chanctx_idx = tx_frame_prep(dev, skb);
+#else
+	tx_frame_prep(dev, skb);
+#endif
+
 	if (sta) {
 		usta = (struct umac_sta *)sta->drv_priv;
 		peer_id = usta->index;
@@ -1692,27 +2421,6 @@ int uccp420wlan_tx_frame(struct sk_buff *skb,
 		more_frames = skb->priority;
 	}
 
-	if (!ieee80211_is_beacon(mac_hdr->frame_control))
-		dev->stats->tx_cmds_from_stack++;
-
-	if (dev->params->production_test == 1)
-		tx_info->flags |= IEEE80211_TX_CTL_AMPDU;
-
-#ifdef MULTI_CHAN_SUPPORT
-	if ((tx_info->flags & IEEE80211_TX_CTL_TX_OFFCHAN) ||
-	    (uvif->chanctx &&
-	    uvif->chanctx->index == dev->roc_off_chanctx_idx))  {
-		atomic_inc(&dev->roc_params.roc_mgmt_tx_count);
-		off_chanctx_idx = UMAC_VIF_CHANCTX_TYPE_OFF;
-		UCCP_DEBUG_ROC("%s:%d Sending OFFCHAN Frame: %d\n",
-			__func__, __LINE__,
-			atomic_read(&dev->roc_params.roc_mgmt_tx_count));
-	} else {
-		off_chanctx_idx = UMAC_VIF_CHANCTX_TYPE_OPER;
-	}
-#endif
-
-
 	UCCP_DEBUG_TX("%s-UMACTX:%s:%d ",
 			dev->name,
 			 __func__,
@@ -1733,7 +2441,7 @@ int uccp420wlan_tx_frame(struct sk_buff *skb,
 						 skb);
 
 	/* The frame was unable to find a reserved token */
-	if (token_id == NUM_TX_DESCS) {
+	if (token_id == dev->tx.num_descs) {
 		UCCP_DEBUG_TX("%s-UMACTX:%s:%d Token Busy Queued:\n",
 			dev->name, __func__, __LINE__);
 		return NETDEV_TX_OK;
@@ -1753,31 +2461,288 @@ int uccp420wlan_tx_frame(struct sk_buff *skb,
 }
 
 
+/* Sends the frames held back for NoA. They all go to the pending queues
+ * first, then each AC they landed on takes a single token and fills it
+ * through uccp420wlan_tx_proc_pend_frms, so they can be aggregated. What
+ * does not fit goes on the next TX_DONE.
+ */
+void uccp420wlan_tx_noa_release(struct mac80211_dev *dev,
+#ifdef MULTI_CHAN_SUPPORT
+				int curr_chanctx_idx,
+#endif
+				struct sk_buff_head *frames)
+{
+	struct tx_config *tx = &dev->tx;
+	struct sk_buff_head *pend_pkt_q = NULL;
+	struct ieee80211_tx_info *tx_info = NULL;
+	struct umac_vif *uvif = NULL;
+	struct sk_buff *skb = NULL;
+	unsigned long acs = 0;
+	unsigned int pkts_pend = 0;
+#ifdef MULTI_CHAN_SUPPORT
+	int off_chanctx_idx = 0;
+#endif
+	int peer_id = 0;
+	int token_id = 0;
+	int ac = 0;
+
+	spin_lock_bh(&tx->lock);
+
+	while ((skb = __skb_dequeue(frames))) {
+		tx_info = IEEE80211_SKB_CB(skb);
+		uvif = (struct umac_vif *)(tx_info->control.vif->drv_priv);
+		peer_id = MAX_PEERS + uvif->vif_index;
+		ac = tx_queue_map(skb->queue_mapping);
+
+#ifdef MULTI_CHAN_SUPPORT
+		off_chanctx_idx = tx_frame_prep(dev, skb);
+		pend_pkt_q = &tx->pending_pkt[off_chanctx_idx][peer_id][ac];
+#else
+		tx_frame_prep(dev, skb);
+		pend_pkt_q = &tx->pending_pkt[peer_id][ac];
+#endif
+		skb_queue_tail(pend_pkt_q, skb);
+		acs |= BIT(ac);
+
+		/* Same back pressure as uccp420wlan_tx_alloc_token */
+		if ((skb_queue_len(pend_pkt_q) >= MAX_TX_QUEUE_LEN) &&
+		    (!dev->roc_params.roc_in_progress ||
+		     (ac != UMAC_ROC_AC))) {
+			uccp420wlan_stop_queues(dev,
+						BIT(skb->queue_mapping),
+						QUEUE_STOP_TX_FULL);
+			tx->queue_stopped_bmp |= (1 << ac);
+		}
+	}
+
+	for (ac = WLAN_AC_VO; ac >= WLAN_AC_BK; ac--) {
+		if (!(acs & BIT(ac)))
+			continue;
+
+		token_id = get_token(dev,
+#ifdef MULTI_CHAN_SUPPORT
+				     curr_chanctx_idx,
+#endif
+				     ac);
+
+		if (token_id == tx->num_descs)
+			continue;
+
+		pkts_pend = uccp420wlan_tx_proc_pend_frms(dev,
+							  ac,
+#ifdef MULTI_CHAN_SUPPORT
+							  curr_chanctx_idx,
+#endif
+							  token_id);
+
+		if (!pkts_pend) {
+			free_token(dev, token_id, ac);
+			continue;
+		}
+
+		spin_unlock_bh(&tx->lock);
+
+		__uccp420wlan_tx_frame(dev,
+				       ac,
+				       token_id,
+#ifdef MULTI_CHAN_SUPPORT
+				       curr_chanctx_idx,
+#endif
+				       0,
+				       0);
+
+		spin_lock_bh(&tx->lock);
+	}
+
+	spin_unlock_bh(&tx->lock);
+}
+
+
+/* Called with tx->lock held, drops it around each send. The descriptors are
+ * filled like on TX_DONE, check_80211_aggregation packs the burst.
+ */
+static void bcast_burst_drain(struct mac80211_dev *dev,
+#ifdef MULTI_CHAN_SUPPORT
+			      int curr_chanctx_idx,
+#endif
+			      struct sk_buff_head *pend_pkt_q)
+{
+	struct tx_config *tx = &dev->tx;
+	unsigned int pkts_pend = 0;
+	int token_id = 0;
+	unsigned int more_frames = 0;
+
+	while (!skb_queue_empty(pend_pkt_q)) {
+		token_id = get_token(dev,
+#ifdef MULTI_CHAN_SUPPORT
+				     curr_chanctx_idx,
+#endif
+				     WLAN_AC_BCN);
+
+		if (token_id == tx->num_descs)
+			break;
+
+		pkts_pend = uccp420wlan_tx_proc_pend_frms(dev,
+							  WLAN_AC_BCN,
+#ifdef MULTI_CHAN_SUPPORT
+							  curr_chanctx_idx,
+#endif
+							  token_id);
+
+		if (!pkts_pend) {
+			free_token(dev, token_id, WLAN_AC_BCN);
+			break;
+		}
+
+		more_frames = !skb_queue_empty(pend_pkt_q);
+
+		dev->stats->bcast_burst_descs++;
+		dev->stats->bcast_burst_frames += pkts_pend;
+
+		spin_unlock_bh(&tx->lock);
+
+		__uccp420wlan_tx_frame(dev,
+				       WLAN_AC_BCN,
+				       token_id,
+#ifdef MULTI_CHAN_SUPPORT
+				       curr_chanctx_idx,
+#endif
+				       more_frames,
+				       0);
+
+		spin_lock_bh(&tx->lock);
+	}
+}
+
+
+/* Sends the group addressed frames released after a DTIM beacon. Instead of
+ * a descriptor per frame, consecutive frames that bcast_burst_can_pack allows
+ * go out in one UMAC_CMD_TX so the FW can send them back to back; more_frms
+ * is set on every descriptor but the last one. Frames that do not get a
+ * beacon queue token stay on the pending queue for the next TX_DONE.
+ * Called with bcast_lock held.
+ */
+void uccp420wlan_tx_bcast_burst(struct mac80211_dev *dev,
+				struct umac_vif *uvif,
+#ifdef MULTI_CHAN_SUPPORT
+				int curr_chanctx_idx,
+#endif
+				struct sk_buff_head *frames)
+{
+	struct tx_config *tx = &dev->tx;
+	struct sk_buff *skb = NULL, *tmp = NULL;
+	struct ieee80211_hdr *mac_hdr = NULL;
+	int peer_id = MAX_PEERS + uvif->vif_index;
+#ifdef MULTI_CHAN_SUPPORT
+	struct sk_buff_head *pend_pkt_q[MAX_UMAC_VIF_CHANCTX_TYPES];
+	int off_chanctx_idx = 0;
+	int i = 0;
+#else
+	struct sk_buff_head *pend_pkt_q =
+		&tx->pending_pkt[peer_id][WLAN_AC_BCN];
+#endif
+
+	if (skb_queue_empty(frames))
+		return;
+
+	/* The more data bit tells the sleeping stations whether to stay
+	 * awake, only the last frame of the burst has it cleared.
+	 */
+	skb_queue_walk(frames, skb) {
+		mac_hdr = (struct ieee80211_hdr *)skb->data;
+
+		if (skb_queue_is_last(frames, skb))
+			mac_hdr->frame_control &=
+				~cpu_to_le16(IEEE80211_FCTL_MOREDATA);
+		else
+			mac_hdr->frame_control |=
+				cpu_to_le16(IEEE80211_FCTL_MOREDATA);
+	}
+
+	spin_lock_bh(&tx->lock);
+
+	dev->stats->bcast_bursts++;
+
+#ifdef MULTI_CHAN_SUPPORT
+	for (i = 0; i < MAX_UMAC_VIF_CHANCTX_TYPES; i++)
+		pend_pkt_q[i] = NULL;
+
+	/* Each frame goes to the pending queue of its own channel context
+	 * type, tx_frame_prep works it out per frame.
+	 */
+	skb_queue_walk_safe(frames, skb, tmp) {
+		off_chanctx_idx = tx_frame_prep(dev, skb);
+
+		if (!pend_pkt_q[off_chanctx_idx])
+			pend_pkt_q[off_chanctx_idx] =
+				&tx->pending_pkt[off_chanctx_idx][peer_id]
+						[WLAN_AC_BCN];
+
+		__skb_unlink(skb, frames);
+		skb_queue_tail(pend_pkt_q[off_chanctx_idx], skb);
+	}
+
+	for (i = 0; i < MAX_UMAC_VIF_CHANCTX_TYPES; i++) {
+		if (pend_pkt_q[i])
+			bcast_burst_drain(dev, curr_chanctx_idx,
+					  pend_pkt_q[i]);
+	}
+#else
+	skb_queue_walk_safe(frames, skb, tmp) {
+		tx_frame_prep(dev, skb);
+		__skb_unlink(skb, frames);
+		skb_queue_tail(pend_pkt_q, skb);
+	}
+
+	bcast_burst_drain(dev, pend_pkt_q);
+#endif
+
+	spin_unlock_bh(&tx->lock);
+}
+
+
 void uccp420wlan_proc_tx_complete(struct umac_event_tx_done *tx_done,
 			     void *context)
 {
 
 	struct mac80211_dev *dev = (struct mac80211_dev *)context;
-	struct sk_buff *skb, *tmp;
+	struct pkt_gen *gen = &dev->pkt_gen;
+	struct sk_buff *skb;
 	struct sk_buff_head *tx_done_list;
 	unsigned int pkt = 0;
+	unsigned int desc = tx_done->descriptor_id;
 
-	tx_done_list = &dev->tx.proc_tx_list[tx_done->descriptor_id];
+	tx_done_list = &dev->tx.proc_tx_list[desc];
 	dev->stats->tx_done_recv_count++;
 	update_aux_adc_voltage(dev, tx_done->pdout_voltage);
-	skb_queue_walk_safe(tx_done_list, skb, tmp) {
-		__skb_unlink(skb, tx_done_list);
-		if (!skb)
-			continue;
-		hal_ops.unmap_tx_buf(tx_done->descriptor_id, pkt);
-		dev_kfree_skb_any(skb);
+
+	spin_lock_bh(&gen->lock);
+
+	/* Keep the frames as they are for the next round */
+	skb_queue_walk(tx_done_list, skb) {
+		hal_ops.unmap_tx_buf(desc, pkt);
+		skb_push(skb, PKT_GEN_HDR_LEN);
+		gen->bytes += skb->len;
 		pkt++;
 	}
 
+	gen->frames += pkt;
+
+	if (gen->in_flight)
+		gen->in_flight--;
+
 	/*send NEXT packet list*/
-	if ((dev->params->pkt_gen_val == -1) ||
-	    (--dev->params->pkt_gen_val > 0))
+	if (gen->running && gen->remaining) {
+		__set_bit(desc, &gen->ready_bmp);
 		tasklet_schedule(&dev->proc_tx_tasklet);
+	} else {
+		skb_queue_purge(tx_done_list);
+
+		if (!gen->in_flight && !ktime_to_ns(gen->end))
+			gen->end = ktime_get();
+	}
+
+	spin_unlock_bh(&gen->lock);
 }
 
 void uccp420wlan_tx_complete(struct umac_event_tx_done *tx_done,
@@ -1907,20 +2872,45 @@ void uccp420_purge_tx_queue(struct mac80211_dev *dev,
 
 }
 
+static bool tx_pend_q_drained(struct tx_config *tx,
+			      struct sk_buff_head *pend_pkt_q)
+{
+	bool drained;
+
+	spin_lock_bh(&tx->lock);
+	drained = skb_queue_empty(pend_pkt_q);
+	spin_unlock_bh(&tx->lock);
+
+	return drained;
+}
+
+
+static bool tx_tokens_drained(struct tx_config *tx,
+			      unsigned int tokens)
+{
+	bool drained;
+
+	spin_lock_bh(&tx->lock);
+	drained = !(tx->buf_pool_bmp[0] & tokens);
+	spin_unlock_bh(&tx->lock);
+
+	return drained;
+}
+
+
 static int uccp420_flush_vif_all_pend_q(struct mac80211_dev *dev,
 					struct umac_vif *uvif,
 					unsigned int hw_queue_map,
 					enum UMAC_VIF_CHANCTX_TYPE chanctx_type)
 {
 	unsigned int pending = 0;
-	int count = 0;
+	unsigned long timeout = QUEUE_FLUSH_TIMEOUT_TICKS;
 	unsigned int queue = 0;
 	int pend_q = 0;
 	struct sk_buff_head *pend_pkt_q = NULL;
 	struct tx_config *tx = NULL;
 	struct ieee80211_sta *sta = NULL;
 	struct umac_sta *usta = NULL;
-	bool warned = false;
 
 	tx = &dev->tx;
 
@@ -1976,51 +2966,28 @@ static int uccp420_flush_vif_all_pend_q(struct mac80211_dev *dev,
 				continue;
 			}
 
-			while (1) {
-				spin_lock_bh(&tx->lock);
+			pend_pkt_q =
+				&tx->pending_pkt[chanctx_type][pend_q][queue];
 
-				pend_pkt_q =
-					&tx->pending_pkt[chanctx_type]
-							[pend_q]
-							[queue];
+			/* Assuming all packets for the peer have same
+			 * channel context
+			 */
+			timeout = wait_event_timeout(tx->flush_wq,
+						     tx_pend_q_drained(tx,
+								       pend_pkt_q),
+						     timeout);
 
-				/* Assuming all packets for the peer have same
-				 * channel context
-				 */
+			if (!timeout) {
+				spin_lock_bh(&tx->lock);
 				pending = skb_queue_len(pend_pkt_q);
-
 				spin_unlock_bh(&tx->lock);
 
-				if (!pending)
-					break;
-
-				if (!warned &&
-				    count >= QUEUE_FLUSH_TIMEOUT_TICKS) {
-					pr_err("%s: Timeout: VIF: %d Queue: %d pending: %d\n",
-					       dev->name,
-					       uvif->vif_index,
-					       queue,
-					       pending);
-					WARN_ON(1);
-					warned = true;
-					return -1;
-				}
-
-				current->state = TASK_INTERRUPTIBLE;
-
-				if (schedule_timeout(1) == 0)
-					count++;
-
-			}
-
-			if (pending) {
-				pr_err("%s-UMACTX: Failed for VIF: %d ",
-					       dev->name,
-					       uvif->vif_index);
-				pr_err(" and Queue: %d, pending: %d\n",
-					       queue,
-					       pending);
-
+				pr_err("%s: Timeout: VIF: %d Queue: %d pending: %d\n",
+				       dev->name,
+				       uvif->vif_index,
+				       queue,
+				       pending);
+				WARN_ON(1);
 				return -1;
 			}
 		}
@@ -2080,6 +3047,7 @@ int uccp420_discard_sta_pend_q(struct mac80211_dev *dev,
 
 		skb_queue_splice_tail_init(pend_pkt_q,
 					   &tx_discard_list);
+		tx_flush_wake(tx);
 		uccp420_purge_tx_queue(dev, &tx_discard_list);
 
 	}
@@ -2109,7 +3077,7 @@ int uccp420_discard_sta_tx_q(struct mac80211_dev *dev,
 		      hw_queue_map,
 		      uvif->vif_index);
 
-	for (i = 0; i < NUM_TX_DESCS; i++) {
+	for (i = 0; i < tx->num_descs; i++) {
 		pkt_info = &tx->pkt_info[chanctx_idx][i];
 		UCCP_DEBUG_TX("%s:%d pvif: %d uvif:%d q:%d hq:%d peer_id:%d\n",
 			      __func__,
@@ -2127,6 +3095,14 @@ int uccp420_discard_sta_tx_q(struct mac80211_dev *dev,
 
 			txq = &pkt_info->pkt;
 
+			/* Frames off the descriptor, uccp420wlan_prog_tx
+			 * drops them instead of sending
+			 */
+			if (pkt_info->build == TX_DESC_BUILDING) {
+				pkt_info->build = TX_DESC_CANCELLED;
+				continue;
+			}
+
 			if (!skb_queue_len(txq) ||
 			    !test_bit(i, &tx->buf_pool_bmp[pool_id]))
 				continue;
@@ -2185,62 +3161,81 @@ static int uccp420_flush_vif_tx_queues(struct mac80211_dev *dev,
 				       int chanctx_idx,
 				       unsigned int hw_queue_map)
 {
-	unsigned int tokens = 0;
+	unsigned int tokens[NUM_ACS] = {0};
 	unsigned int i = 0;
+	unsigned int queue = 0;
 	unsigned long buf_pool_bmp = 0;
+	unsigned long timeout = QUEUE_FLUSH_TIMEOUT_TICKS;
 	struct tx_pkt_info *pkt_info = NULL;
 	struct tx_config *tx = NULL;
-	int count = 0;
-	bool warned = false;
 
 	tx = &dev->tx;
 
 	spin_lock_bh(&tx->lock);
 
-	for (i = 0; i < NUM_TX_DESCS; i++) {
+	for (i = 0; i < tx->num_descs; i++) {
 		pkt_info = &tx->pkt_info[chanctx_idx][i];
 
 		if ((pkt_info->vif_index == uvif->vif_index) &&
 		    (BIT(pkt_info->queue) & hw_queue_map))
-			tokens |= BIT(i);
+			tokens[pkt_info->queue] |= BIT(i);
 	}
 
 	spin_unlock_bh(&tx->lock);
 
-	if (!tokens)
-		return 0;
+	for (queue = 0; queue < NUM_ACS; queue++) {
+		if (!tokens[queue])
+			continue;
 
-	while (1) {
-		spin_lock_bh(&tx->lock);
-		buf_pool_bmp = tx->buf_pool_bmp[0];
-		spin_unlock_bh(&tx->lock);
+		timeout = wait_event_timeout(tx->flush_wq,
+					     tx_tokens_drained(tx,
+							       tokens[queue]),
+					     timeout);
 
-		if (!(buf_pool_bmp & tokens))
-			break;
+		if (!timeout) {
+			spin_lock_bh(&tx->lock);
+			buf_pool_bmp = tx->buf_pool_bmp[0];
+			spin_unlock_bh(&tx->lock);
 
-		if (!warned &&
-		    count >= QUEUE_FLUSH_TIMEOUT_TICKS) {
 			pr_err("%s-UMACTX: TXQ: Failed for VIF: %d, buf_pool_bmp : 0x%lx:\n",
 			       dev->name,
 			       uvif->vif_index,
 			       buf_pool_bmp);
 			WARN_ON(1);
-			warned = true;
 			return -1;
 		}
-
-		current->state = TASK_INTERRUPTIBLE;
-
-		if (schedule_timeout(1) == 0)
-			count++;
 	}
 
-	UCCP_DEBUG_TX("%s: Success for VIF: %d, buf_pool_bmp : 0x%lx\n",
+	UCCP_DEBUG_TX("%s: Success for VIF: %d\n",
 					__func__,
-					uvif->vif_index,
-					buf_pool_bmp);
+					uvif->vif_index);
 	return 0;
 }
+
+
+static void tx_desc_cancel_building(struct mac80211_dev *dev,
+				    struct umac_vif *uvif,
+				    int chanctx_idx,
+				    unsigned int hw_queue_map)
+{
+	struct tx_config *tx = &dev->tx;
+	struct tx_pkt_info *pkt_info;
+	unsigned int i;
+
+	spin_lock_bh(&tx->lock);
+
+	for (i = 0; i < tx->num_descs; i++) {
+		pkt_info = &tx->pkt_info[chanctx_idx][i];
+
+		if ((pkt_info->build == TX_DESC_BUILDING) &&
+		    (pkt_info->vif_index == uvif->vif_index) &&
+		    (BIT(pkt_info->queue) & hw_queue_map))
+			pkt_info->build = TX_DESC_CANCELLED;
+	}
+
+	spin_unlock_bh(&tx->lock);
+}
+
 int uccp420_discard_vif_all_pend_q(struct mac80211_dev *dev,
 				   struct umac_vif *uvif,
 				   unsigned int hw_queue_map)
@@ -2318,6 +3313,7 @@ int uccp420_flush_vif_queues(struct mac80211_dev *dev,
 {
 	int result  = -1;
 	char peer_addr[ETH_ALEN] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+	ktime_t start;
 
 	UCCP_DEBUG_TX("%s:%d Enter..:tx:%d txd:%d\n", __func__, __LINE__,
 		      dev->stats->tx_cmds_from_stack,
@@ -2332,7 +3328,10 @@ int uccp420_flush_vif_queues(struct mac80211_dev *dev,
 		if (result)
 			return result;
 
-		dev->tx_deinit_complete = 0;
+		/* Not to reach the FW after its TX deinit */
+		tx_desc_cancel_building(dev, uvif, chanctx_idx, hw_queue_map);
+
+		reinit_completion(&dev->tx_deinit_complete);
 		uccp420wlan_prog_tx_deinit(uvif->vif_index, peer_addr);
 		if (wait_for_tx_deinit_complete(dev) < 0) {
 			/*Stuck: Reload FW??*/
@@ -2345,6 +3344,7 @@ int uccp420_flush_vif_queues(struct mac80211_dev *dev,
 	} else {
 		UCCP_DEBUG_TX("%s: FLUSH\n", __func__);
 		/*Flush: Wait for frames*/
+		start = ktime_get();
 		result = uccp420_flush_vif_all_pend_q(dev,
 						      uvif,
 						      hw_queue_map,
@@ -2357,6 +3357,11 @@ int uccp420_flush_vif_queues(struct mac80211_dev *dev,
 							     hw_queue_map);
 		}
 
+		if (result == 0)
+			tx_flush_hist_update(dev, start);
+		else
+			dev->stats->tx_flush_timeouts++;
+
 		if (result) {
 			result = uccp420_discard_vif_all_pend_q(dev,
 								uvif,
@@ -56,6 +56,77 @@ struct lmac_if_data {
 
 static struct lmac_if_data __rcu *lmac_if;
 
+/* Last values handed to the FW, a command that would not change them is
+ * dropped. The FW acks commands in order and a failed send forgets the
+ * value, so this follows what the FW has applied. Cleared on every reset.
+ * Updated under control_path_lock.
+ */
+#define FW_SHADOW_UNKNOWN (-1)
+
+struct fw_shadow_vif {
+	int ps_state;
+	int short_retry;
+	int long_retry;
+	bool chan_valid;
+	struct cmd_channel channel;
+};
+
+static struct {
+	int txpower;
+	int mcast_filter;
+	int mcast_addr_cnt;
+	unsigned char mcast_addr[MCST_ADDR_LIMIT][ETH_ALEN];
+	struct fw_shadow_vif vif[MAX_VIFS];
+} fw_shadow;
+
+/* Control commands are built in skbs taken from these pools. The pool holds
+ * a reference on each buffer, so it is free again once the HAL (or a purge
+ * of the command queue) drops the one handed out with it.
+ */
+#define CMD_POOL_MAX_DEPTH 16
+
+static const unsigned int cmd_pool_len[CMD_POOL_CLASSES] = {
+	256,	/* Most commands */
+	1024,	/* cmd_reset, cmd_nw_selection, cmd_scan with a few IEs */
+	3072	/* cmd_scan with up to IEEE80211_MAX_DATA_LEN of IEs */
+};
+
+static const unsigned int cmd_pool_depth[CMD_POOL_CLASSES] = {
+	CMD_POOL_MAX_DEPTH,
+	4,
+	2
+};
+
+static struct {
+	spinlock_t lock;
+	struct sk_buff *skb[CMD_POOL_CLASSES][CMD_POOL_MAX_DEPTH];
+} cmd_pool;
+
+
+static void fw_shadow_vif_reset(int index)
+{
+	struct fw_shadow_vif *vif = &fw_shadow.vif[index];
+
+	vif->ps_state = FW_SHADOW_UNKNOWN;
+	vif->short_retry = FW_SHADOW_UNKNOWN;
+	vif->long_retry = FW_SHADOW_UNKNOWN;
+	vif->chan_valid = false;
+}
+
+
+static void fw_shadow_reset(void)
+{
+	int index;
+
+	fw_shadow.txpower = FW_SHADOW_UNKNOWN;
+	fw_shadow.mcast_filter = FW_SHADOW_UNKNOWN;
+	fw_shadow.mcast_addr_cnt = 0;
+
+	for (index = 0; index < MAX_VIFS; index++)
+		fw_shadow_vif_reset(index);
+}
+
+
 static void update_mcs_packet_stat(int mcs_rate_num,
 				   int rate_flags,
 				   struct mac80211_dev *dev)
@@ -152,19 +223,96 @@ static void update_mcs_packet_stat(int mcs_rate_num,
 }
 
 
-static void get_rate(struct sk_buff *skb,
-		     struct cmd_tx_ctrl *txcmd,
-		     struct tx_pkt_info *pkt_info,
-		     bool retry,
-		     struct mac80211_dev *dev)
+#define RATE_FRM_DATA		BIT(0)
+#define RATE_FRM_MCAST		BIT(1)
+#define RATE_FRM_PROTECTED	BIT(2)
+
+#define RATE_CTL_FLAGS (IEEE80211_TX_CTL_LDPC | \
+			IEEE80211_TX_CTL_STBC | \
+			IEEE80211_TX_CTL_AMPDU)
+
+static unsigned int get_rate_frm_type(struct sk_buff *skb)
+{
+	struct ieee80211_hdr *hdr = (struct ieee80211_hdr *) skb->data;
+	unsigned int frm_type = 0;
+
+	if (ieee80211_is_data(hdr->frame_control))
+		frm_type |= RATE_FRM_DATA;
+
+	if (is_multicast_ether_addr(hdr->addr1))
+		frm_type |= RATE_FRM_MCAST;
+
+	if (ieee80211_has_protected(hdr->frame_control))
+		frm_type |= RATE_FRM_PROTECTED;
+
+	return frm_type;
+}
+
+
+/* Protection which depends on the length of the frame, has to be evaluated
+ * for every frame even when the rates come from the cache.
+ */
+static unsigned char get_rate_len_prot(struct sk_buff *skb,
+				       struct ieee80211_tx_info *c,
+				       unsigned int frm_type,
+				       unsigned char prot_type,
+				       struct mac80211_dev *dev)
+{
+	/*RTS threshold: Check for PSDU length
+	 * Need to add all HW added lenghts to skb,
+	 * sw added lengths are already part of skb->len
+	 * IV ==> Always SW
+	 * MIC for CCMP ==> HW (MMIC for TKIP ==> SW)
+	 * ICV ==> HW
+	 * FCS ==> HW
+	*/
+	if ((frm_type & RATE_FRM_DATA) &&
+	    !(frm_type & RATE_FRM_MCAST) &&
+	    (frm_type & RATE_FRM_PROTECTED)) {
+		if (skb->len +
+		    c->control.hw_key->icv_len +
+		    dev->rts_threshold < FCS_LEN)
+			prot_type = USE_PROTECTION_RTS;
+	}
+
+	if ((frm_type & RATE_FRM_DATA) &&
+	    !(frm_type & RATE_FRM_MCAST) &&
+	    !(frm_type & RATE_FRM_PROTECTED) &&
+	    (skb->len + FCS_LEN > dev->rts_threshold))
+		prot_type = USE_PROTECTION_RTS;
+
+	return prot_type;
+}
+
+
+static void add_rate_mcs_stat(struct umac_rate_tbl *tbl,
+			      unsigned char mcs_rate_num,
+			      unsigned char rate_flags)
+{
+	if (tbl->num_mcs_stats >= ARRAY_SIZE(tbl->mcs_stat_rate))
+		return;
+
+	tbl->mcs_stat_rate[tbl->num_mcs_stats] = mcs_rate_num;
+	tbl->mcs_stat_flags[tbl->num_mcs_stats] = rate_flags;
+	tbl->num_mcs_stats++;
+}
+
+
+/* Translate the mac80211 RC rates (and the proc overrides) of a frame in to
+ * the UMAC_CMD_TX rate fields. The result depends only on the rates, the
+ * tx_info flags, the band, the frame type and the params, so it can be
+ * cached and reused till any of them change.
+ */
+static void compile_rate_tbl(struct ieee80211_tx_info *c,
+			     unsigned int frm_type,
+			     struct umac_rate_tbl *tbl,
+			     struct mac80211_dev *dev)
 {
 	struct ieee80211_rate *rate;
-	struct ieee80211_tx_info *c = IEEE80211_SKB_CB(skb);
 	unsigned int index, min_rate;
 	bool is_mcs = false, is_mgd = false;
 	struct ieee80211_tx_rate *txrate;
 	unsigned char mcs_rate_num = 0;
-	struct ieee80211_hdr *hdr = (struct ieee80211_hdr *) skb->data;
 	int mcs_indx;
 	int mgd_rate;
 	int mgd_mcast_rate;
@@ -172,47 +320,8 @@ static void get_rate(struct sk_buff *skb,
 	unsigned char nss = 1;
 	bool all_rates_invalid = true;
 
-	/* production test*/
-	if (dev->params->production_test == 1) {
-		index = 0;
-		if (dev->params->tx_fixed_mcs_indx != -1) {
-			txcmd->rate[index] = 0x80;
-			txcmd->rate[index] |=
-			    (dev->params->tx_fixed_mcs_indx);
-			txcmd->num_spatial_streams[index] =
-			    dev->params->num_spatial_streams;
-			txcmd->bcc_or_ldpc =
-			    dev->params->prod_mode_bcc_or_ldpc;
-			txcmd->stbc_enabled =
-			    dev->params->prod_mode_stbc_enabled;
-			update_mcs_packet_stat(
-			    dev->params->tx_fixed_mcs_indx,
-			    txcmd->rate_flags[index], dev);
-		} else if (dev->params->production_test == 1 &&
-			   dev->params->tx_fixed_rate != -1) {
-			txcmd->rate[index] = 0x00;
-			if (dev->params->tx_fixed_rate == 55)
-				txcmd->rate[index] |=
-				 ((dev->params->tx_fixed_rate) /
-				  5);
-			else
-				txcmd->rate[index] |=
-				  ((dev->params->tx_fixed_rate *
-				    10) / 5);
-			txcmd->num_spatial_streams[index] = 1;
-			txcmd->bcc_or_ldpc = 0;
-			txcmd->stbc_enabled = 0;
-		}
-		txcmd->num_rates = 1;
-		txcmd->rate_retries[index] = 1;
-		txcmd->rate_flags[index] =
-			dev->params->prod_mode_rate_flag;
-		txcmd->rate_preamble_type[index] =
-			dev->params->prod_mode_rate_preamble_type;
-		return;
-	}
+	memset(tbl, 0, sizeof(struct umac_rate_tbl));
 
-	/* Normal Mode*/
 	rate = ieee80211_get_tx_rate(dev->hw, c);
 	min_rate = dev->hw->wiphy->bands[c->band]->bitrates[0].hw_value;
 
@@ -221,44 +330,40 @@ static void get_rate(struct sk_buff *skb,
 			      __func__,
 			      __LINE__,
 			      c->control.rates[0].idx);
-		txcmd->num_rates = 1;
-		txcmd->rate[0] = min_rate;
-		txcmd->rate_retries[0] = 5;
-		txcmd->rate_protection_type[0] = USE_PROTECTION_NONE;
-		txcmd->rate_preamble_type[0] = DONT_USE_SHORT_PREAMBLE;
-		txcmd->num_spatial_streams[0] = 1;
-		txcmd->bcc_or_ldpc = 0;
-		txcmd->stbc_enabled = 0;
-		txcmd->rate_flags[0] = 0;
+		tbl->num_rates = 1;
+		tbl->rate[0] = min_rate;
+		tbl->rate_retries[0] = 5;
+		tbl->rate_protection_type[0] = USE_PROTECTION_NONE;
+		tbl->rate_preamble_type[0] = DONT_USE_SHORT_PREAMBLE;
+		tbl->num_spatial_streams[0] = 1;
+		tbl->bcc_or_ldpc = 0;
+		tbl->stbc_enabled = 0;
+		tbl->rate_flags[0] = 0;
 		return;
 	}
 
-	/* Some defaults*/
-	txcmd->num_rates = 0;
-	txcmd->stbc_enabled = 0;
-
 	/* BCC (or) LDPC */
 	if (c->flags & IEEE80211_TX_CTL_LDPC)
-		txcmd->bcc_or_ldpc = 1;
+		tbl->bcc_or_ldpc = 1;
 	else
-		txcmd->bcc_or_ldpc = 0;
+		tbl->bcc_or_ldpc = 0;
 
-	if (ieee80211_is_data(hdr->frame_control) &&
+	if ((frm_type & RATE_FRM_DATA) &&
 	    c->flags & IEEE80211_TX_CTL_AMPDU) {
-		txcmd->aggregate_mpdu = AMPDU_AGGR_ENABLED;
+		tbl->aggregate_mpdu = AMPDU_AGGR_ENABLED;
 	}
 
 	for (index = 0; index < 4; index++) {
 		bool skip_rate = false;
 
 		txrate = (&c->control.rates[index]);
-		txcmd->rate_flags[index] = 0;
+		tbl->rate_flags[index] = 0;
 
 		if (txrate->idx < 0)
 			continue;
 
-		txcmd->num_rates++;
-		txcmd->num_spatial_streams[index] = 1;
+		tbl->num_rates++;
+		tbl->num_spatial_streams[index] = 1;
 
 		/* No input from production_test proc, continue and use
 		 * info from mac80211 RC
@@ -273,12 +378,12 @@ static void get_rate(struct sk_buff *skb,
 			is_mcs = true;
 			mcs_rate_num = ieee80211_rate_get_vht_mcs(txrate);
 			nss =  ieee80211_rate_get_vht_nss(txrate);
-			txcmd->rate_flags[index] |= ENABLE_VHT_FORMAT;
+			tbl->rate_flags[index] |= ENABLE_VHT_FORMAT;
 		} else if (txrate->flags & IEEE80211_TX_RC_MCS) {
 			is_mcs = true;
 			mcs_rate_num  = txrate->idx;
 			nss = mcs_rate_num/8 + 1;
-			txcmd->rate_flags[index] |= ENABLE_11N_FORMAT;
+			tbl->rate_flags[index] |= ENABLE_11N_FORMAT;
 		}
 
 		mcs_indx = dev->params->mgd_mode_tx_fixed_mcs_indx;
@@ -292,8 +397,8 @@ static void get_rate(struct sk_buff *skb,
 		 * From RC in mac80211
 		 * Can be MCS(HT/VHT) or Rate (11abg)
 		 */
-		if (ieee80211_is_data(hdr->frame_control) &&
-		    is_multicast_ether_addr(hdr->addr1) &&
+		if ((frm_type & RATE_FRM_DATA) &&
+		    (frm_type & RATE_FRM_MCAST) &&
 		    (mgd_mcast_rate != -1)) {
 			/* proc: Fixed MCS/Legacy rate for Multicast packets
 			 */
@@ -307,92 +412,92 @@ static void get_rate(struct sk_buff *skb,
 					mgd_mcast_rate *= 2;
 			}
 
-			txcmd->rate[index] = mgd_mcast_rate;
-			txcmd->rate_flags[index] =
+			tbl->rate[index] = mgd_mcast_rate;
+			tbl->rate_flags[index] =
 				dev->params->mgd_mode_mcast_fixed_rate_flags;
-			txcmd->bcc_or_ldpc =
+			tbl->bcc_or_ldpc =
 				dev->params->mgd_mode_mcast_fixed_bcc_or_ldpc;
-			if (txcmd->rate_flags[index] & ENABLE_11N_FORMAT)
+			if (tbl->rate_flags[index] & ENABLE_11N_FORMAT)
 				nss = (mgd_mcast_rate & 0x7F)/8 + 1;
 			else
 				nss = dev->params->mgd_mode_mcast_fixed_nss;
-			txcmd->stbc_enabled =
+			tbl->stbc_enabled =
 				dev->params->mgd_mode_mcast_fixed_stbc_enabled;
-			txcmd->rate_preamble_type[index] =
+			tbl->rate_preamble_type[index] =
 				dev->params->mgd_mode_mcast_fixed_preamble;
 			if (is_mcs)
-				update_mcs_packet_stat(mgd_mcast_rate & 0x7F,
-						       txcmd->rate_flags[index],
-						       dev);
-		} else if (ieee80211_is_data(hdr->frame_control) &&
+				add_rate_mcs_stat(tbl,
+						  mgd_mcast_rate & 0x7F,
+						  tbl->rate_flags[index]);
+		} else if ((frm_type & RATE_FRM_DATA) &&
 			   mcs_indx != -1) {
 			/* proc: Fixed MCS for unicast
 			 */
 			is_mgd = true;
 
-			txcmd->rate[index] = 0x80;
-			txcmd->rate[index] |= (mcs_indx);
-			txcmd->rate_flags[index] =
+			tbl->rate[index] = 0x80;
+			tbl->rate[index] |= (mcs_indx);
+			tbl->rate_flags[index] =
 				dev->params->prod_mode_rate_flag;
-			if (txcmd->rate_flags[index] & ENABLE_11N_FORMAT)
+			if (tbl->rate_flags[index] & ENABLE_11N_FORMAT)
 				nss = (mcs_indx)/8 + 1;
 			else
 				nss = dev->params->num_spatial_streams;
-			txcmd->bcc_or_ldpc =
+			tbl->bcc_or_ldpc =
 				dev->params->prod_mode_bcc_or_ldpc;
-			txcmd->stbc_enabled =
+			tbl->stbc_enabled =
 				dev->params->prod_mode_stbc_enabled;
 
-			update_mcs_packet_stat(mcs_indx,
-					       txcmd->rate_flags[index],
-					       dev);
-		} else if (ieee80211_is_data(hdr->frame_control) &&
+			add_rate_mcs_stat(tbl,
+					  mcs_indx,
+					  tbl->rate_flags[index]);
+		} else if ((frm_type & RATE_FRM_DATA) &&
 			   mgd_rate != -1) {
 			/* proc: Fixed Legacy Rate for unicast
 			 */
 			is_mgd = true;
-			txcmd->rate[index] = 0x80;
-			txcmd->rate[index] = 0x00;
+			tbl->rate[index] = 0x80;
+			tbl->rate[index] = 0x00;
 
 			if (mgd_rate == 55)
-				txcmd->rate[index] |= ((mgd_rate) / 5);
+				tbl->rate[index] |= ((mgd_rate) / 5);
 			else
-				txcmd->rate[index] |= ((mgd_rate * 10) / 5);
+				tbl->rate[index] |= ((mgd_rate * 10) / 5);
 
-			txcmd->rate_flags[index] = 0;
+			tbl->rate_flags[index] = 0;
 			nss = 1;
-			txcmd->bcc_or_ldpc         = 0;
-			txcmd->stbc_enabled        = 0;
-			txcmd->rate_preamble_type[index] =
+			tbl->bcc_or_ldpc         = 0;
+			tbl->stbc_enabled        = 0;
+			tbl->rate_preamble_type[index] =
 				dev->params->prod_mode_rate_preamble_type;
 		} else if (is_mcs) {
-			txcmd->rate[index] = MARK_RATE_AS_MCS_INDEX;
-			txcmd->rate[index] |= mcs_rate_num;
-			update_mcs_packet_stat(mcs_rate_num,
-					      txcmd->rate_flags[index],
-					      dev);
+			tbl->rate[index] = MARK_RATE_AS_MCS_INDEX;
+			tbl->rate[index] |= mcs_rate_num;
+			add_rate_mcs_stat(tbl,
+					  mcs_rate_num,
+					  tbl->rate_flags[index]);
 		} else if (!is_mcs) {
 			rate = &dev->hw->wiphy->bands[
 				c->band]->bitrates[
 				c->control.rates[index].idx];
-			txcmd->rate[index] = MARK_RATE_AS_RATE;
-			txcmd->rate[index] |= rate->hw_value;
+			tbl->rate[index] = MARK_RATE_AS_RATE;
+			tbl->rate[index] |= rate->hw_value;
 			nss = 1;
 		}
 
-		txcmd->num_spatial_streams[index] = nss;
-		if (txcmd->rate_flags[index] & ENABLE_VHT_FORMAT)
+		tbl->num_spatial_streams[index] = nss;
+		if (tbl->rate_flags[index] & ENABLE_VHT_FORMAT)
 			/*Enabled for all ucast/bcast/mcast frames*/
-			txcmd->aggregate_mpdu = AMPDU_AGGR_ENABLED;
+			tbl->aggregate_mpdu = AMPDU_AGGR_ENABLED;
 
 		if (is_mgd) {
 			if (dev->params->rate_protection_type)
-				txcmd->rate_protection_type[index] =
+				tbl->rate_protection_type[index] =
 					USE_PROTECTION_RTS;
 			else
-				txcmd->rate_protection_type[index] =
+				tbl->rate_protection_type[index] =
 					USE_PROTECTION_NONE;
-			txcmd->rate_retries[index] = 1;
+			tbl->rate_retries[index] = 1;
 			all_rates_invalid = false;
 			break;
 		}
@@ -400,17 +505,17 @@ static void get_rate(struct sk_buff *skb,
 		/* STBC Enabled/Disabled: valid if n_antennas > Nss */
 		if (dev->params->uccp_num_spatial_streams > nss &&
 		    (c->flags & IEEE80211_TX_CTL_STBC))
-			txcmd->stbc_enabled = 1;
+			tbl->stbc_enabled = 1;
 
-		txcmd->rate_retries[index] =
+		tbl->rate_retries[index] =
 			c->control.rates[index].count;
 
 		if (c->control.rates[index].flags &
 		    IEEE80211_TX_RC_USE_SHORT_PREAMBLE)
-			txcmd->rate_preamble_type[index] =
+			tbl->rate_preamble_type[index] =
 				USE_SHORT_PREAMBLE;
 		else
-			txcmd->rate_preamble_type[index] =
+			tbl->rate_preamble_type[index] =
 				DONT_USE_SHORT_PREAMBLE;
 
 		prot_type = USE_PROTECTION_NONE;
@@ -425,49 +530,28 @@ static void get_rate(struct sk_buff *skb,
 			else
 				prot_type = USE_PROTECTION_NONE;
 
-			/*RTS threshold: Check for PSDU length
-			 * Need to add all HW added lenghts to skb,
-			 * sw added lengths are already part of skb->len
-			 * IV ==> Always SW
-			 * MIC for CCMP ==> HW (MMIC for TKIP ==> SW)
-			 * ICV ==> HW
-			 * FCS ==> HW
-			*/
-			if (ieee80211_is_data(hdr->frame_control) &&
-			    !is_multicast_ether_addr(hdr->addr1) &&
-			    ieee80211_has_protected(hdr->frame_control)) {
-				if (skb->len +
-				    c->control.hw_key->icv_len +
-				    dev->rts_threshold < FCS_LEN)
-					prot_type = USE_PROTECTION_RTS;
-			}
-
-			if (ieee80211_is_data(hdr->frame_control) &&
-			    !is_multicast_ether_addr(hdr->addr1) &&
-			    !ieee80211_has_protected(hdr->frame_control) &&
-			    (skb->len + FCS_LEN > dev->rts_threshold))
-				prot_type = USE_PROTECTION_RTS;
-
+			/* RTS threshold is checked per frame */
+			tbl->len_prot_map |= BIT(index);
 		}
 
-		txcmd->rate_protection_type[index] = prot_type;
+		tbl->rate_protection_type[index] = prot_type;
 
 
 		if (c->control.rates[index].flags &
 				IEEE80211_TX_RC_GREEN_FIELD)
-			txcmd->rate_flags[index] |=
+			tbl->rate_flags[index] |=
 					ENABLE_GREEN_FIELD;
 		if (c->control.rates[index].flags &
 				IEEE80211_TX_RC_40_MHZ_WIDTH)
-			txcmd->rate_flags[index] |=
+			tbl->rate_flags[index] |=
 					ENABLE_CHNL_WIDTH_40MHZ;
 		if (c->control.rates[index].flags &
 				IEEE80211_TX_RC_80_MHZ_WIDTH)
-			txcmd->rate_flags[index] |=
+			tbl->rate_flags[index] |=
 				ENABLE_CHNL_WIDTH_80MHZ;
 		if (c->control.rates[index].flags &
 				IEEE80211_TX_RC_SHORT_GI)
-			txcmd->rate_flags[index] |= ENABLE_SGI;
+			tbl->rate_flags[index] |= ENABLE_SGI;
 
 		/*Some Sanity Checks*/
 		if (nss <= max(MAX_TX_STREAMS, MAX_RX_STREAMS))
@@ -482,35 +566,21 @@ static void get_rate(struct sk_buff *skb,
 
 		/* VHT 20MHz MCS9 is not valid*/
 		if (txrate->flags & IEEE80211_TX_RC_VHT_MCS &&
-			((txcmd->rate[index] & 0x7F) == 9) &&
-			!(txcmd->rate_flags[index] &
+			((tbl->rate[index] & 0x7F) == 9) &&
+			!(tbl->rate_flags[index] &
 			  ENABLE_CHNL_WIDTH_40MHZ) &&
-			!(txcmd->rate_flags[index] &
+			!(tbl->rate_flags[index] &
 			  ENABLE_CHNL_WIDTH_80MHZ))
 			skip_rate = true;
 
 		/*First Time*/
-#ifdef notyet
-		if (!retry) {
-#endif
-			if (!index)
-				pkt_info->max_retries = 0;
-			pkt_info->max_retries +=
-				txcmd->rate_retries[index];
-#ifdef notyet
-			pkt_info->retries[index] =
-				txcmd->rate_retries[index];
-			UCCP_DEBUG_IF("%s-UMACTX : Using MINSTREL rates\n",
-				  dev->name);
-		} else {
-			txcmd->rate_retries[index] =
-				pkt_info->retries[index];
-			UCCP_DEBUG_IF("%s-UMACTX : Using Adjusted rates\n",
-				  dev->name);
-		}
-#endif
+		if (!index)
+			tbl->max_retries = 0;
+		tbl->max_retries += tbl->rate_retries[index];
+		tbl->upd_max_retries = true;
+
 		if (skip_rate)
-			txcmd->rate_retries[index] = 0;
+			tbl->rate_retries[index] = 0;
 
 	}
 
@@ -518,27 +588,634 @@ static void get_rate(struct sk_buff *skb,
 		/*use min supported rate*/
 		if (net_ratelimit())
 			UCCP_DEBUG_IF("UCCP420_WIFI:invalid rates\n");
+		tbl->num_rates = 1;
+		tbl->rate[0] = min_rate;
+		tbl->rate_retries[0] = 4;
+		tbl->rate_protection_type[0] = USE_PROTECTION_NONE;
+		tbl->rate_preamble_type[0] = DONT_USE_SHORT_PREAMBLE;
+		tbl->num_spatial_streams[0] = 1;
+		tbl->bcc_or_ldpc = 0;
+		tbl->stbc_enabled = 0;
+		tbl->rate_flags[0] = 0;
+		tbl->len_prot_map &= ~BIT(0);
+	}
+}
+
+
+static void apply_rate_tbl(struct umac_rate_tbl *tbl,
+			   struct sk_buff *skb,
+			   struct ieee80211_tx_info *c,
+			   unsigned int frm_type,
+			   struct cmd_tx_ctrl *txcmd,
+			   struct tx_pkt_info *pkt_info,
+			   struct mac80211_dev *dev)
+{
+	unsigned int index;
+
+	txcmd->num_rates = tbl->num_rates;
+	memcpy(txcmd->rate_protection_type, tbl->rate_protection_type,
+	       sizeof(txcmd->rate_protection_type));
+	memcpy(txcmd->rate_preamble_type, tbl->rate_preamble_type,
+	       sizeof(txcmd->rate_preamble_type));
+	memcpy(txcmd->rate_retries, tbl->rate_retries,
+	       sizeof(txcmd->rate_retries));
+	memcpy(txcmd->rate, tbl->rate, sizeof(txcmd->rate));
+	memcpy(txcmd->rate_flags, tbl->rate_flags, sizeof(txcmd->rate_flags));
+	memcpy(txcmd->num_spatial_streams, tbl->num_spatial_streams,
+	       sizeof(txcmd->num_spatial_streams));
+	txcmd->stbc_enabled = tbl->stbc_enabled;
+	txcmd->bcc_or_ldpc = tbl->bcc_or_ldpc;
+
+	if (tbl->aggregate_mpdu == AMPDU_AGGR_ENABLED)
+		txcmd->aggregate_mpdu = AMPDU_AGGR_ENABLED;
+
+	for (index = 0; tbl->len_prot_map && index < 4; index++) {
+		if (!(tbl->len_prot_map & BIT(index)))
+			continue;
+
+		txcmd->rate_protection_type[index] =
+			get_rate_len_prot(skb,
+					  c,
+					  frm_type,
+					  tbl->rate_protection_type[index],
+					  dev);
+	}
+
+	for (index = 0; index < tbl->num_mcs_stats; index++)
+		update_mcs_packet_stat(tbl->mcs_stat_rate[index],
+				       tbl->mcs_stat_flags[index],
+				       dev);
+
+	if (tbl->upd_max_retries)
+		pkt_info->max_retries = tbl->max_retries;
+}
+
+
+static bool rate_cache_match(struct umac_rate_cache *cache,
+			     struct ieee80211_tx_info *c,
+			     unsigned int frm_type,
+			     unsigned int gen)
+{
+	return cache->valid &&
+	       cache->gen == gen &&
+	       cache->frm_type == frm_type &&
+	       cache->band == c->band &&
+	       cache->ctl_flags == (c->flags & RATE_CTL_FLAGS) &&
+	       !memcmp(cache->rates, c->control.rates, sizeof(cache->rates));
+}
+
+
+/* Called with tx.lock held, the compiled rates of a peer are reused as long
+ * as mac80211 RC hands out the same rates and the params do not change.
+ */
+static void get_rate(struct sk_buff *skb,
+		     struct cmd_tx_ctrl *txcmd,
+		     struct tx_pkt_info *pkt_info,
+		     bool retry,
+		     struct mac80211_dev *dev)
+{
+	struct ieee80211_tx_info *c = IEEE80211_SKB_CB(skb);
+	struct umac_rate_cache *cache = NULL;
+	struct umac_rate_tbl tbl;
+	unsigned int gen;
+	unsigned int index;
+	unsigned int frm_type;
+#ifdef PERF_PROFILING
+	ktime_t start = ktime_get();
+#endif
+
+	/* production test*/
+	if (dev->params->production_test == 1) {
+		index = 0;
+		if (dev->params->tx_fixed_mcs_indx != -1) {
+			txcmd->rate[index] = 0x80;
+			txcmd->rate[index] |=
+			    (dev->params->tx_fixed_mcs_indx);
+			txcmd->num_spatial_streams[index] =
+			    dev->params->num_spatial_streams;
+			txcmd->bcc_or_ldpc =
+			    dev->params->prod_mode_bcc_or_ldpc;
+			txcmd->stbc_enabled =
+			    dev->params->prod_mode_stbc_enabled;
+			update_mcs_packet_stat(
+			    dev->params->tx_fixed_mcs_indx,
+			    txcmd->rate_flags[index], dev);
+		} else if (dev->params->production_test == 1 &&
+			   dev->params->tx_fixed_rate != -1) {
+			txcmd->rate[index] = 0x00;
+			if (dev->params->tx_fixed_rate == 55)
+				txcmd->rate[index] |=
+				 ((dev->params->tx_fixed_rate) /
+				  5);
+			else
+				txcmd->rate[index] |=
+				  ((dev->params->tx_fixed_rate *
+				    10) / 5);
+			txcmd->num_spatial_streams[index] = 1;
+			txcmd->bcc_or_ldpc = 0;
+			txcmd->stbc_enabled = 0;
+		}
 		txcmd->num_rates = 1;
-		txcmd->rate[0] = min_rate;
-		txcmd->rate_retries[0] = 4;
-		txcmd->rate_protection_type[0] = USE_PROTECTION_NONE;
-		txcmd->rate_preamble_type[0] = DONT_USE_SHORT_PREAMBLE;
-		txcmd->num_spatial_streams[0] = 1;
-		txcmd->bcc_or_ldpc = 0;
-		txcmd->stbc_enabled = 0;
-		txcmd->rate_flags[0] = 0;
+		txcmd->rate_retries[index] = 1;
+		txcmd->rate_flags[index] =
+			dev->params->prod_mode_rate_flag;
+		txcmd->rate_preamble_type[index] =
+			dev->params->prod_mode_rate_preamble_type;
+		return;
 	}
+
+	/* Normal Mode*/
+	frm_type = get_rate_frm_type(skb);
+
+	if (dev->params->rate_cache &&
+	    pkt_info->peer_id >= 0 &&
+	    pkt_info->peer_id < MAX_PEND_Q_PER_AC)
+		cache = &dev->tx.rate_cache[pkt_info->peer_id];
+
+	/* Taken before compiling, a flush meanwhile leaves the entry stale */
+	gen = READ_ONCE(dev->tx.rate_cache_gen);
+
+	if (cache && rate_cache_match(cache, c, frm_type, gen)) {
+		apply_rate_tbl(&cache->tbl, skb, c, frm_type,
+			       txcmd, pkt_info, dev);
+		dev->stats->rate_cache_hits++;
+#ifdef PERF_PROFILING
+		dev->stats->rate_cache_hit_ns +=
+			ktime_to_ns(ktime_sub(ktime_get(), start));
+#endif
+		return;
+	}
+
+	compile_rate_tbl(c, frm_type, &tbl, dev);
+
+	if (cache) {
+		cache->gen = gen;
+		cache->frm_type = frm_type;
+		cache->band = c->band;
+		cache->ctl_flags = c->flags & RATE_CTL_FLAGS;
+		memcpy(cache->rates, c->control.rates, sizeof(cache->rates));
+		cache->tbl = tbl;
+		cache->valid = true;
+	}
+
+	apply_rate_tbl(&tbl, skb, c, frm_type, txcmd, pkt_info, dev);
+	dev->stats->rate_cache_misses++;
+#ifdef PERF_PROFILING
+	dev->stats->rate_cache_miss_ns +=
+		ktime_to_ns(ktime_sub(ktime_get(), start));
+#endif
 }
 
 
-static int uccp420wlan_send_cmd(unsigned char *buf,
-				unsigned int len,
-				unsigned char id)
+void uccp420wlan_rate_cache_flush(struct mac80211_dev *dev)
+{
+	/* get_rate tags an entry with the generation it read before
+	 * compiling it, so a table compiled with the old params is not kept.
+	 */
+	WRITE_ONCE(dev->tx.rate_cache_gen, dev->tx.rate_cache_gen + 1);
+}
+
+
+static int cmd_pool_init(void)
+{
+	int class, i;
+
+	spin_lock_init(&cmd_pool.lock);
+
+	for (class = 0; class < CMD_POOL_CLASSES; class++) {
+		for (i = 0; i < cmd_pool_depth[class]; i++) {
+			cmd_pool.skb[class][i] = alloc_skb(cmd_pool_len[class],
+							   GFP_KERNEL);
+
+			if (!cmd_pool.skb[class][i])
+				return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+
+static void cmd_pool_deinit(void)
+{
+	int class, i;
+
+	/* Buffers still held by the HAL go when it frees them */
+	for (class = 0; class < CMD_POOL_CLASSES; class++) {
+		for (i = 0; i < CMD_POOL_MAX_DEPTH; i++) {
+			if (cmd_pool.skb[class][i])
+				kfree_skb(cmd_pool.skb[class][i]);
+
+			cmd_pool.skb[class][i] = NULL;
+		}
+	}
+}
+
+
+/* Returns a zeroed buffer of len bytes for a control command. Falls back to
+ * allocating with gfp when the pool of that size is exhausted.
+ */
+static struct sk_buff *cmd_buf_alloc(struct mac80211_dev *dev,
+				     unsigned int len,
+				     gfp_t gfp)
+{
+	struct sk_buff *nbuf = NULL;
+	int class, i;
+
+	for (class = 0; class < CMD_POOL_CLASSES; class++) {
+		if (len <= cmd_pool_len[class])
+			break;
+	}
+
+	if (class < CMD_POOL_CLASSES) {
+		spin_lock_bh(&cmd_pool.lock);
+
+		for (i = 0; i < cmd_pool_depth[class]; i++) {
+			if (!cmd_pool.skb[class][i] ||
+			    skb_shared(cmd_pool.skb[class][i]))
+				continue;
+
+			nbuf = skb_get(cmd_pool.skb[class][i]);
+			skb_trim(nbuf, 0);
+			break;
+		}
+
+		spin_unlock_bh(&cmd_pool.lock);
+	}
+
+	if (nbuf) {
+		dev->stats->cmd_pool_used[class]++;
+	} else {
+		nbuf = alloc_skb(len, gfp);
+
+		if (!nbuf)
+			return NULL;
+
+		dev->stats->cmd_pool_miss++;
+	}
+
+	memset(skb_put(nbuf, len), 0, len);
+
+	return nbuf;
+}
+
+
+/* Hands a control command to the HAL and tracks it until its PROC_DONE.
+ * Called with control_path_lock held.
+ */
+static void ctrl_cmd_xmit(struct mac80211_dev *dev,
+			  struct sk_buff *nbuf)
+{
+	struct ctrl_cmd_info *info = (struct ctrl_cmd_info *)nbuf->cb;
+	struct ctrl_cmd_info *slot;
+	s64 wait_us;
+
+	/* Numbered in the order they reach the FW, queued commands can be
+	 * overtaken by key commands.
+	 */
+	info->seq = cmd_info.cmd_seq++;
+	slot = &cmd_info.in_flight[info->seq % MAX_CTRL_CMD_WINDOW];
+	*slot = *info;
+	slot->send_ts = ktime_get();
+
+	wait_us = ktime_us_delta(slot->send_ts, slot->queue_ts);
+
+	if (wait_us > 0) {
+		dev->stats->cmd_queue_wait_us += wait_us;
+
+		if (wait_us > dev->stats->cmd_queue_wait_max_us)
+			dev->stats->cmd_queue_wait_max_us = wait_us;
+	}
+
+	cmd_info.cmd_in_flight++;
+
+	if (cmd_info.cmd_in_flight > dev->stats->cmd_in_flight_max)
+		dev->stats->cmd_in_flight_max = cmd_info.cmd_in_flight;
+
+	hal_ops.send((void *)nbuf, HOST_MOD_ID, UMAC_MOD_ID, 0);
+	dev->stats->gen_cmd_send_count++;
+}
+
+
+/* Key commands can go ahead of the queued commands nothing else depends on,
+ * statistics and settings the FW applies on their own, so a rekey does not
+ * wait behind them. They never pass any other command or each other.
+ */
+static bool ctrl_cmd_is_key(unsigned int id)
+{
+	switch (id) {
+	case UMAC_CMD_SETKEY:
+	case UMAC_CMD_SET_DEFAULTKEY:
+	case UMAC_CMD_REKEY_DATA:
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+static bool ctrl_cmd_is_deferrable(unsigned int id)
+{
+	switch (id) {
+	case UMAC_CMD_TX_POWER:
+	case UMAC_CMD_MCST_ADDR_CFG:
+	case UMAC_CMD_MCST_FLTR_CTRL:
+	case UMAC_CMD_VHT_BEAMFORM_CTRL:
+	case UMAC_CMD_TXQ_PARAMS:
+	case UMAC_CMD_MIB_STATS:
+	case UMAC_CMD_PHY_STATS:
+	case UMAC_CMD_BT_INFO:
+	case UMAC_CMD_CLEAR_STATS:
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+/* Called with control_path_lock held */
+static void ctrl_cmd_queue_key(struct mac80211_dev *dev,
+			       struct sk_buff *nbuf)
+{
+	struct sk_buff_head *q = &cmd_info.outstanding_cmd;
+	struct ctrl_cmd_info *info;
+	struct sk_buff *skb;
+	unsigned long flags;
+	unsigned int passed = 0;
+
+	spin_lock_irqsave(&q->lock, flags);
+
+	skb_queue_reverse_walk(q, skb) {
+		info = (struct ctrl_cmd_info *)skb->cb;
+
+		if (!ctrl_cmd_is_deferrable(info->id))
+			break;
+
+		passed++;
+	}
+
+	/* skb is the queue head itself if every queued command was passed */
+	__skb_queue_after(q, skb, nbuf);
+
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	dev->stats->key_cmd_passed += passed;
+}
+
+
+/* RESET_COMPLETE/PROC_DONE: retire the oldest command in flight and refill
+ * the window from the queued ones.
+ */
+static void ctrl_cmd_done(struct mac80211_dev *dev,
+			  const char *name)
+{
+	struct ctrl_cmd_info *slot;
+	struct sk_buff *pending_cmd;
+	s64 rtt_us;
+
+	spin_lock_bh(&cmd_info.control_path_lock);
+
+	if (cmd_info.cmd_in_flight == 0) {
+		pr_err("%s-UMACIF: Unexpected: Spurious proc_done received. Ignoring and continuing\n",
+		       name);
+		goto out;
+	}
+
+	slot = &cmd_info.in_flight[cmd_info.cmd_done_seq % MAX_CTRL_CMD_WINDOW];
+	cmd_info.cmd_done_seq++;
+	cmd_info.cmd_in_flight--;
+	cmd_info.outstanding_ctrl_req--;
+
+	rtt_us = ktime_us_delta(ktime_get(), slot->send_ts);
+
+	if (rtt_us < 0)
+		rtt_us = 0;
+
+	if (slot->id < UMAC_CMD_NUM) {
+		dev->stats->cmd_rtt_cnt[slot->id]++;
+		dev->stats->cmd_rtt_us[slot->id] += rtt_us;
+
+		if (rtt_us > dev->stats->cmd_rtt_max_us[slot->id])
+			dev->stats->cmd_rtt_max_us[slot->id] = rtt_us;
+	}
+
+	if (ctrl_cmd_is_key(slot->id))
+		key_ack_hist_update(dev, slot->queue_ts);
+
+	UCCP_DEBUG_IF("Done cmd: %d seq: %d rtt: %lld us, in flight: %d\n",
+		     slot->id, slot->seq, rtt_us, cmd_info.cmd_in_flight);
+
+	while (cmd_info.cmd_in_flight < dev->params->cmd_window) {
+		pending_cmd = skb_dequeue(&cmd_info.outstanding_cmd);
+
+		if (!pending_cmd)
+			break;
+
+		UCCP_DEBUG_IF("Send 1 outstanding cmd\n");
+		ctrl_cmd_xmit(dev, pending_cmd);
+	}
+
+out:
+	spin_unlock_bh(&cmd_info.control_path_lock);
+}
+
+
+/* Called with control_path_lock held, consumes nbuf */
+static int __uccp420wlan_send_cmd_buf(struct mac80211_dev *dev,
+				      struct sk_buff *nbuf,
+				      unsigned char id)
+{
+	struct host_mac_msg_hdr *hdr = (struct host_mac_msg_hdr *)nbuf->data;
+	struct ctrl_cmd_info *info;
+
+	hdr->id = id;
+	hdr->length = nbuf->len;
+	UCCP_DEBUG_IF("%s-UMACIF: Sending command:%d, outstanding_cmds: %d\n",
+		     dev->name, hdr->id, cmd_info.outstanding_ctrl_req);
+	hdr->descriptor_id = 0;
+	hdr->descriptor_id |= 0x0000ffff;
+
+	dev->stats->outstanding_cmd_cnt = cmd_info.outstanding_ctrl_req;
+
+	info = (struct ctrl_cmd_info *)nbuf->cb;
+	info->id = id;
+	info->queue_ts = ktime_get();
+
+	/* Queued commands go first to keep the FW order */
+	if ((cmd_info.cmd_in_flight < dev->params->cmd_window) &&
+	    skb_queue_empty(&cmd_info.outstanding_cmd)) {
+		UCCP_DEBUG_IF("Sending the CMD, got Access\n");
+		ctrl_cmd_xmit(dev, nbuf);
+	} else {
+		UCCP_DEBUG_IF("Sending the CMD, Waiting in Queue: %d\n",
+			     cmd_info.outstanding_ctrl_req);
+
+		if (dev->params->key_cmd_prio && ctrl_cmd_is_key(id))
+			ctrl_cmd_queue_key(dev, nbuf);
+		else
+			skb_queue_tail(&cmd_info.outstanding_cmd, nbuf);
+
+		dev->stats->cmd_queued_cnt++;
+	}
+
+	/* sent but still no proc_done / unsent due to pending requests */
+	cmd_info.outstanding_ctrl_req++;
+
+	return 0;
+}
+
+
+/* Called with control_path_lock held */
+static int __uccp420wlan_send_cmd(struct mac80211_dev *dev,
+				  unsigned char *buf,
+				  unsigned int len,
+				  unsigned char id)
 {
-	struct host_mac_msg_hdr *hdr = (struct host_mac_msg_hdr *)buf;
 	struct sk_buff *nbuf;
+
+	nbuf = cmd_buf_alloc(dev, len, GFP_ATOMIC);
+
+	if (!nbuf) {
+		WARN_ON(1);
+		return -ENOMEM;
+	}
+
+	memcpy(nbuf->data, buf, len);
+
+	return __uccp420wlan_send_cmd_buf(dev, nbuf, id);
+}
+
+
+/* Between uccp420wlan_vif_cfg_begin and _end the UMAC_CMD_VIF_CFG changes of
+ * a VIF are merged here and go to the FW as one command. Any other command
+ * flushes them first, so the FW sees the changes in the same order.
+ */
+static struct cmd_vif_cfg vif_cfg_batch[MAX_VIFS];
+static unsigned long vif_cfg_batching;
+
+
+static bool vif_cfg_merge(struct cmd_vif_cfg *batch,
+			  struct cmd_vif_cfg *vif_cfg)
+{
+	unsigned int changed = vif_cfg->changed_bitmap;
+
+	if (!batch->changed_bitmap) {
+		memcpy(batch, vif_cfg, sizeof(struct cmd_vif_cfg));
+		return true;
+	}
+
+	/* The DTIM period is passed in beacon_interval */
+	if (((changed & BCN_INT_CHANGED) &&
+	     (batch->changed_bitmap & DTIM_PERIOD_CHANGED)) ||
+	    ((changed & DTIM_PERIOD_CHANGED) &&
+	     (batch->changed_bitmap & BCN_INT_CHANGED)))
+		return false;
+
+	if (changed & BASICRATES_CHANGED)
+		batch->basic_rate_set = vif_cfg->basic_rate_set;
+
+	if (changed & SHORTSLOT_CHANGED)
+		batch->use_short_slot = vif_cfg->use_short_slot;
+
+	if (changed & ATIMWINDOW_CHANGED)
+		batch->atim_window = vif_cfg->atim_window;
+
+	if (changed & AID_CHANGED)
+		batch->aid = vif_cfg->aid;
+
+	if (changed & CAPABILITY_CHANGED)
+		batch->capability = vif_cfg->capability;
+
+	if (changed & SHORTRETRY_CHANGED)
+		batch->short_retry = vif_cfg->short_retry;
+
+	if (changed & LONGRETRY_CHANGED)
+		batch->long_retry = vif_cfg->long_retry;
+
+	if (changed & BSSID_CHANGED)
+		ether_addr_copy(batch->bssid, vif_cfg->bssid);
+
+	if (changed & RCV_BCN_MODE_CHANGED)
+		batch->bcn_mode = vif_cfg->bcn_mode;
+
+	if (changed & (BCN_INT_CHANGED | DTIM_PERIOD_CHANGED))
+		batch->beacon_interval = vif_cfg->beacon_interval;
+
+	if (changed & SMPS_CHANGED)
+		batch->smps_info = vif_cfg->smps_info;
+
+	if (changed & CONNECT_STATE_CHANGED)
+		batch->connect_state = vif_cfg->connect_state;
+
+	if (changed & OP_CHAN_CHANGED)
+		batch->op_channel = vif_cfg->op_channel;
+
+	batch->changed_bitmap |= changed;
+
+	return true;
+}
+
+
+/* Called with control_path_lock held */
+static int vif_cfg_flush(struct mac80211_dev *dev,
+			 int index)
+{
+	struct cmd_vif_cfg *batch = &vif_cfg_batch[index];
+	int ret = 0;
+
+	if (!batch->changed_bitmap)
+		return 0;
+
+	ret = __uccp420wlan_send_cmd(dev,
+				     (unsigned char *)batch,
+				     sizeof(struct cmd_vif_cfg),
+				     UMAC_CMD_VIF_CFG);
+
+	/* The values were recorded when merged, the FW never got them */
+	if (ret) {
+		if (batch->changed_bitmap & SHORTRETRY_CHANGED)
+			fw_shadow.vif[index].short_retry = FW_SHADOW_UNKNOWN;
+
+		if (batch->changed_bitmap & LONGRETRY_CHANGED)
+			fw_shadow.vif[index].long_retry = FW_SHADOW_UNKNOWN;
+	}
+
+	batch->changed_bitmap = 0;
+	dev->stats->vif_cfg_flushes++;
+
+	return ret;
+}
+
+
+static int vif_cfg_flush_all(struct mac80211_dev *dev)
+{
+	int index, ret = 0;
+
+	for (index = 0; index < MAX_VIFS; index++) {
+		ret = vif_cfg_flush(dev, index);
+
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+
+/* With shadow set, the command is dropped if the FW already has val, else
+ * val is recorded once the command is sent (or merged into a VIF_CFG batch,
+ * vif_cfg_flush forgets it if that fails).
+ */
+static int uccp420wlan_send_cmd_shadow(unsigned char *buf,
+				       unsigned int len,
+				       unsigned char id,
+				       int *shadow,
+				       int val)
+{
+	struct cmd_vif_cfg *vif_cfg = (struct cmd_vif_cfg *)buf;
 	struct lmac_if_data *p;
 	struct mac80211_dev *dev;
+	int ret = 0;
 
 	rcu_read_lock();
 
@@ -553,48 +1230,109 @@ static int uccp420wlan_send_cmd(unsigned char *buf,
 		return -1;
 	}
 	dev = p->context;
-	nbuf = alloc_skb(len, GFP_ATOMIC);
 
-	if (!nbuf) {
-		rcu_read_unlock();
-		WARN_ON(1);
-		return -ENOMEM;
+	/* Take lock to make the control commands sequential in case of SMP*/
+	spin_lock_bh(&cmd_info.control_path_lock);
+
+	if (shadow && dev->params->cmd_shadow && (*shadow == val)) {
+		dev->stats->cmd_suppressed[id]++;
+		goto unlock;
 	}
-	hdr->id = id;
-	hdr->length = len;
-	UCCP_DEBUG_IF("%s-UMACIF: Sending command:%d, outstanding_cmds: %d\n",
-		     p->name, hdr->id, cmd_info.outstanding_ctrl_req);
-	hdr->descriptor_id = 0;
-	hdr->descriptor_id |= 0x0000ffff;
-	memcpy(skb_put(nbuf, len), buf, len);
 
-	dev->stats->outstanding_cmd_cnt = cmd_info.outstanding_ctrl_req;
+	if ((id == UMAC_CMD_VIF_CFG) &&
+	    (vif_cfg->if_index < MAX_VIFS) &&
+	    test_bit(vif_cfg->if_index, &vif_cfg_batching)) {
+		if (!vif_cfg_merge(&vif_cfg_batch[vif_cfg->if_index],
+				   vif_cfg)) {
+			ret = vif_cfg_flush(dev, vif_cfg->if_index);
+			vif_cfg_merge(&vif_cfg_batch[vif_cfg->if_index],
+				      vif_cfg);
+		}
+
+		dev->stats->vif_cfg_batched++;
+		goto out;
+	}
+
+	ret = vif_cfg_flush_all(dev);
+
+	if (!ret)
+		ret = __uccp420wlan_send_cmd(dev, buf, len, id);
+out:
+	if (shadow)
+		*shadow = ret ? FW_SHADOW_UNKNOWN : val;
+unlock:
+	spin_unlock_bh(&cmd_info.control_path_lock);
+	rcu_read_unlock();
+
+	return ret;
+}
+
+
+static int uccp420wlan_send_cmd(unsigned char *buf,
+				unsigned int len,
+				unsigned char id)
+{
+	return uccp420wlan_send_cmd_shadow(buf, len, id, NULL, 0);
+}
+
+
+/* Sends a command built in place with cmd_buf_alloc, consumes nbuf */
+static int uccp420wlan_send_cmd_buf(struct mac80211_dev *dev,
+				    struct sk_buff *nbuf,
+				    unsigned char id)
+{
+	int ret = 0;
 
-	/* Take lock to make the control commands sequential in case of SMP*/
 	spin_lock_bh(&cmd_info.control_path_lock);
 
-	if (cmd_info.outstanding_ctrl_req < MAX_OUTSTANDING_CTRL_REQ) {
-		UCCP_DEBUG_IF("Sending the CMD, got Access\n");
-		hal_ops.send((void *)nbuf, HOST_MOD_ID, UMAC_MOD_ID, 0);
-		dev->stats->gen_cmd_send_count++;
-	} else {
-		UCCP_DEBUG_IF("Sending the CMD, Waiting in Queue: %d\n",
-			     cmd_info.outstanding_ctrl_req);
-		skb_queue_tail(&cmd_info.outstanding_cmd, nbuf);
-	}
+	ret = vif_cfg_flush_all(dev);
+
+	if (!ret)
+		ret = __uccp420wlan_send_cmd_buf(dev, nbuf, id);
+	else
+		dev_kfree_skb_any(nbuf);
+
+	spin_unlock_bh(&cmd_info.control_path_lock);
+
+	return ret;
+}
+
+
+void uccp420wlan_vif_cfg_begin(int index)
+{
+	spin_lock_bh(&cmd_info.control_path_lock);
+	set_bit(index, &vif_cfg_batching);
+	spin_unlock_bh(&cmd_info.control_path_lock);
+}
+
+
+int uccp420wlan_vif_cfg_end(int index)
+{
+	struct lmac_if_data *p;
+	int ret = 0;
+
+	rcu_read_lock();
+	p = (struct lmac_if_data *)(rcu_dereference(lmac_if));
+
+	spin_lock_bh(&cmd_info.control_path_lock);
+	clear_bit(index, &vif_cfg_batching);
+
+	if (p)
+		ret = vif_cfg_flush(p->context, index);
+	else
+		vif_cfg_batch[index].changed_bitmap = 0;
 
-	/* sent but still no proc_done / unsent due to pending requests */
-	cmd_info.outstanding_ctrl_req++;
 	spin_unlock_bh(&cmd_info.control_path_lock);
 	rcu_read_unlock();
 
-	return 0;
+	return ret;
 }
 
 
 int uccp420wlan_prog_reset(unsigned int reset_type, unsigned int lmac_mode)
 {
-	struct cmd_reset reset;
+	struct cmd_reset *reset;
+	struct sk_buff *nbuf;
 	struct mac80211_dev *dev;
 	struct lmac_if_data *p;
 	unsigned int i;
@@ -610,61 +1348,71 @@ int uccp420wlan_prog_reset(unsigned int reset_type, unsigned int lmac_mode)
 	rcu_read_unlock();
 	dev = p->context;
 
-	memset(&reset, 0, sizeof(struct cmd_reset));
+	nbuf = cmd_buf_alloc(dev, sizeof(struct cmd_reset), GFP_KERNEL);
+
+	if (!nbuf)
+		return -ENOMEM;
+
+	reset = (struct cmd_reset *)nbuf->data;
 
-	reset.type = reset_type;
+	reset->type = reset_type;
 
 	if (reset_type == LMAC_ENABLE) {
 		UCCP_DEBUG_IF("ed = %d auto = %d\n",
 			dev->params->ed_sensitivity,
 			dev->params->auto_sensitivity);
-		reset.ed_sensitivity = dev->params->ed_sensitivity;
-		reset.auto_sensitivity = dev->params->auto_sensitivity;
-		reset.include_rxmac_hdr = 0;
-		reset.num_spatial_streams =
+		reset->ed_sensitivity = dev->params->ed_sensitivity;
+		reset->auto_sensitivity = dev->params->auto_sensitivity;
+		reset->include_rxmac_hdr = 0;
+		reset->num_spatial_streams =
 			dev->params->uccp_num_spatial_streams;
-		reset.lmac_mode = lmac_mode;
-		reset.antenna_sel = dev->params->antenna_sel;
+		reset->lmac_mode = lmac_mode;
+		reset->antenna_sel = dev->params->antenna_sel;
 
 		if (dev->params->production_test == 0 &&
 			dev->params->bypass_vpd == 0) {
-			memcpy(reset.rf_params, dev->params->rf_params_vpd,
+			memcpy(reset->rf_params, dev->params->rf_params_vpd,
 			       RF_PARAMS_SIZE);
 		} else {
-			memcpy(reset.rf_params, dev->params->rf_params,
+			memcpy(reset->rf_params, dev->params->rf_params,
 			       RF_PARAMS_SIZE);
 		}
 
-		reset.system_rev = dev->stats->system_rev;
-		reset.bg_scan.enabled = dev->params->bg_scan_enable;
+		reset->system_rev = dev->stats->system_rev;
+		reset->bg_scan.enabled = dev->params->bg_scan_enable;
 
-		if (reset.bg_scan.enabled) {
+		if (reset->bg_scan.enabled) {
 			for (i = 0; i < dev->params->bg_scan_num_channels;
 			     i++) {
-				reset.bg_scan.channel_list[i] =
+				reset->bg_scan.channel_list[i] =
 					dev->params->bg_scan_channel_list[i];
-				reset.bg_scan.channel_flags[i] =
+				reset->bg_scan.channel_flags[i] =
 					dev->params->bg_scan_channel_flags[i];
 			}
-			reset.bg_scan.num_channels =
+			reset->bg_scan.num_channels =
 				dev->params->bg_scan_num_channels;
-			reset.bg_scan.scan_intval =
+			reset->bg_scan.scan_intval =
 				dev->params->bg_scan_intval;
-			reset.bg_scan.channel_dur =
+			reset->bg_scan.channel_dur =
 				/* Channel spending time */
 				dev->params->bg_scan_chan_dur;
 
-			reset.bg_scan.serv_channel_dur =
+			reset->bg_scan.serv_channel_dur =
 				/* operating channel spending time */
 				dev->params->bg_scan_serv_chan_dur;
 		}
 	}
 
-	return uccp420wlan_send_cmd((unsigned char *) &reset,
-				    sizeof(struct cmd_reset), UMAC_CMD_RESET);
+	/* The FW comes back with its defaults */
+	spin_lock_bh(&cmd_info.control_path_lock);
+	fw_shadow_reset();
+	spin_unlock_bh(&cmd_info.control_path_lock);
+
+	return uccp420wlan_send_cmd_buf(dev, nbuf, UMAC_CMD_RESET);
 }
 
-int uccp420wlan_proc_tx(void)
+int uccp420wlan_proc_tx(unsigned int descriptor_id,
+			unsigned int queue)
 {
 	struct cmd_tx_ctrl tx_cmd;
 	struct sk_buff *nbuf, *nbuf_start, *tmp, *skb;
@@ -673,8 +1421,8 @@ int uccp420wlan_proc_tx(void)
 	struct mac80211_dev *dev;
 	struct sk_buff_head *skb_list;
 	struct ieee80211_hdr *mac_hdr;
-	unsigned int index = 0, descriptor_id = 0, queue = WLAN_AC_BE, pkt = 0;
-	u16 hdrlen = 26;
+	unsigned int index = 0, pkt = 0;
+	u16 hdrlen = PKT_GEN_HDR_LEN;
 
 	rcu_read_lock();
 	p = (struct lmac_if_data *)(rcu_dereference(lmac_if));
@@ -705,6 +1453,10 @@ int uccp420wlan_proc_tx(void)
 	tx_cmd.aggregate_mpdu = AMPDU_AGGR_DISABLED;
 	tx_cmd.rate_retries[index] = 1;
 
+	if ((tx_cmd.num_frames_per_desc > 1) &&
+	    (dev->params->tx_fixed_mcs_indx != -1))
+		tx_cmd.aggregate_mpdu = AMPDU_AGGR_ENABLED;
+
 	if (dev->params->tx_fixed_mcs_indx != -1) {
 		tx_cmd.rate_preamble_type[index] =
 			dev->params->prod_mode_rate_preamble_type;
@@ -752,6 +1504,11 @@ int uccp420wlan_proc_tx(void)
 			 tx_cmd.num_frames_per_desc *
 			 MAX_GRAM_PAYLOAD_LEN, GFP_ATOMIC);
 
+	if (!nbuf) {
+		rcu_read_unlock();
+		return -ENOMEM;
+	}
+
 	data = skb_put(nbuf, sizeof(struct cmd_tx_ctrl));
 	memset(data, 0, sizeof(struct cmd_tx_ctrl));
 	/*store the start for later use*/
@@ -803,9 +1560,11 @@ int uccp420wlan_prog_txpower(unsigned int txpower)
 	power.tx_pwr = txpower;
 	power.if_index = 0;
 
-	return uccp420wlan_send_cmd((unsigned char *) &power,
-				    sizeof(struct cmd_tx_pwr),
-				    UMAC_CMD_TX_POWER);
+	return uccp420wlan_send_cmd_shadow((unsigned char *) &power,
+					   sizeof(struct cmd_tx_pwr),
+					   UMAC_CMD_TX_POWER,
+					   &fw_shadow.txpower,
+					   txpower);
 }
 
 
@@ -835,25 +1594,128 @@ int uccp420wlan_prog_vif_ctrl(int index,
 	vif_ctrl.if_index = index;
 	vif_ctrl.if_ctrl = op;
 
+	if (index < MAX_VIFS) {
+		spin_lock_bh(&cmd_info.control_path_lock);
+		fw_shadow_vif_reset(index);
+		spin_unlock_bh(&cmd_info.control_path_lock);
+	}
+
 	return uccp420wlan_send_cmd((unsigned char *) &vif_ctrl,
 				    sizeof(struct cmd_vifctrl),
 				    UMAC_CMD_VIF_CTRL);
 }
 
 
-int uccp420wlan_prog_mcast_addr_cfg(unsigned char *mcast_addr,
-				    unsigned int op)
+static int mcast_addr_find(unsigned char (*list)[ETH_ALEN],
+			   int cnt,
+			   const unsigned char *addr)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		if (ether_addr_equal(list[i], addr))
+			return i;
+	}
+
+	return -1;
+}
+
+
+static int mcast_addr_cfg_send(struct mac80211_dev *dev,
+			       const unsigned char *mcast_addr,
+			       unsigned int op)
 {
 	struct cmd_mcst_addr_cfg mcast_config;
 
 	memset(&mcast_config, 0, sizeof(struct cmd_mcst_addr_cfg));
 
 	mcast_config.op = op;
-	memcpy(mcast_config.mac_addr, mcast_addr, 6);
+	memcpy(mcast_config.mac_addr, mcast_addr, ETH_ALEN);
+
+	return __uccp420wlan_send_cmd(dev,
+				      (unsigned char *) &mcast_config,
+				      sizeof(struct cmd_mcst_addr_cfg),
+				      UMAC_CMD_MCST_ADDR_CFG);
+}
+
+
+/* Brings the FW multicast list in line with addr. The FW takes one address
+ * per command, so only the addresses that left or joined the list since the
+ * last call are sent, back to back under one hold of the control path lock.
+ * Removals go first so the FW list never grows beyond MCST_ADDR_LIMIT.
+ */
+int uccp420wlan_prog_mcast_list(unsigned char (*addr)[ETH_ALEN],
+				int count)
+{
+	struct lmac_if_data *p;
+	struct mac80211_dev *dev;
+	unsigned char *last;
+	int i, ret = 0;
+
+	if (count > MCST_ADDR_LIMIT)
+		return -EINVAL;
+
+	rcu_read_lock();
+
+	p = (struct lmac_if_data *)(rcu_dereference(lmac_if));
+
+	if (!p) {
+		pr_err("%s: Unable to retrieve lmac_if\n", __func__);
+		rcu_read_unlock();
+		return -1;
+	}
+
+	dev = p->context;
+
+	spin_lock_bh(&cmd_info.control_path_lock);
+
+	ret = vif_cfg_flush_all(dev);
+
+	/* Without the shadow the whole list is programmed again */
+	i = 0;
+
+	while (!ret && (i < fw_shadow.mcast_addr_cnt)) {
+		if (dev->params->cmd_shadow &&
+		    (mcast_addr_find(addr, count,
+				     fw_shadow.mcast_addr[i]) >= 0)) {
+			i++;
+			continue;
+		}
+
+		ret = mcast_addr_cfg_send(dev,
+					  fw_shadow.mcast_addr[i],
+					  WLAN_MCAST_ADDR_REM);
+		if (ret)
+			break;
+
+		/* Move the last entry into the hole */
+		last = fw_shadow.mcast_addr[--fw_shadow.mcast_addr_cnt];
+		memcpy(fw_shadow.mcast_addr[i], last, ETH_ALEN);
+		dev->stats->mcast_addr_del++;
+	}
+
+	for (i = 0; !ret && (i < count); i++) {
+		if (mcast_addr_find(fw_shadow.mcast_addr,
+				    fw_shadow.mcast_addr_cnt,
+				    addr[i]) >= 0) {
+			dev->stats->mcast_addr_kept++;
+			continue;
+		}
+
+		ret = mcast_addr_cfg_send(dev, addr[i], WLAN_MCAST_ADDR_ADD);
+		if (ret)
+			break;
 
-	return uccp420wlan_send_cmd((unsigned char *) &mcast_config,
-				    sizeof(struct cmd_mcst_addr_cfg),
-				    UMAC_CMD_MCST_ADDR_CFG);
+		memcpy(fw_shadow.mcast_addr[fw_shadow.mcast_addr_cnt++],
+		       addr[i],
+		       ETH_ALEN);
+		dev->stats->mcast_addr_add++;
+	}
+
+	spin_unlock_bh(&cmd_info.control_path_lock);
+	rcu_read_unlock();
+
+	return ret;
 }
 
 
@@ -864,9 +1726,11 @@ int uccp420wlan_prog_mcast_filter_control(unsigned int mcast_filter_enable)
 	memset(&mcast_ctrl, 0, sizeof(struct cmd_mcst_filter_ctrl));
 	mcast_ctrl.ctrl = mcast_filter_enable;
 
-	return uccp420wlan_send_cmd((unsigned char *) &mcast_ctrl,
-				    sizeof(struct cmd_mcst_filter_ctrl),
-				    UMAC_CMD_MCST_FLTR_CTRL);
+	return uccp420wlan_send_cmd_shadow((unsigned char *) &mcast_ctrl,
+					   sizeof(struct cmd_mcst_filter_ctrl),
+					   UMAC_CMD_MCST_FLTR_CTRL,
+					   &fw_shadow.mcast_filter,
+					   mcast_filter_enable);
 }
 
 
@@ -892,6 +1756,15 @@ int uccp420wlan_prog_roc(unsigned int roc_ctrl,
 			 unsigned int roc_type)
 {
 	struct cmd_roc cmd_roc;
+	int index;
+
+	/* The FW moves off the operating channels for the ROC */
+	spin_lock_bh(&cmd_info.control_path_lock);
+
+	for (index = 0; index < MAX_VIFS; index++)
+		fw_shadow.vif[index].chan_valid = false;
+
+	spin_unlock_bh(&cmd_info.control_path_lock);
 
 	memset(&cmd_roc, 0, sizeof(struct cmd_roc));
 
@@ -908,7 +1781,10 @@ int uccp420wlan_prog_roc(unsigned int roc_ctrl,
 int uccp420wlan_prog_nw_selection(unsigned int nw_select_enabled,
 				  unsigned char *mac_addr)
 {
-	struct cmd_nw_selection nw_select;
+	struct cmd_nw_selection *nw_select;
+	struct sk_buff *nbuf;
+	struct mac80211_dev *dev;
+	struct lmac_if_data *p;
 	unsigned char req_ie[] = {0xdd, 0x7d, 0x00, 0x50, 0xf2, 0x04, 0x10,
 				  0x4a, 0x00, 0x01, 0x10, 0x10, 0x3a, 0x00,
 				  0x01, 0x01, 0x10, 0x08, 0x00, 0x02, 0x23,
@@ -955,22 +1831,37 @@ int uccp420wlan_prog_nw_selection(unsigned int nw_select_enabled,
 				  0x50, 0xf2, 0x04, 0x00, 0x01, 0x00, 0x10,
 				  0x11, 0x00, 0x02, 0x4d, 0x4d};
 
-	memset(&nw_select, 0, sizeof(struct cmd_nw_selection));
-	nw_select.p2p_selection = nw_select_enabled;
-	memcpy(nw_select.ssid.ssid, wildcard_ssid, 7);
-	nw_select.ssid.len = 7;
-	nw_select.scan_req_ie_len = sizeof(req_ie);
-	nw_select.scan_resp_ie_len = sizeof(resp_ie);
+	rcu_read_lock();
+	p = (struct lmac_if_data *)(rcu_dereference(lmac_if));
+
+	if (!p) {
+		WARN_ON(1);
+		rcu_read_unlock();
+		return -1;
+	}
+
+	rcu_read_unlock();
+	dev = p->context;
+
+	nbuf = cmd_buf_alloc(dev, sizeof(struct cmd_nw_selection), GFP_KERNEL);
+
+	if (!nbuf)
+		return -ENOMEM;
+
+	nw_select = (struct cmd_nw_selection *)nbuf->data;
+	nw_select->p2p_selection = nw_select_enabled;
+	memcpy(nw_select->ssid.ssid, wildcard_ssid, 7);
+	nw_select->ssid.len = 7;
+	nw_select->scan_req_ie_len = sizeof(req_ie);
+	nw_select->scan_resp_ie_len = sizeof(resp_ie);
 
 	pr_err("req_len = %d, resp_len = %d\n",
-	       nw_select.scan_req_ie_len, nw_select.scan_resp_ie_len);
+	       nw_select->scan_req_ie_len, nw_select->scan_resp_ie_len);
 
-	memcpy(nw_select.scan_req_ie, req_ie, nw_select.scan_req_ie_len);
-	memcpy(nw_select.scan_resp_ie, resp_ie, nw_select.scan_resp_ie_len);
+	memcpy(nw_select->scan_req_ie, req_ie, nw_select->scan_req_ie_len);
+	memcpy(nw_select->scan_resp_ie, resp_ie, nw_select->scan_resp_ie_len);
 
-	return uccp420wlan_send_cmd((unsigned char *) &nw_select,
-				    sizeof(struct cmd_nw_selection),
-				    UMAC_CMD_NW_SELECTION);
+	return uccp420wlan_send_cmd_buf(dev, nbuf, UMAC_CMD_NW_SELECTION);
 
 }
 
@@ -1121,6 +2012,7 @@ int uccp420wlan_scan(int index,
 		     struct scan_req *req)
 {
 	struct cmd_scan *scan;
+	struct sk_buff *nbuf;
 	unsigned char i;
 	struct mac80211_dev *dev;
 	struct lmac_if_data *p;
@@ -1137,15 +2029,15 @@ int uccp420wlan_scan(int index,
 	rcu_read_unlock();
 	dev = p->context;
 
-	scan = kmalloc(sizeof(struct cmd_scan) +
-		       req->ie_len, GFP_KERNEL);
+	nbuf = cmd_buf_alloc(dev, sizeof(struct cmd_scan) + req->ie_len,
+			     GFP_KERNEL);
 
-	if (scan == NULL) {
+	if (!nbuf) {
 		UCCP_DEBUG_IF("%s: Failed to allocate memory\n", __func__);
 		return -ENOMEM;
 	}
 
-	memset(scan, 0, sizeof(struct cmd_scan));
+	scan = (struct cmd_scan *)nbuf->data;
 
 	scan->if_index = index;
 
@@ -1214,9 +2106,7 @@ int uccp420wlan_scan(int index,
 
 	dev->stats->umac_scan_req++;
 
-	uccp420wlan_send_cmd((unsigned char *)scan, sizeof(struct cmd_scan) +
-			     req->ie_len, UMAC_CMD_SCAN);
-	kfree(scan);
+	uccp420wlan_send_cmd_buf(dev, nbuf, UMAC_CMD_SCAN);
 
 	return 0;
 }
@@ -1249,26 +2139,26 @@ int uccp420wlan_scan_abort(int index)
 }
 
 
-int uccp420wlan_prog_channel(unsigned int prim_ch,
-			     unsigned int center_freq1,
-			     unsigned int center_freq2,
-			     unsigned int ch_width,
-#ifdef MULTI_CHAN_SUPPORT
-			     unsigned int vif_index,
-#endif
-			     unsigned int freq_band)
+/* Builds the UMAC_CMD_CHANNEL for a channel once, so that a channel context
+ * can send it again without converting the chandef each time.
+ */
+int uccp420wlan_build_channel(struct umac_chan_cmd *cmd,
+			      unsigned int prim_ch,
+			      unsigned int center_freq1,
+			      unsigned int center_freq2,
+			      unsigned int ch_width,
+			      unsigned int freq_band)
 {
-	struct cmd_channel channel;
+	struct cmd_channel *channel = &cmd->channel;
 	struct lmac_if_data *p;
 	struct mac80211_dev *dev;
 	int is_vht_bw80_sec_40minus;
 	int is_vht_bw80_sec_40plus;
 	int is_vht_bw80;
 	int ch_no1, ch_no2;
-	int err = 0;
 	unsigned int cf_offset = center_freq1;
 
-	memset(&channel, 0, sizeof(struct cmd_channel));
+	memset(cmd, 0, sizeof(struct umac_chan_cmd));
 
 	rcu_read_lock();
 	p = (struct lmac_if_data *)(rcu_dereference(lmac_if));
@@ -1323,59 +2213,179 @@ int uccp420wlan_prog_channel(unsigned int prim_ch,
 
 
 	}
+	rcu_read_unlock();
+
 	ch_no1 = ieee80211_frequency_to_channel(cf_offset);
 	ch_no2 = 0;
 
-	channel.primary_ch_number = prim_ch;
-	channel.channel_number1 = ch_no1;
-	channel.channel_number2 = ch_no2;
+	channel->primary_ch_number = prim_ch;
+	channel->channel_number1 = ch_no1;
+	channel->channel_number2 = ch_no2;
 
 	switch (ch_width) {
 	case 0:
 	case 1:
-		channel.channel_bw = 0;
+		channel->channel_bw = 0;
 		break;
 	case 2:
-		channel.channel_bw = 1;
+		channel->channel_bw = 1;
 		break;
 	case 3:
-		channel.channel_bw = 2;
+		channel->channel_bw = 2;
 		break;
 	case 4:
 	case 5:
-		channel.channel_bw = 3;
+		channel->channel_bw = 3;
 		break;
 	default:
 		break;
 	}
 
-	channel.freq_band = freq_band;
+	channel->freq_band = freq_band;
+
+	cmd->center_freq1 = cf_offset;
+	cmd->ch_width = ch_width;
+
+	return 0;
+}
+
+
+static struct fw_shadow_vif *chan_shadow(unsigned int vif_index)
+{
+#ifdef MULTI_CHAN_SUPPORT
+	if (vif_index < MAX_VIFS)
+		return &fw_shadow.vif[vif_index];
+
+	return NULL;
+#else
+	return &fw_shadow.vif[0];
+#endif
+}
+
+
+/* The channel sent for the VIF was never acked, it may not be the one the
+ * FW is on.
+ */
+void uccp420wlan_channel_forget(unsigned int vif_index)
+{
+	struct fw_shadow_vif *shadow = chan_shadow(vif_index);
+
+	if (!shadow)
+		return;
+
+	spin_lock_bh(&cmd_info.control_path_lock);
+	shadow->chan_valid = false;
+	spin_unlock_bh(&cmd_info.control_path_lock);
+}
+
+
+/* True if cmd is the last channel sent for the VIF, the FW completes the
+ * commands in order so it is or will be on it without another one.
+ */
+bool uccp420wlan_channel_active(struct mac80211_dev *dev,
+				const struct umac_chan_cmd *cmd,
+				unsigned int vif_index)
+{
+	struct fw_shadow_vif *shadow = chan_shadow(vif_index);
+	struct cmd_channel channel = cmd->channel;
+
 #ifdef MULTI_CHAN_SUPPORT
 	channel.vif_index = vif_index;
 #endif
-	dev->cur_chan.center_freq1 = cf_offset;
-	dev->cur_chan.center_freq2 = ch_no2;
-	dev->cur_chan.pri_chnl_num = prim_ch;
-	dev->cur_chan.ch_width  = ch_width;
-	dev->cur_chan.freq_band = freq_band;
-	dev->chan_prog_done = 0;
 
-	rcu_read_unlock();
+	return shadow && dev->params->cmd_shadow && shadow->chan_valid &&
+		!memcmp(&shadow->channel, &channel, sizeof(struct cmd_channel));
+}
+
+
+/* Returns 1 if the FW is already on the channel and no CH_PROG_DONE will
+ * follow, else the result of sending (and with wait set, acking) it.
+ */
+int uccp420wlan_prog_channel_cmd(struct mac80211_dev *dev,
+				 const struct umac_chan_cmd *cmd,
+				 unsigned int vif_index,
+				 bool wait)
+{
+	struct fw_shadow_vif *shadow = chan_shadow(vif_index);
+	struct cmd_channel channel = cmd->channel;
+	int err = 0;
+
+#ifdef MULTI_CHAN_SUPPORT
+	channel.vif_index = vif_index;
+#endif
+	dev->cur_chan.center_freq1 = cmd->center_freq1;
+	dev->cur_chan.center_freq2 = channel.channel_number2;
+	dev->cur_chan.pri_chnl_num = channel.primary_ch_number;
+	dev->cur_chan.ch_width  = cmd->ch_width;
+	dev->cur_chan.freq_band = channel.freq_band;
+
+	if (uccp420wlan_channel_active(dev, cmd, vif_index)) {
+		dev->stats->cmd_suppressed[UMAC_CMD_CHANNEL]++;
+		return 1;
+	}
 
-	dev->chan_prog_done = 0;
+	reinit_completion(&dev->chan_prog_done);
 
 	err = uccp420wlan_send_cmd((unsigned char *) &channel,
 				   sizeof(struct cmd_channel),
 				   UMAC_CMD_CHANNEL);
 
 
-	if (err)
-		return err;
+	if (!err && wait && wait_for_channel_prog_complete(dev))
+		err = -1;
+
+	if (shadow) {
+		spin_lock_bh(&cmd_info.control_path_lock);
+		shadow->chan_valid = !err;
+		memcpy(&shadow->channel, &channel, sizeof(struct cmd_channel));
+		spin_unlock_bh(&cmd_info.control_path_lock);
+	}
+
+	if (!err)
+		dev->stats->chan_prog_sent++;
+
+	return err;
+}
+
+
+int uccp420wlan_prog_channel(unsigned int prim_ch,
+			     unsigned int center_freq1,
+			     unsigned int center_freq2,
+			     unsigned int ch_width,
+#ifdef MULTI_CHAN_SUPPORT
+			     unsigned int vif_index,
+#endif
+			     unsigned int freq_band)
+{
+	struct umac_chan_cmd cmd;
+	struct lmac_if_data *p;
+	struct mac80211_dev *dev;
+	int err;
+
+	if (uccp420wlan_build_channel(&cmd, prim_ch, center_freq1,
+				      center_freq2, ch_width, freq_band))
+		return -1;
+
+	rcu_read_lock();
+	p = (struct lmac_if_data *)(rcu_dereference(lmac_if));
 
-	if (wait_for_channel_prog_complete(dev))
+	if (!p) {
+		rcu_read_unlock();
 		return -1;
+	}
 
-	return 0;
+	dev = p->context;
+	rcu_read_unlock();
+
+	err = uccp420wlan_prog_channel_cmd(dev, &cmd,
+#ifdef MULTI_CHAN_SUPPORT
+					   vif_index,
+#else
+					   0,
+#endif
+					   true);
+
+	return err < 0 ? err : 0;
 }
 
 
@@ -1446,11 +2456,59 @@ int uccp420wlan_prog_ps_state(int index,
 	ps_cfg.mode = powersave_state;
 	ps_cfg.if_index = index;
 
-	return uccp420wlan_send_cmd((unsigned char *)&ps_cfg,
-				    sizeof(struct cmd_ps), UMAC_CMD_PS);
+	return uccp420wlan_send_cmd_shadow((unsigned char *)&ps_cfg,
+					   sizeof(struct cmd_ps),
+					   UMAC_CMD_PS,
+					   (index < MAX_VIFS) ?
+					   &fw_shadow.vif[index].ps_state :
+					   NULL,
+					   powersave_state);
+}
+
+
+/* Puts the frames back on the descriptor under tx->lock. Returns false when
+ * a discard or deinit cancelled the descriptor while they were off it, they
+ * must not be sent then.
+ */
+static bool prog_tx_relock(struct mac80211_dev *dev,
+			   struct tx_pkt_info *pkt_info,
+			   struct sk_buff_head *frames,
+			   ktime_t *lock_start)
+{
+	bool cancelled;
+
+	spin_lock_bh(&dev->tx.lock);
+	*lock_start = ktime_get();
+
+	skb_queue_splice_init(frames, &pkt_info->pkt);
+	cancelled = (pkt_info->build == TX_DESC_CANCELLED);
+	pkt_info->build = TX_DESC_IDLE;
+
+	return !cancelled;
+}
+
+
+static void prog_tx_unlock(struct mac80211_dev *dev,
+			   ktime_t lock_start)
+{
+	s64 held_ns = ktime_to_ns(ktime_sub(ktime_get(), lock_start));
+
+	dev->stats->tx_lock_hold_cnt++;
+	dev->stats->tx_lock_hold_ns += held_ns;
+
+	if (held_ns > dev->stats->tx_lock_hold_max_ns)
+		dev->stats->tx_lock_hold_max_ns = held_ns;
+
+	spin_unlock_bh(&dev->tx.lock);
 }
 
 
+/* Programs UMAC_CMD_TX for a claimed descriptor in two phases. Under tx->lock
+ * only the descriptor state shared with the rest of the TX path is set up
+ * (rates, sequence numbers, channel map). The command is then built and the
+ * frames mapped with the lock released; the token keeps the descriptor ours
+ * and the frames are off pkt_info->pkt until they are sent.
+ */
 int uccp420wlan_prog_tx(unsigned int queue,
 			unsigned int more_frms,
 #ifdef MULTI_CHAN_SUPPORT
@@ -1467,11 +2525,16 @@ int uccp420wlan_prog_tx(unsigned int queue,
 	struct umac_vif *uvif;
 	struct sk_buff *skb, *skb_first, *tmp;
 	struct sk_buff_head *txq = NULL;
+	struct sk_buff_head frames, *build_q;
 	struct ieee80211_hdr *mac_hdr;
 	struct ieee80211_tx_info *tx_info_first;
+	struct umac_tx_meta *meta;
 	unsigned int hdrlen, pkt = 0;
+	unsigned int num_frames;
 	int vif_index;
-	__u16 fc;
+	int ret = 0;
+	bool locked;
+	ktime_t lock_start;
 #ifdef MULTI_CHAN_SUPPORT
 	struct tx_config *tx;
 #endif
@@ -1490,6 +2553,8 @@ int uccp420wlan_prog_tx(unsigned int queue,
 
 	dev = p->context;
 	spin_lock_bh(&dev->tx.lock);
+	lock_start = ktime_get();
+	locked = true;
 #ifdef MULTI_CHAN_SUPPORT
 	tx = &dev->tx;
 	txq = &dev->tx.pkt_info[curr_chanctx_idx][descriptor_id].pkt;
@@ -1501,68 +2566,26 @@ int uccp420wlan_prog_tx(unsigned int queue,
 	skb_first = skb_peek(txq);
 
 	if (!skb_first) {
-		spin_unlock_bh(&dev->tx.lock);
+		prog_tx_unlock(dev, lock_start);
 		rcu_read_unlock();
 		return -10;
 	}
 
 	tx_info_first = IEEE80211_SKB_CB(skb_first);
 
-	mac_hdr = (struct ieee80211_hdr *)skb_first->data;
-	fc = mac_hdr->frame_control;
-	hdrlen = ieee80211_hdrlen(fc);
-	vif_index = vif_addr_to_index(mac_hdr->addr2, dev);
-
-	/* GET The security Header Length only for data/qos-data/unicast PMF
-	 * for 11W case.
+	/* Header length, VIF and encryption were worked out when the frame
+	 * was queued, see tx_meta_fill
 	 */
-	if ((ieee80211_is_data(fc) ||
-	     ieee80211_is_data_qos(fc))
-	    && ieee80211_has_protected(fc)) {
-		/* hw_key == NULL: Encrypted in SW (injected frames)
-		 * iv_len = 0: treat as SW encryption.
-		 */
-		if (tx_info_first->control.hw_key == NULL ||
-		    !tx_info_first->control.hw_key->iv_len) {
-			UCCP_DEBUG_IF("%s: hw_key is %s and iv_len: 0\n",
-			  __func__,
-			  tx_info_first->control.hw_key?"valid":"NULL");
-			tx_cmd.encrypt = ENCRYPT_DISABLE;
-		 } else {
-			UCCP_DEBUG_IF("%s: cipher: %d, icv: %d",
-				  __func__,
-				  tx_info_first->control.hw_key->cipher,
-				  tx_info_first->control.hw_key->icv_len);
-			UCCP_DEBUG_IF("iv: %d, key: %d\n",
-				  tx_info_first->control.hw_key->iv_len,
-				  tx_info_first->control.hw_key->keylen);
-			/* iv_len is always the header and icv_len is always
-			 * the trailer include only iv_len
-			 */
-			hdrlen += tx_info_first->control.hw_key->iv_len;
-			tx_cmd.encrypt = ENCRYPT_ENABLE;
-		}
-	}
+	meta = umac_tx_meta(skb_first);
+	hdrlen = meta->hdr_len;
+	vif_index = meta->vif_index;
+	tx_cmd.encrypt = meta->encrypt;
 
 #ifdef MULTI_CHAN_SUPPORT
 	if (tx_info_first->flags & IEEE80211_TX_CTL_TX_OFFCHAN)
 		tx_cmd.tx_flags |= (1 << UMAC_TX_FLAG_OFFCHAN_FRM);
 #endif
 
-	/* For injected frames (wlantest) hw_key is not set,as PMF uses
-	 * CCMP always so hardcode this to CCMP IV LEN 8.
-	 * For Auth3: It is completely handled in SW (mac80211).
-	 */
-	if (ieee80211_is_unicast_robust_mgmt_frame(skb_first) &&
-	    ieee80211_has_protected(fc)) {
-		hdrlen += 8;
-		tx_cmd.encrypt = ENCRYPT_ENABLE;
-	}
-
-	/* separate in to up to TSF and From TSF*/
-	if (ieee80211_is_beacon(fc) || ieee80211_is_probe_resp(fc))
-		hdrlen += 8; /* Timestamp*/
-
 	/* HAL UMAC-LMAC HDR*/
 	tx_cmd.hdr.id = UMAC_CMD_TX;
 	/* Keep the queue num and pool id in descriptor id */
@@ -1572,35 +2595,24 @@ int uccp420wlan_prog_tx(unsigned int queue,
 	/* Not used anywhere currently */
 	tx_cmd.hdr.length = sizeof(struct cmd_tx_ctrl);
 
+	num_frames = skb_queue_len(txq);
+
 	/* UMAC_CMD_TX*/
 	tx_cmd.if_index = vif_index;
 	tx_cmd.queue_num = queue;
 	tx_cmd.more_frms = more_frms;
 	tx_cmd.descriptor_id = descriptor_id;
-	tx_cmd.num_frames_per_desc = skb_queue_len(txq);
+	tx_cmd.num_frames_per_desc = num_frames;
 	tx_cmd.pkt_gram_payload_len = hdrlen;
 	tx_cmd.aggregate_mpdu = AMPDU_AGGR_DISABLED;
 
-#ifdef MULTI_CHAN_SUPPORT
-	dev->tx.pkt_info[curr_chanctx_idx][descriptor_id].vif_index = vif_index;
-	dev->tx.pkt_info[curr_chanctx_idx][descriptor_id].queue = queue;
-#else
-	dev->tx.pkt_info[descriptor_id].vif_index = vif_index;
-	dev->tx.pkt_info[descriptor_id].queue = queue;
-#endif
+	pkt_info->vif_index = vif_index;
+	pkt_info->queue = queue;
+	/* Need it for tx_status later */
+	pkt_info->hdr_len = hdrlen;
 
 	uvif = (struct umac_vif *) (tx_info_first->control.vif->drv_priv);
 
-	nbuf = alloc_skb(sizeof(struct cmd_tx_ctrl) +
-			 tx_cmd.num_frames_per_desc *
-			 MAX_GRAM_PAYLOAD_LEN, GFP_ATOMIC);
-
-	if (!nbuf) {
-		spin_unlock_bh(&dev->tx.lock);
-		rcu_read_unlock();
-		return -20;
-	}
-
 	/* Get the rate for first packet as all packets have same rate */
 	get_rate(skb_first,
 		 &tx_cmd,
@@ -1608,18 +2620,11 @@ int uccp420wlan_prog_tx(unsigned int queue,
 		 retry,
 		 dev);
 
-	data = skb_put(nbuf, sizeof(struct cmd_tx_ctrl));
-	memset(data, 0, sizeof(struct cmd_tx_ctrl));
-	/*store the start for later use*/
-	nbuf_start = (struct sk_buff *)data;
-	memcpy(data, &tx_cmd,  sizeof(struct cmd_tx_ctrl));
-
 	UCCP_DEBUG_TX("%s-UMACTX: TX Frame, Queue = %d, descriptord_id = %d\n",
 		     dev->name,
 		     tx_cmd.queue_num, tx_cmd.descriptor_id);
-	UCCP_DEBUG_TX("		num_frames= %d qlen: %d len = %d\n",
-		     tx_cmd.num_frames_per_desc, skb_queue_len(txq),
-		     nbuf->len);
+	UCCP_DEBUG_TX("		num_frames= %d qlen: %d\n",
+		     tx_cmd.num_frames_per_desc, skb_queue_len(txq));
 
 	UCCP_DEBUG_TX("%s-UMACTX: Num rates = %d, %x, %x, %x, %x\n",
 		     dev->name,
@@ -1641,35 +2646,62 @@ int uccp420wlan_prog_tx(unsigned int queue,
 	tx->desc_chan_map[descriptor_id] = curr_chanctx_idx;
 #endif
 
-	skb_queue_walk_safe(txq, skb, tmp) {
-		if (!skb || (pkt > tx_cmd.num_frames_per_desc))
+	/* Only for Non-Qos and MGMT frames, for Qos-Data
+	 * mac80211 handles the sequence no generation
+	 */
+	if (!retry &&
+	    tx_info_first->flags &
+	    IEEE80211_TX_CTL_ASSIGN_SEQ) {
+		skb_queue_walk(txq, skb) {
+			mac_hdr = (struct ieee80211_hdr *)skb->data;
+
+			if (tx_info_first->flags &
+			    IEEE80211_TX_CTL_FIRST_FRAGMENT) {
+				uvif->seq_no += 0x10;
+			}
+
+			mac_hdr->seq_ctrl &= cpu_to_le16(IEEE80211_SCTL_FRAG);
+			mac_hdr->seq_ctrl |= cpu_to_le16(uvif->seq_no);
+		}
+	}
+
+	/* The frames are built from a private list, so the discard, flush
+	 * and deinit paths, which only look at pkt_info->pkt under tx->lock,
+	 * never see them half mapped. Those that would drop them mark the
+	 * descriptor cancelled instead, see prog_tx_relock.
+	 */
+	__skb_queue_head_init(&frames);
+	build_q = txq;
+
+	if (dev->params->prog_tx_two_phase) {
+		skb_queue_splice_init(txq, &frames);
+		build_q = &frames;
+		pkt_info->build = TX_DESC_BUILDING;
+		prog_tx_unlock(dev, lock_start);
+		locked = false;
+	}
+
+	nbuf = alloc_skb(sizeof(struct cmd_tx_ctrl) +
+			 num_frames *
+			 MAX_GRAM_PAYLOAD_LEN, GFP_ATOMIC);
+
+	if (!nbuf) {
+		ret = -20;
+		goto out;
+	}
+
+	data = skb_put(nbuf, sizeof(struct cmd_tx_ctrl));
+	memset(data, 0, sizeof(struct cmd_tx_ctrl));
+	/*store the start for later use*/
+	nbuf_start = (struct sk_buff *)data;
+	memcpy(data, &tx_cmd,  sizeof(struct cmd_tx_ctrl));
+
+	skb_queue_walk_safe(build_q, skb, tmp) {
+		if (!skb || (pkt >= num_frames))
 			break;
 
 		mac_hdr = (struct ieee80211_hdr *)skb->data;
 
-		/* Only for Non-Qos and MGMT frames, for Qos-Data
-		 * mac80211 handles the sequence no generation
-		 */
-		if (!retry &&
-		    tx_info_first->flags &
-		    IEEE80211_TX_CTL_ASSIGN_SEQ) {
-			if (tx_info_first->flags &
-			    IEEE80211_TX_CTL_FIRST_FRAGMENT) {
-				uvif->seq_no += 0x10;
-			}
-
-			mac_hdr->seq_ctrl &= cpu_to_le16(IEEE80211_SCTL_FRAG);
-			mac_hdr->seq_ctrl |= cpu_to_le16(uvif->seq_no);
-		}
-
-		/* Need it for tx_status later */
-#ifdef MULTI_CHAN_SUPPORT
-		dev->tx.pkt_info[curr_chanctx_idx][descriptor_id].hdr_len =
-			hdrlen;
-#else
-		dev->tx.pkt_info[descriptor_id].hdr_len = hdrlen;
-#endif
-
 		/* Complete packet length */
 		((struct cmd_tx_ctrl *)nbuf_start)->pkt_length[pkt] = skb->len;
 
@@ -1687,27 +2719,32 @@ int uccp420wlan_prog_tx(unsigned int queue,
 		skb_pull(skb, hdrlen);
 		if (hal_ops.map_tx_buf(descriptor_id, pkt,
 				       skb->data, skb->len)) {
-			spin_unlock_bh(&dev->tx.lock);
-			rcu_read_unlock();
 			dev_kfree_skb_any(nbuf);
-			return -30;
+			ret = -30;
+			goto out;
 		}
 
 		pkt++;
 	}
 
+	/* Back on the descriptor before TX_DONE can look for them. A
+	 * cancelled descriptor goes through the send failure path of the
+	 * caller, which reports the frames and frees the token.
+	 */
+	if (!locked) {
+		locked = true;
+
+		if (!prog_tx_relock(dev, pkt_info, &frames, &lock_start)) {
+			dev_kfree_skb_any(nbuf);
+			ret = -40;
+			goto out;
+		}
+	}
+
 #ifdef PERF_PROFILING
 	if (dev->params->driver_tput == 0) {
 #endif
-
-		/* SDK: Check if we can use the same txq initialized before in
-		 * the function here
-		 */
-#ifdef MULTI_CHAN_SUPPORT
-		txq = &dev->tx.pkt_info[curr_chanctx_idx][descriptor_id].pkt;
-#else
-		txq = &dev->tx.pkt_info[descriptor_id].pkt;
-#endif
+		pkt_info->send_ts = ktime_get();
 
 		spin_lock_bh(&cmd_info.control_path_lock);
 
@@ -1722,9 +2759,9 @@ int uccp420wlan_prog_tx(unsigned int queue,
 		 * tx_cmd send
 		 */
 		if (queue != WLAN_AC_BCN) {
-			if (skb_queue_len(txq) == 1)
+			if (num_frames == 1)
 				dev->stats->tx_cmd_send_count_single++;
-			else if (skb_queue_len(txq) > 1)
+			else if (num_frames > 1)
 				dev->stats->tx_cmd_send_count_multi++;
 		} else
 			dev->stats->tx_cmd_send_count_beaconq++;
@@ -1732,10 +2769,14 @@ int uccp420wlan_prog_tx(unsigned int queue,
 	}
 #endif
 
-	spin_unlock_bh(&dev->tx.lock);
+out:
+	if (!locked)
+		prog_tx_relock(dev, pkt_info, &frames, &lock_start);
+
+	prog_tx_unlock(dev, lock_start);
 	rcu_read_unlock();
 
-	return 0;
+	return ret;
 }
 
 
@@ -1787,9 +2828,13 @@ int uccp420wlan_prog_long_retry(int index,
 	vif_cfg.if_index = index;
 	ether_addr_copy(vif_cfg.vif_addr, vif_addr);
 
-	return uccp420wlan_send_cmd((unsigned char *)&vif_cfg,
-				    sizeof(struct cmd_vif_cfg),
-				    UMAC_CMD_VIF_CFG);
+	return uccp420wlan_send_cmd_shadow((unsigned char *)&vif_cfg,
+					   sizeof(struct cmd_vif_cfg),
+					   UMAC_CMD_VIF_CFG,
+					   (index < MAX_VIFS) ?
+					   &fw_shadow.vif[index].long_retry :
+					   NULL,
+					   long_retry);
 
 }
 
@@ -1807,9 +2852,13 @@ int uccp420wlan_prog_short_retry(int index,
 	vif_cfg.if_index = index;
 	ether_addr_copy(vif_cfg.vif_addr, vif_addr);
 
-	return uccp420wlan_send_cmd((unsigned char *)&vif_cfg,
-				    sizeof(struct cmd_vif_cfg),
-				    UMAC_CMD_VIF_CFG);
+	return uccp420wlan_send_cmd_shadow((unsigned char *)&vif_cfg,
+					   sizeof(struct cmd_vif_cfg),
+					   UMAC_CMD_VIF_CFG,
+					   (index < MAX_VIFS) ?
+					   &fw_shadow.vif[index].short_retry :
+					   NULL,
+					   short_retry);
 
 
 }
@@ -1929,6 +2978,56 @@ int uccp420wlan_prog_vif_beacon_int(int index,
 }
 
 
+int uccp420wlan_prog_vif_beacon(int index,
+				unsigned char *vif_addr,
+				unsigned int bcn_int,
+				unsigned int dtim_period,
+				unsigned int channel,
+				unsigned char *bcn_buf,
+				unsigned int len)
+{
+	struct cmd_set_beacon *set_bcn;
+	struct sk_buff *nbuf;
+	struct mac80211_dev *dev;
+	struct lmac_if_data *p;
+
+	rcu_read_lock();
+	p = (struct lmac_if_data *)(rcu_dereference(lmac_if));
+
+	if (!p) {
+		WARN_ON(1);
+		rcu_read_unlock();
+		return -1;
+	}
+
+	rcu_read_unlock();
+	dev = p->context;
+
+	/* A zero length template stops the firmware beaconing */
+	nbuf = cmd_buf_alloc(dev, sizeof(struct cmd_set_beacon) + len,
+			     GFP_ATOMIC);
+
+	if (!nbuf) {
+		UCCP_DEBUG_IF("%s: Failed to allocate memory\n", __func__);
+		return -ENOMEM;
+	}
+
+	set_bcn = (struct cmd_set_beacon *)nbuf->data;
+
+	set_bcn->if_index = index;
+	set_bcn->interval = bcn_int;
+	set_bcn->dtim_period = dtim_period;
+	set_bcn->len = len;
+	ether_addr_copy(set_bcn->mac_addr, vif_addr);
+	set_bcn->channel = channel;
+
+	if (len)
+		memcpy(set_bcn->beacon_buf, bcn_buf, len);
+
+	return uccp420wlan_send_cmd_buf(dev, nbuf, UMAC_CMD_SET_BEACON);
+}
+
+
 int uccp420wlan_prog_vif_dtim_period(int index,
 				     unsigned char *vif_addr,
 				     unsigned int dtim_period)
@@ -2223,245 +3322,393 @@ int uccp420wlan_prog_tx_deinit(int vif_index, char *peer_addr)
 				    UMAC_CMD_TX_DEINIT);
 }
 
-int uccp420wlan_msg_handler(void *nbuff,
-			    unsigned char sender_id)
+static void umac_event_reset_complete(struct mac80211_dev *dev,
+				      struct lmac_if_data *p,
+				      struct sk_buff *skb)
 {
-	unsigned int event;
-	unsigned char *buff;
-	struct host_mac_msg_hdr *hdr;
-	struct lmac_if_data *p;
-	struct sk_buff *skb = (struct sk_buff *)nbuff;
-	struct sk_buff *pending_cmd;
-	struct mac80211_dev *dev;
-#ifdef MULTI_CHAN_SUPPORT
-	int curr_chanctx_idx = -1;
+	struct host_event_reset_complete *r =
+			(struct host_event_reset_complete *)skb->data;
+
+	uccp420wlan_reset_complete(r->version, p->context);
+	ctrl_cmd_done(dev, p->name);
+}
+
+
+static void umac_event_scan_abort(struct mac80211_dev *dev,
+				  struct lmac_if_data *p,
+				  struct sk_buff *skb)
+{
+	complete(&dev->scan_abort_done);
+}
+
+
+#ifdef CONFIG_PM
+static void umac_event_econ_cfg_done(struct mac80211_dev *dev,
+				     struct lmac_if_data *p,
+				     struct sk_buff *skb)
+{
+	struct umac_event_ps_econ_cfg_complete *econ_cfg_complete_data =
+			(struct umac_event_ps_econ_cfg_complete *)skb->data;
+
+	dev->econ_ps_cfg_stats.result = econ_cfg_complete_data->status;
+	complete(&dev->econ_ps_cfg_stats.completed);
+	rx_interrupt_status = 0;
+}
+
+
+static void umac_event_econ_wake(struct mac80211_dev *dev,
+				 struct lmac_if_data *p,
+				 struct sk_buff *skb)
+{
+	struct umac_event_ps_econ_wake *econ_wake_data =
+			(struct umac_event_ps_econ_wake *)skb->data;
+
+	dev->econ_ps_cfg_stats.wake_trig = econ_wake_data->trigger;
+}
 #endif
 
-	rcu_read_lock();
 
-	p = (struct lmac_if_data *)(rcu_dereference(lmac_if));
+static void umac_event_scan_complete(struct mac80211_dev *dev,
+				     struct lmac_if_data *p,
+				     struct sk_buff *skb)
+{
+	uccp420wlan_scan_complete(p->context,
+		(struct host_event_scanres *)skb->data,
+		skb->data + sizeof(struct host_event_scanres), skb->len);
+}
 
-	if (!p) {
-		WARN_ON(1);
+
+static void umac_event_rx(struct mac80211_dev *dev,
+			  struct lmac_if_data *p,
+			  struct sk_buff *skb)
+{
+	if (dev->params->production_test) {
+		dev->stats->rx_packet_data_count++;
 		dev_kfree_skb_any(skb);
-		rcu_read_unlock();
-		return 0;
+	} else {
+		uccp420wlan_rx_frame(skb, p->context);
 	}
+}
 
-	buff = skb->data;
-	hdr = (struct host_mac_msg_hdr *)buff;
 
-	event = hdr->id & 0xffff;
+static void umac_event_tx_done(struct mac80211_dev *dev,
+			       struct lmac_if_data *p,
+			       struct sk_buff *skb)
+{
+	if (dev->params->production_test &&
+	    dev->params->start_prod_mode)
+		uccp420wlan_proc_tx_complete((void *)skb->data,
+					     p->context);
+	else {
+		/* Increment tx_done_recv_count to keep track of number
+		 * of tx_done received do not count tx dones from host.
+		 */
+		dev->stats->tx_done_recv_count++;
 
-	dev = (struct mac80211_dev *)p->context;
+		/* The lock would only guard this single read, the index
+		 * can change as soon as it is dropped anyway.
+		 */
+		uccp420wlan_tx_complete((void *)skb->data,
+#ifdef MULTI_CHAN_SUPPORT
+					READ_ONCE(dev->curr_chanctx_idx),
+#endif
+					p->context);
+	}
 
-	/* UCCP_DEBUG_IF("%s-UMACIF: event %d received\n", p->name, event); */
-	if (event == UMAC_EVENT_RESET_COMPLETE) {
-		struct host_event_reset_complete *r =
-				(struct host_event_reset_complete *)buff;
+	cmd_info.tx_done_recv_count++;
+}
 
-		uccp420wlan_reset_complete(r->version, p->context);
-		spin_lock_bh(&cmd_info.control_path_lock);
 
-		if (cmd_info.outstanding_ctrl_req == 0) {
-			pr_err("%s-UMACIF: Unexpected: Spurious proc_done received. Ignoring and continuing.\n",
-			       p->name);
-		} else {
-			cmd_info.outstanding_ctrl_req--;
+static void umac_event_disconnected(struct mac80211_dev *dev,
+				    struct lmac_if_data *p,
+				    struct sk_buff *skb)
+{
+	struct host_event_disconnect *dis =
+		(struct host_event_disconnect *)skb->data;
+	struct ieee80211_vif *vif = NULL;
+	int i = 0;
 
-			UCCP_DEBUG_IF("After DEC: outstanding cmd: %d\n",
-				     cmd_info.outstanding_ctrl_req);
-			pending_cmd = skb_dequeue(&cmd_info.outstanding_cmd);
+	if (dis->reason_code != REASON_NW_LOST)
+		return;
 
-			if (likely(pending_cmd != NULL)) {
-				UCCP_DEBUG_IF("Send 1 outstanding cmd\n");
-				hal_ops.send((void *)pending_cmd, HOST_MOD_ID,
-					     UMAC_MOD_ID, 0);
-				dev->stats->gen_cmd_send_count++;
-			}
+	for (i = 0; i < MAX_VIFS; i++) {
+		if (!(dev->active_vifs & (1 << i)))
+			continue;
+
+		vif = rcu_dereference(dev->vifs[i]);
+
+		if (ether_addr_equal(vif->addr, dis->mac_addr)) {
+			ieee80211_connection_loss(vif);
+			break;
 		}
+	}
+}
+
+
+static void umac_event_mib_stat(struct mac80211_dev *dev,
+				struct lmac_if_data *p,
+				struct sk_buff *skb)
+{
+	uccp420wlan_mib_stats((struct umac_event_mib_stats *)skb->data,
+			      p->context);
+}
+
+
+static void umac_event_mac_stats(struct mac80211_dev *dev,
+				 struct lmac_if_data *p,
+				 struct sk_buff *skb)
+{
+	uccp420wlan_mac_stats((struct umac_event_mac_stats *)skb->data,
+			      p->context);
+}
+
+
+static void umac_event_nw_found(struct mac80211_dev *dev,
+				struct lmac_if_data *p,
+				struct sk_buff *skb)
+{
+	UCCP_DEBUG_IF("received event_found\n");
+}
+
+
+static void umac_event_phy_stat(struct mac80211_dev *dev,
+				struct lmac_if_data *p,
+				struct sk_buff *skb)
+{
+	int i;
+	struct host_event_phy_stats *phy =
+		(struct host_event_phy_stats *)skb->data;
+
+	UCCP_DEBUG_IF("received phy stats event\n");
+	UCCP_DEBUG_IF("phy stats are\n");
+
+	for (i = 0; i < 32; i++)
+		UCCP_DEBUG_IF("%x ", phy->phy_stats[i]);
+
+	UCCP_DEBUG_IF("\n\n\n");
+}
+
+
+static void umac_event_noa(struct mac80211_dev *dev,
+			   struct lmac_if_data *p,
+			   struct sk_buff *skb)
+{
+	uccp420wlan_noa_event(FROM_EVENT_NOA, (void *)skb->data,
+			      p->context, NULL);
+}
+
+
+static void umac_event_proc_done(struct mac80211_dev *dev,
+				 struct lmac_if_data *p,
+				 struct sk_buff *skb)
+{
+	/*struct host_event_command_complete *cmd =
+	 * (struct host_event_command_complete*)buff;
+	 */
+	UCCP_DEBUG_IF("Received  PROC_DONE\n");
+	ctrl_cmd_done(dev, p->name);
+}
+
+
+static void umac_event_ch_prog_done(struct mac80211_dev *dev,
+				    struct lmac_if_data *p,
+				    struct sk_buff *skb)
+{
+	uccp420wlan_ch_prog_complete(UMAC_EVENT_CH_PROG_DONE,
+		(struct umac_event_ch_prog_complete *)skb->data, p->context);
+}
+
+
+static void umac_event_radar(struct mac80211_dev *dev,
+			     struct lmac_if_data *p,
+			     struct sk_buff *skb)
+{
+	ieee80211_radar_detected(dev->hw);
+}
+
+
+static void umac_event_rf_calib(struct mac80211_dev *dev,
+				struct lmac_if_data *p,
+				struct sk_buff *skb)
+{
+	uccp420wlan_rf_calib_data((struct umac_event_rf_calib_data *)skb->data,
+				  p->context);
+}
 
-		spin_unlock_bh(&cmd_info.control_path_lock);
-	} else if (event == UMAC_EVENT_SCAN_ABORT_COMPLETE) {
-		dev->scan_abort_done = 1;
-#ifdef CONFIG_PM
-	} else if (event == UMAC_EVENT_PS_ECON_CFG_DONE) {
-		struct umac_event_ps_econ_cfg_complete *econ_cfg_complete_data =
-				(struct umac_event_ps_econ_cfg_complete *)buff;
-		dev->econ_ps_cfg_stats.completed = 1;
-		dev->econ_ps_cfg_stats.result = econ_cfg_complete_data->status;
-		rx_interrupt_status = 0;
-	} else if (event == UMAC_EVENT_PS_ECON_WAKE) {
-		struct umac_event_ps_econ_wake *econ_wake_data =
-					(struct umac_event_ps_econ_wake *)buff;
-		dev->econ_ps_cfg_stats.wake_trig = econ_wake_data->trigger;
-#endif
-	} else if (event == UMAC_EVENT_SCAN_COMPLETE) {
-		uccp420wlan_scan_complete(p->context,
-			(struct host_event_scanres *) buff,
-			buff +  sizeof(struct host_event_scanres), skb->len);
-
-	} else if (event == UMAC_EVENT_RX) {
-		if (dev->params->production_test) {
-			dev->stats->rx_packet_data_count++;
-			dev_kfree_skb_any(skb);
-		} else {
-			uccp420wlan_rx_frame(skb, p->context);
 
+static void umac_event_roc_status(struct mac80211_dev *dev,
+				  struct lmac_if_data *p,
+				  struct sk_buff *skb)
+{
+	struct umac_event_roc_status *roc_status = (void *)skb->data;
+	struct delayed_work *work = NULL;
+
+	UCCP_DEBUG_ROC("%s:%d ROC status is %d\n",
+		__func__, __LINE__, roc_status->roc_status);
+
+	switch (roc_status->roc_status) {
+	case UMAC_ROC_STAT_STARTED:
+		if (dev->roc_params.roc_in_progress == 0) {
+			dev->roc_params.roc_in_progress = 1;
+			ieee80211_ready_on_channel(dev->hw);
+			chan_op_hist_update(dev, CHAN_OP_ROC_START,
+					    dev->roc_params.start_ts);
+			UCCP_DEBUG_ROC("%s-UMACIF: ROC READY..\n",
+				  dev->name);
 		}
+		break;
+	case UMAC_ROC_STAT_DONE:
+	case UMAC_ROC_STAT_STOPPED:
+		if (dev->roc_params.roc_in_progress == 1) {
+			dev->roc_params.stop_ts = ktime_get();
+			work = &dev->roc_complete_work;
+			ieee80211_queue_delayed_work(dev->hw,
+						     work,
+						     0);
+		}
+		break;
+	}
+}
 
-	} else if (event == UMAC_EVENT_TX_DONE) {
-		if (dev->params->production_test &&
-		    dev->params->start_prod_mode)
-			uccp420wlan_proc_tx_complete((void *)buff,
-						     p->context);
-		else {
-			/* Increment tx_done_recv_count to keep track of number
-			 * of tx_done received do not count tx dones from host.
-			 */
-			dev->stats->tx_done_recv_count++;
 
 #ifdef MULTI_CHAN_SUPPORT
-			spin_lock(&dev->chanctx_lock);
-			curr_chanctx_idx = dev->curr_chanctx_idx;
-			spin_unlock(&dev->chanctx_lock);
+static void umac_event_chan_switch(struct mac80211_dev *dev,
+				   struct lmac_if_data *p,
+				   struct sk_buff *skb)
+{
+	uccp420wlan_proc_ch_sw_event((void *)skb->data,
+				     p->context);
+}
+#endif
+
+
+static void umac_event_tx_deinit_done(struct mac80211_dev *dev,
+				      struct lmac_if_data *p,
+				      struct sk_buff *skb)
+{
+	complete(&dev->tx_deinit_complete);
+}
+
+
+static void umac_event_fw_error(struct mac80211_dev *dev,
+				struct lmac_if_data *p,
+				struct sk_buff *skb)
+{
+	pr_err("%s: FW is in Error State, please reload.\n", __func__);
+}
+
+
+/* Events with no handler here are reported as unknown. Handlers that take
+ * ownership of the skb set owns_skb, the rest have it freed after return.
+ */
+static const struct umac_event_desc {
+	const char *name;
+	void (*handler)(struct mac80211_dev *dev,
+			struct lmac_if_data *p,
+			struct sk_buff *skb);
+	bool owns_skb;
+} umac_events[UMAC_EVENT_NUM] = {
+	[UMAC_EVENT_RX] = { "rx", umac_event_rx, true },
+	[UMAC_EVENT_TX_DONE] = { "tx_done", umac_event_tx_done },
+	[UMAC_EVENT_DISCONNECTED] = { "disconnected",
+				      umac_event_disconnected },
+	[UMAC_EVENT_SCAN_COMPLETE] = { "scan_complete",
+				       umac_event_scan_complete },
+	[UMAC_EVENT_SCAN_ABORT_COMPLETE] = { "scan_abort",
+					     umac_event_scan_abort },
+	[UMAC_EVENT_RESET_COMPLETE] = { "reset_complete",
+					umac_event_reset_complete },
+	[UMAC_EVENT_MIB_STAT] = { "mib_stat", umac_event_mib_stat },
+	[UMAC_EVENT_PHY_STAT] = { "phy_stat", umac_event_phy_stat },
+	[UMAC_EVENT_NW_FOUND] = { "nw_found", umac_event_nw_found },
+	[UMAC_EVENT_NOA] = { "noa", umac_event_noa },
+	[UMAC_EVENT_COMMAND_PROC_DONE] = { "proc_done",
+					   umac_event_proc_done },
+	[UMAC_EVENT_CH_PROG_DONE] = { "ch_prog_done",
+				      umac_event_ch_prog_done },
+#ifdef CONFIG_PM
+	[UMAC_EVENT_PS_ECON_CFG_DONE] = { "econ_cfg_done",
+					  umac_event_econ_cfg_done },
+	[UMAC_EVENT_PS_ECON_WAKE] = { "econ_wake", umac_event_econ_wake },
 #endif
-			uccp420wlan_tx_complete((void *)buff,
+	[UMAC_EVENT_MAC_STATS] = { "mac_stats", umac_event_mac_stats },
+	[UMAC_EVENT_RF_CALIB_DATA] = { "rf_calib", umac_event_rf_calib },
+	[UMAC_EVENT_RADAR_DETECTED] = { "radar", umac_event_radar },
+	[UMAC_EVENT_ROC_STATUS] = { "roc_status", umac_event_roc_status },
 #ifdef MULTI_CHAN_SUPPORT
-						curr_chanctx_idx,
+	[UMAC_EVENT_CHAN_SWITCH] = { "chan_switch", umac_event_chan_switch },
 #endif
-						p->context);
-		}
+	[UMAC_EVENT_FW_ERROR] = { "fw_error", umac_event_fw_error },
+	[UMAC_EVENT_TX_DEINIT_DONE] = { "tx_deinit_done",
+					umac_event_tx_deinit_done },
+};
 
-		cmd_info.tx_done_recv_count++;
-	} else if (event == UMAC_EVENT_DISCONNECTED) {
-		struct host_event_disconnect *dis =
-			(struct host_event_disconnect *)buff;
-		struct mac80211_dev *dev = (struct mac80211_dev *)p->context;
-		struct ieee80211_vif *vif = NULL;
-		int i = 0;
-
-		if (dis->reason_code == REASON_NW_LOST) {
-			for (i = 0; i < MAX_VIFS; i++) {
-				if (!(dev->active_vifs & (1 << i)))
-					continue;
-
-				vif = rcu_dereference(dev->vifs[i]);
-
-				if (ether_addr_equal(vif->addr,
-						     dis->mac_addr)) {
-					ieee80211_connection_loss(vif);
-					break;
-				}
-			}
-		}
-	} else if (event == UMAC_EVENT_MIB_STAT) {
-		struct umac_event_mib_stats  *mib_stats =
-			(struct umac_event_mib_stats *) buff;
-
-		uccp420wlan_mib_stats(mib_stats, p->context);
-	} else if (event == UMAC_EVENT_MAC_STATS) {
-		struct umac_event_mac_stats  *mac_stats =
-			(struct umac_event_mac_stats *) buff;
-
-		uccp420wlan_mac_stats(mac_stats, p->context);
-	} else if (event == UMAC_EVENT_NW_FOUND) {
-		UCCP_DEBUG_IF("received event_found\n");
-	} else if (event == UMAC_EVENT_PHY_STAT) {
-		int i;
-		struct host_event_phy_stats *phy =
-			(struct host_event_phy_stats *)buff;
-		UCCP_DEBUG_IF("received phy stats event\n");
-		UCCP_DEBUG_IF("phy stats are\n");
-
-		for (i = 0; i < 32; i++)
-			UCCP_DEBUG_IF("%x ", phy->phy_stats[i]);
-
-		UCCP_DEBUG_IF("\n\n\n");
-	} else if (event == UMAC_EVENT_NOA) {
-		uccp420wlan_noa_event(FROM_EVENT_NOA, (void *)buff,
-				      p->context, NULL);
-
-	} else if (event == UMAC_EVENT_COMMAND_PROC_DONE) {
-		/*struct host_event_command_complete *cmd =
-		 * (struct host_event_command_complete*)buff;
-		 */
-		UCCP_DEBUG_IF("Received  PROC_DONE\n");
 
-		spin_lock_bh(&cmd_info.control_path_lock);
+const char *uccp420wlan_event_name(unsigned int event)
+{
+	if (event >= UMAC_EVENT_NUM || !umac_events[event].name)
+		return "unknown";
 
-		if (cmd_info.outstanding_ctrl_req == 0) {
-			pr_err("%s-UMACIF: Unexpected: Spurious proc_done received. Ignoring and continuing\n",
-			       p->name);
-		} else {
-			cmd_info.outstanding_ctrl_req--;
+	return umac_events[event].name;
+}
 
-			UCCP_DEBUG_IF("After DEC: outstanding cmd: %d\n",
-				     cmd_info.outstanding_ctrl_req);
 
-			pending_cmd = skb_dequeue(&cmd_info.outstanding_cmd);
+int uccp420wlan_msg_handler(void *nbuff,
+			    unsigned char sender_id)
+{
+	unsigned int event;
+	struct host_mac_msg_hdr *hdr;
+	struct lmac_if_data *p;
+	struct sk_buff *skb = (struct sk_buff *)nbuff;
+	struct mac80211_dev *dev;
+	const struct umac_event_desc *desc = NULL;
+	ktime_t start;
+	s64 delta_ns;
 
-			if (unlikely(pending_cmd != NULL)) {
-				UCCP_DEBUG_IF("Send 1 outstanding cmd\n");
-				hal_ops.send((void *)pending_cmd, HOST_MOD_ID,
-					     UMAC_MOD_ID, 0);
-				dev->stats->gen_cmd_send_count++;
-			}
-		}
-		spin_unlock_bh(&cmd_info.control_path_lock);
+	rcu_read_lock();
 
-	} else if (event == UMAC_EVENT_CH_PROG_DONE) {
-		uccp420wlan_ch_prog_complete(event,
-			(struct umac_event_ch_prog_complete *)buff, p->context);
-	} else if (event == UMAC_EVENT_RADAR_DETECTED) {
-		ieee80211_radar_detected(dev->hw);
-	} else if (event == UMAC_EVENT_RF_CALIB_DATA) {
-		struct umac_event_rf_calib_data  *rf_data = (void *)buff;
-
-		uccp420wlan_rf_calib_data(rf_data, p->context);
-	} else if (event == UMAC_EVENT_ROC_STATUS) {
-		struct umac_event_roc_status *roc_status = (void *)buff;
-		struct delayed_work *work = NULL;
-
-		UCCP_DEBUG_ROC("%s:%d ROC status is %d\n",
-			__func__, __LINE__, roc_status->roc_status);
-
-		switch (roc_status->roc_status) {
-		case UMAC_ROC_STAT_STARTED:
-			if (dev->roc_params.roc_in_progress == 0) {
-				dev->roc_params.roc_in_progress = 1;
-				ieee80211_ready_on_channel(dev->hw);
-				UCCP_DEBUG_ROC("%s-UMACIF: ROC READY..\n",
-					  dev->name);
-			}
-			break;
-		case UMAC_ROC_STAT_DONE:
-		case UMAC_ROC_STAT_STOPPED:
-			if (dev->roc_params.roc_in_progress == 1) {
-				work = &dev->roc_complete_work;
-				ieee80211_queue_delayed_work(dev->hw,
-							     work,
-							     0);
-			}
-			break;
-		}
-#ifdef MULTI_CHAN_SUPPORT
-	} else if (event == UMAC_EVENT_CHAN_SWITCH) {
-		uccp420wlan_proc_ch_sw_event((void *)buff,
-					     p->context);
+	p = (struct lmac_if_data *)(rcu_dereference(lmac_if));
 
-#endif
-	} else if (event == UMAC_EVENT_TX_DEINIT_DONE) {
-		dev->tx_deinit_complete = 1;
-	} else if (event == UMAC_EVENT_FW_ERROR) {
-		pr_err("%s: FW is in Error State, please reload.\n", __func__);
-	} else {
+	if (!p) {
+		WARN_ON(1);
+		dev_kfree_skb_any(skb);
+		rcu_read_unlock();
+		return 0;
+	}
+
+	hdr = (struct host_mac_msg_hdr *)skb->data;
+
+	event = hdr->id & 0xffff;
+
+	dev = (struct mac80211_dev *)p->context;
+
+	if (event < UMAC_EVENT_NUM && umac_events[event].handler)
+		desc = &umac_events[event];
+
+	if (!desc) {
 		pr_warn("%s: Unknown event received %d\n", __func__, event);
+		dev->stats->event_unknown++;
+		dev_kfree_skb_any(skb);
+		rcu_read_unlock();
+		return 0;
 	}
 
-	if (event != UMAC_EVENT_RX)
+	/* UCCP_DEBUG_IF("%s-UMACIF: event %d received\n", p->name, event); */
+	start = ktime_get();
+
+	desc->handler(dev, p, skb);
+
+	if (!desc->owns_skb)
 		dev_kfree_skb_any(skb);
 
+	delta_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	dev->stats->event_cnt[event]++;
+	dev->stats->event_ns[event] += delta_ns;
+
+	if (delta_ns > dev->stats->event_max_ns[event])
+		dev->stats->event_max_ns[event] = delta_ns;
+
 	rcu_read_unlock();
 
 	return 0;
@@ -2479,13 +3726,22 @@ int uccp420wlan_lmac_if_init(void *context, const char *name)
 	if (!p)
 		return -ENOMEM;
 
+	if (cmd_pool_init()) {
+		cmd_pool_deinit();
+		kfree(p);
+		return -ENOMEM;
+	}
+
 	p->name = (char *)name;
 	p->context = context;
 	hal_ops.register_callback(uccp420wlan_msg_handler, UMAC_MOD_ID);
 	rcu_assign_pointer(lmac_if, p);
 	skb_queue_head_init(&cmd_info.outstanding_cmd);
 	spin_lock_init(&cmd_info.control_path_lock);
+	fw_shadow_reset();
 	cmd_info.outstanding_ctrl_req = 0;
+	cmd_info.cmd_in_flight = 0;
+	cmd_info.cmd_done_seq = cmd_info.cmd_seq;
 
 	return 0;
 }
@@ -2501,6 +3757,7 @@ void uccp420wlan_lmac_if_deinit(void)
 	rcu_assign_pointer(lmac_if, NULL);
 	synchronize_rcu();
 	kfree(p);
+	cmd_pool_deinit();
 }
 
 
@@ -2508,6 +3765,7 @@ void uccp420_lmac_if_free_outstnding(void)
 {
 
 	struct sk_buff *skb;
+	int index;
 
 	/* First free the outstanding commands, we are not sending
 	 * anymore commands to the FW except RESET.
@@ -2515,5 +3773,10 @@ void uccp420_lmac_if_free_outstnding(void)
 	while ((skb = __skb_dequeue(&cmd_info.outstanding_cmd)))
 		dev_kfree_skb_any(skb);
 
+	for (index = 0; index < MAX_VIFS; index++)
+		vif_cfg_batch[index].changed_bitmap = 0;
+
 	cmd_info.outstanding_ctrl_req = 0;
+	cmd_info.cmd_in_flight = 0;
+	cmd_info.cmd_done_seq = cmd_info.cmd_seq;
 }